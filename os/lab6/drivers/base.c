@@ -1,4 +1,5 @@
 #include <device.h>
+#include <mm.h>
 
 uint64_t device_table_get_hash(struct hash_table_node *node) {
     struct device *dev = container_of(node, struct device, hash_node);
@@ -19,8 +20,11 @@ struct hash_table device_table = {
     .is_equal = device_table_is_equal
 };
 
+struct kmem_cache *device_cache;
+
 void init_device_table() {
     hash_table_init(&device_table);
+    device_cache = kmem_cache_create("device", sizeof(struct device), 0, NULL);
 }
 
 uint32_t device_table_get_major_num(uint32_t major) {
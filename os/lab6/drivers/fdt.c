@@ -22,7 +22,7 @@ void fdt_match_drivers_by_node(const struct fdt_header *fdt, struct fdt_node_hea
                 const char * driver_match_str = match_table.compatible;
                 if (!driver_match_str) break;
                 if (!strcmp(driver_match_str, device_compatible)) {
-                    struct device *dev = kmalloc(sizeof(struct device));
+                    struct device *dev = kmem_cache_alloc(device_cache);
                     dev->match_data = match_table.match_data;
                     dev->fdt = (struct fdt_header *)fdt;
                     dev->fdt_node = node;
@@ -56,7 +56,7 @@ void fdt_loader(const struct fdt_header *fdt, struct device_driver *driver_list[
         return;
     }
 
-    struct device *dev = kmalloc(sizeof(struct device));
+    struct device *dev = kmem_cache_alloc(device_cache);
     device_init(dev);
     fdt_mem.resource_start = (uint64_t)fdt;
     fdt_mem.resource_end = fdt_mem.resource_start + 2 * PAGE_SIZE;
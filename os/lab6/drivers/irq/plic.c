@@ -1,4 +1,5 @@
 #include <mm.h>
+#include <smp.h>
 #include <device/irq/plic.h>
 
 struct plic_match_data *match_info = NULL;
@@ -15,16 +16,24 @@ struct driver_resource plic_mmio_res = {
     .resource_type = DRIVER_RESOURCE_MEM
 };
 
+/*
+ * hart 的 S-mode 中断上下文编号。
+ * QEMU virt 中每个 hart 有 M-mode、S-mode 两个上下文，S-mode 上下文为 hart_id * 2 + 1。
+ */
+static inline uint32_t plic_context(uint32_t hart_id) {
+    return hart_id * 2 + 1;
+}
+
 void plic_enable_irq(struct device *dev, uint32_t hart_id, uint32_t irq_id) {
     uint64_t reg_addr = plic_mmio_res.map_address +
-        PLIC_ENABLE_BASE + (hart_id * 2 + 1) * PLIC_ENABLE_STRIDE + 
+        PLIC_ENABLE_BASE + plic_context(hart_id) * PLIC_ENABLE_STRIDE + 
         (irq_id / 32) * 4;
     *((volatile uint32_t *)reg_addr) |= (1 << (irq_id % 32));
 }
 
 void plic_disable_irq(struct device *dev, uint32_t hart_id, uint32_t irq_id) {
     uint64_t reg_addr = plic_mmio_res.map_address +
-        PLIC_ENABLE_BASE + (hart_id * 2 + 1) * PLIC_ENABLE_STRIDE + 
+        PLIC_ENABLE_BASE + plic_context(hart_id) * PLIC_ENABLE_STRIDE + 
         (irq_id / 32) * 4;
     *((volatile uint32_t *)reg_addr) &= ~(1 << (irq_id % 32));
 }
@@ -38,20 +47,20 @@ void plic_set_priority(struct device *dev, uint32_t irq_id, uint32_t priority) {
 
 void plic_set_threshold(struct device *dev, uint32_t hart_id, uint32_t threshold) {
     uint64_t reg_addr = plic_mmio_res.map_address +
-        PLIC_CONTEXT_BASE + (hart_id * 2 + 1) * PLIC_CONTEXT_STRIDE + PLIC_THRESHOLD_OFFSET;
+        PLIC_CONTEXT_BASE + plic_context(hart_id) * PLIC_CONTEXT_STRIDE + PLIC_THRESHOLD_OFFSET;
     *((volatile uint32_t *)reg_addr) =
         (threshold > match_info->num_priorities ? match_info->num_priorities - 1 : threshold);
 }
 
 uint32_t plic_get_claim(uint32_t hart_id) {
     uint64_t reg_addr = plic_mmio_res.map_address +
-        PLIC_CONTEXT_BASE + (hart_id * 2 + 1) * PLIC_CONTEXT_STRIDE + PLIC_CLAIM_OFFSET;
+        PLIC_CONTEXT_BASE + plic_context(hart_id) * PLIC_CONTEXT_STRIDE + PLIC_CLAIM_OFFSET;
     return *((volatile uint32_t *)reg_addr);
 }
 
 void plic_complete(uint32_t hart_id, uint32_t irq_id) {
     uint64_t reg_addr = plic_mmio_res.map_address +
-        PLIC_CONTEXT_BASE + (hart_id * 2 + 1) * PLIC_CONTEXT_STRIDE + PLIC_COMPLETE_OFFSET;
+        PLIC_CONTEXT_BASE + plic_context(hart_id) * PLIC_CONTEXT_STRIDE + PLIC_COMPLETE_OFFSET;
     *((volatile uint32_t *)reg_addr) = irq_id;
 }
 
@@ -67,6 +76,7 @@ uint64_t plic_handler_is_equal(struct hash_table_node *nodeA, struct hash_table_
 }
 
 struct hash_table_node plic_handler_buffer[PLIC_HANDLER_BUFFER_LENGTH];
+static struct kmem_cache *plic_handler_cache;
 struct hash_table plic_handler_table = {
     .buffer = plic_handler_buffer,
     .buffer_length = PLIC_HANDLER_BUFFER_LENGTH,
@@ -75,22 +85,24 @@ struct hash_table plic_handler_table = {
 };
 
 void plic_set_handler(struct device *dev, uint32_t hart_id, uint32_t irq_id, struct irq_descriptor* descriptor) {
-    struct plic_handler *handler = kmalloc(sizeof(struct plic_handler));
+    struct plic_handler *handler = kmem_cache_alloc(plic_handler_cache);
     handler->irq_id = irq_id;
     handler->descriptor = descriptor;
     hash_table_set(&plic_handler_table, &handler->hash_node);
     plic_enable_irq(dev, hart_id, irq_id);
 }
 
+/* 外部中断只发送给启动处理器，但在哪个 hart 上处理就向哪个 hart 的上下文 claim/complete */
 void plic_interrupt_handle(struct device *dev) {
-    uint32_t irq_id = plic_get_claim(0);
+    uint32_t hart_id = this_cpu()->hartid;
+    uint32_t irq_id = plic_get_claim(hart_id);
     struct plic_handler tmp = {
         .irq_id = irq_id
     };
     struct hash_table_node *hash_node = hash_table_get(&plic_handler_table, &tmp.hash_node);
     struct plic_handler *handler = container_of(hash_node, struct plic_handler, hash_node);
     if(handler) handler->descriptor->handler(handler->descriptor->dev);
-    plic_complete(0, irq_id);
+    plic_complete(hart_id, irq_id);
 }
 
 void plic_device_init(struct device *dev) {
@@ -100,10 +112,11 @@ void plic_device_init(struct device *dev) {
     device_add_resource(dev, &plic_mmio_res);
 
     hash_table_init(&plic_handler_table);
+    plic_handler_cache = kmem_cache_create("plic_handler", sizeof(struct plic_handler), 0, NULL);
 
-    plic_set_threshold(dev, 0, 0);
+    plic_set_threshold(dev, boot_hartid(), 0);
     for (uint32_t i = 0; i < match_info->num_sources; i += 1) {
-        plic_disable_irq(dev, 0, i);
+        plic_disable_irq(dev, boot_hartid(), i);
         plic_set_priority(dev, i, 1);
     }
 }
@@ -1,16 +1,19 @@
+#include <assert.h>
 #include <mm.h>
 #include <device.h>
 
-#define DRIVER_MEM_START 0xCC000000
-uint64_t mem_resource_ptr = DRIVER_MEM_START;
+uint64_t mem_resource_ptr = DEVICE_ADDRESS;
 
 void mem_resource_map(struct driver_resource *res) {
     uint64_t map_start = FLOOR(res->resource_start);
     uint64_t map_end = CEIL(res->resource_end);
+    uint64_t size = map_end - map_start;
+    // 虚拟地址与物理地址相对大页边界的偏移相同，map_range() 才能使用大页。
+    // 设备映射区的二级页表已由 map_kernel() 预先分配，不能使用 1G 大页，最多按 2M 对齐
+    uint64_t align = size >= MEGA_PAGE_SIZE ? MEGA_PAGE_SIZE : PAGE_SIZE;
+    mem_resource_ptr += (map_start - mem_resource_ptr) & (align - 1);
+    assert(mem_resource_ptr + size <= KERNEL_END, "mem_resource_map(): device window exhausts");
     res->map_address = mem_resource_ptr;
-    while (map_start < map_end) {
-        put_page(map_start, mem_resource_ptr, KERN_RW | PAGE_VALID);
-        map_start += PAGE_SIZE;
-        mem_resource_ptr += PAGE_SIZE;
-    }
+    map_range(map_start, mem_resource_ptr, size, KERN_RW | PAGE_GLOBAL | PAGE_VALID);
+    mem_resource_ptr += size;
 }
@@ -3,6 +3,7 @@
 #include <kdebug.h>
 #include <riscv.h>
 #include <sched.h>
+#include <utils/atomic.h>
 
 struct driver_resource uart8250_mmio_res = {
     .resource_start = 0x10000000,
@@ -16,9 +17,14 @@ uint64_t uart8250_rx_buffer_start = 0;
 uint64_t uart8250_rx_buffer_end = 0;
 uint64_t uart8250_rx_buffer_empty = 1;
 struct task_struct *uart8250_rx_buffer_wait = NULL;
+/* 保护接收缓冲区和等待队列，中断处理程序可能在其他处理器上运行 */
+static struct spinlock uart8250_rx_lock;
+/* 保护发送寄存器，多个处理器上的进程可能同时输出 */
+static struct spinlock uart8250_tx_lock;
 
 void uart8250_rx_irq_handler(struct device *dev) {
     struct uart_qemu_regs *regs = (struct uart_qemu_regs *)uart8250_mmio_res.map_address;
+    acquire_lock(&uart8250_rx_lock);
     wake_up(&uart8250_rx_buffer_wait);
     while (regs->LSR & (1 << LSR_DR)) {
         uart8250_rx_buffer_empty = 0;
@@ -33,6 +39,7 @@ void uart8250_rx_irq_handler(struct device *dev) {
             uart8250_rx_buffer_start = (uart8250_rx_buffer_start + 1) % UART8250_BUFF_LEN;
         }
     }
+    release_lock(&uart8250_rx_lock);
 }
 
 struct irq_descriptor uart8250_rx_irq = {
@@ -43,6 +50,8 @@ struct irq_descriptor uart8250_rx_irq = {
 void uart8250_init(struct device *dev) {
     device_add_resource(dev, &uart8250_mmio_res);
     struct uart_qemu_regs *regs = (struct uart_qemu_regs *)uart8250_mmio_res.map_address;
+    init_lock(&uart8250_rx_lock, "uart8250_rx");
+    init_lock(&uart8250_tx_lock, "uart8250_tx");
 
     regs->IER_DLM = 0; // 关闭 16550a 的所有中断，避免初始化未完成就发生中断
     while(!(regs->LSR & (1 << LSR_THRE))); // 等待发送缓冲区为空
@@ -58,27 +67,31 @@ void uart8250_init(struct device *dev) {
     regs->IIR_FCR |= 0b00000001; // 设置 FCR[TL]=00，设置中断阈值为 1 字节，设置 FCR[FIFOE]=1，启动 FIFO
     regs->IER_DLM |= 1 << IER_ERBFI; // 设置 IER，启用接收数据时发生的中断
 
-    irq_add(0, 0x0a, &uart8250_rx_irq);
+    irq_add(boot_hartid(), 0x0a, &uart8250_rx_irq);
 }
 
 uint64_t uart8250_request(struct device *dev, void *buffer, uint64_t size, uint64_t is_read) {
     char *char_buffer = (char *)buffer;
     if (is_read) {
+        uint64_t flags = acquire_lock_irqsave(&uart8250_rx_lock);
         for (uint64_t i = 0; i < size; i += 1) {
-            if (uart8250_rx_buffer_empty) sleep_on(&uart8250_rx_buffer_wait);
+            while (uart8250_rx_buffer_empty) sleep_on_lock(&uart8250_rx_buffer_wait, &uart8250_rx_lock);
             char_buffer[i] = uart8250_rx_buffer[uart8250_rx_buffer_start];
             uart8250_rx_buffer_start = (uart8250_rx_buffer_start + 1) % UART8250_BUFF_LEN;
             if (uart8250_rx_buffer_start == uart8250_rx_buffer_end) { // empty
                 uart8250_rx_buffer_empty = 1;
             }
         }
+        release_lock_irqrestore(&uart8250_rx_lock, flags);
         return size;
     } else {// !is_read
         struct uart_qemu_regs *regs = (struct uart_qemu_regs *)uart8250_mmio_res.map_address;
+        uint64_t flags = acquire_lock_irqsave(&uart8250_tx_lock);
         for (uint64_t i = 0; i < size; i += 1) {
             while (!(regs->LSR & (1 << LSR_THRE)));
             regs->RBR_THR_DLL = char_buffer[i];
         }
+        release_lock_irqrestore(&uart8250_tx_lock, flags);
         return size;
     }
 }
@@ -4,7 +4,9 @@
 #include <kdebug.h>
 #include <assert.h>
 #include <sched.h>
+#include <clock.h>
 #include <mm.h>
+#include <utils/atomic.h>
 
 uint64_t virtio_blk_get_hash(struct hash_table_node *node) {
     struct virtio_blk_qmap *qmap = container_of(node, struct virtio_blk_qmap, hash_node);
@@ -18,6 +20,17 @@ uint64_t virtio_blk_is_equal(struct hash_table_node *nodeA, struct hash_table_no
 }
 
 #define VIRTIO_BLK_BUFFER_LENGTH 13
+
+// 请求超时未完成，设备可能出现故障，在时钟中断中报告
+static void virtio_blk_timeout(struct timer_list *timer) {
+    struct virtio_blk_qmap *qmap = container_of(timer, struct virtio_blk_qmap, timeout);
+    kprintf("virtio_blk: request for sector %u not completed in %u ms\n",
+            qmap->request->sector, VIRTIO_BLK_TIMEOUT * 1000 / HZ);
+}
+
+static struct kmem_cache *virtio_blk_data_cache;
+/* 保护请求队列和 virtio_blk_table，中断处理程序可能在其他处理器上运行 */
+static struct spinlock virtio_blk_lock;
 struct hash_table_node virtio_blk_buffer[VIRTIO_BLK_BUFFER_LENGTH];
 struct hash_table virtio_blk_table = {
     .buffer = virtio_blk_buffer,
@@ -31,6 +44,7 @@ void virtio_block_irq_handler(struct device *dev) {
     struct virtq *virtio_blk_queue = &data->virtio_blk_queue;
     uint32_t interrupt_status = data->virtio_device->interrupt_status;
 
+    acquire_lock(&virtio_blk_lock);
     struct virtq_used_elem *used_elem = virtq_get_used_elem(virtio_blk_queue);
     while (used_elem) {
         struct virtio_blk_qmap qmap_search = {
@@ -43,6 +57,7 @@ void virtio_block_irq_handler(struct device *dev) {
         hash_table_del(&virtio_blk_table, &qmap->hash_node);
         used_elem = virtq_get_used_elem(virtio_blk_queue);
     }
+    release_lock(&virtio_blk_lock);
     data->virtio_device->interrupt_ack = interrupt_status;
 }
 
@@ -104,6 +119,7 @@ void virtio_block_request(struct device *dev, struct block_request *request) {
     };
 
     uint16_t idx, head;
+    uint64_t flags = acquire_lock_irqsave(&virtio_blk_lock);
     head = idx = virtq_get_desc(virtio_blk_queue);
     assert(idx != 0xff);
     virtio_blk_queue->desc[idx].addr = PHYSICAL(((uint64_t)&req));
@@ -126,11 +142,17 @@ void virtio_block_request(struct device *dev, struct block_request *request) {
         .request = request
     };
     hash_table_set(&virtio_blk_table, &qmap.hash_node);
+    init_timer(&qmap.timeout, virtio_blk_timeout);
+    mod_timer(&qmap.timeout, get_jiffies() + VIRTIO_BLK_TIMEOUT);
     
     virtq_put_avail(virtio_blk_queue, head);
     device->queue_notify = 0;
 
-    sleep_on(&request->wait_queue);
+    /* 持有锁直到进入睡眠，完成中断不会在睡眠之前唤醒 */
+    sleep_on_lock(&request->wait_queue, &virtio_blk_lock);
+    release_lock_irqrestore(&virtio_blk_lock, flags);
+    /* qmap 在内核栈上，返回前确保超时定时器不在时间轮中 */
+    del_timer_sync(&qmap.timeout);
 }
 
 struct block_device virtio_block_device = {
@@ -143,7 +165,11 @@ void *virtio_block_get_interface(struct device *dev, uint64_t flag) {
 }
 
 void virtio_block_init(struct device *dev, struct virtio_device *device, uint64_t is_legacy) {
-    struct virtio_blk_data *data = kmalloc(sizeof(struct virtio_blk_data));
+    if (!virtio_blk_data_cache) {
+        virtio_blk_data_cache = kmem_cache_create("virtio_blk_data", sizeof(struct virtio_blk_data), 0, NULL);
+        init_lock(&virtio_blk_lock, "virtio_blk");
+    }
+    struct virtio_blk_data *data = kmem_cache_alloc(virtio_blk_data_cache);
     memset(data, 0, sizeof(struct virtio_blk_data));
     data->virtio_device = device;
     device_set_data(dev, data);
@@ -155,7 +181,7 @@ void virtio_block_init(struct device *dev, struct virtio_device *device, uint64_
     struct fdt_property *prop = fdt_get_prop(fdt, node, "interrupts");
     uint32_t irq_id = fdt_get_prop_num_value(prop, 0);
     virtio_block_irq.dev = dev;
-    irq_add(0, irq_id, &virtio_block_irq);
+    irq_add(boot_hartid(), irq_id, &virtio_block_irq);
 }
 
 uint64_t virtio_block_device_probe(struct device *dev, struct virtio_device *device, uint64_t is_legacy) {
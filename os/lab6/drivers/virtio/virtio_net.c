@@ -75,8 +75,8 @@ void virtio_net_test(struct virtio_device *device) {
         0x00, 0x0c, 0x1e, 0x6c, // UDP length 12(8 + 4)
         0x74, 0x65, 0x73, 0x74  // payload "test"
     };
-    uint8_t bufferA[2000];
-    uint8_t bufferB[2000];
+    uint8_t *bufferA = kmalloc(2000);
+    uint8_t *bufferB = kmalloc(2000);
     uint8_t *buffer;
     uint64_t buffer_idx = 0;
 
@@ -45,18 +45,16 @@ struct virtq_used_elem* virtq_get_used_elem(struct virtq *vq) {
 }
 
 void virtio_queue_init(struct virtq* virtio_queue, uint64_t is_legacy) {
-    uint64_t virtq_legacy_mem = get_free_page();
-    uint64_t virtq_phy_addr = get_free_page();
+    /* Each legacy virtqueue occupies two or more physically-contiguous pages */
+    uint64_t virtq_phy_addr = is_legacy ? alloc_pages(1) : get_free_page();
     uint64_t virtq_vir_addr = VIRTUAL(virtq_phy_addr);
-    memset((uint8_t *)virtq_vir_addr, 0, VIRTQ_LENGTH);
+    memset((uint8_t *)virtq_vir_addr, 0, is_legacy ? 2 * PAGE_SIZE : VIRTQ_LENGTH);
     virtio_queue->num = VIRTQ_RING_NUM;
     virtio_queue->desc  = (struct virtq_desc *)  (virtq_vir_addr);
     virtio_queue->avail = (struct virtq_avail *) (virtq_vir_addr + VIRTQ_DESC_TABLE_LENGTH);
     if (is_legacy) {
-        /* Each virtqueue occupies two or more physically-contiguous pages */
-        virtio_queue->used  = (struct virtq_used *) VIRTUAL(virtq_legacy_mem);
+        virtio_queue->used  = (struct virtq_used *) (virtq_vir_addr + PAGE_SIZE);
     } else {
-        free_page(virtq_legacy_mem);
         virtio_queue->used  = (struct virtq_used *) (virtq_vir_addr + VIRTQ_DESC_TABLE_LENGTH + VIRTQ_AVAIL_RING_LENGTH);
     }
     virtio_queue->last_used_idx = 0;
@@ -4,7 +4,8 @@
 #include <string.h>
 #include <mm.h>
 
-#define RAMFS_INODE_NUM (PAGE_SIZE / (sizeof(struct ramfs_inode)))
+#define RAMFS_INODE_TABLE_SIZE (4 * PAGE_SIZE)
+#define RAMFS_INODE_NUM (RAMFS_INODE_TABLE_SIZE / (sizeof(struct ramfs_inode)))
 
 struct vfs_inode *ramfs_open_inode(struct vfs_inode *inode) {
     if (inode->inode_idx >= RAMFS_INODE_NUM) return NULL;
@@ -57,7 +58,7 @@ void ramfs_set_inode(struct vfs_interface *fs, void *data, uint64_t length, uint
 }
 
 void ramfs_init_fs(struct vfs_interface *fs) {
-    fs->fs_data = kmalloc(PAGE_SIZE);
+    fs->fs_data = kmalloc(RAMFS_INODE_TABLE_SIZE);
     fs->ref_cnt = 0;
     struct ramfs_inode *inode_list = (struct ramfs_inode *)fs->fs_data;
     for (uint64_t i=0; i < RAMFS_INODE_NUM; i+=1) {
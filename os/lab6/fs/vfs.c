@@ -3,17 +3,35 @@
 
 #include <assert.h>
 #include <mm.h>
+#include <utils/atomic.h>
 
 struct vfs_inode *vfs_root;
+static struct kmem_cache *vfs_inode_cache;
+/* 保护 inode 和文件系统的引用计数以及文件系统的数据，每个 vfs_* 操作在持有锁时完成 */
+/* 不在中断处理程序中使用 */
+static struct spinlock vfs_lock;
 
 void vfs_init() {
+    init_lock(&vfs_lock, "vfs");
+    vfs_inode_cache = kmem_cache_create("vfs_inode", sizeof(struct vfs_inode), 0, NULL);
+    assert(vfs_inode_cache, "vfs_init(): fail to create inode cache");
     ramfs_interface.init_fs(&ramfs_interface);
     vfs_root = ramfs_interface.root;
     vfs_ref_inode(vfs_root);
 }
 
+static void vfs_put_inode(struct vfs_inode *inode) {
+    inode->ref_cnt -= 1;
+    if (!inode->ref_cnt) {
+        inode->fs->close_inode(inode);
+        inode->fs->ref_cnt -= 1;
+        kmem_cache_free(vfs_inode_cache, inode);
+    }
+}
+
 struct vfs_inode *vfs_new_inode(struct vfs_interface *fs, uint64_t inode_idx) {
-    struct vfs_inode *new_inode = kmalloc(sizeof(struct vfs_inode));
+    struct vfs_inode *new_inode = kmem_cache_alloc(vfs_inode_cache);
+    acquire_lock(&vfs_lock);
     new_inode->fs = fs;
     new_inode->fs->ref_cnt += 1;
     new_inode->inode_data = NULL;
@@ -21,38 +39,50 @@ struct vfs_inode *vfs_new_inode(struct vfs_interface *fs, uint64_t inode_idx) {
     new_inode->ref_cnt = 0;
     struct vfs_inode *opened_inode = new_inode->fs->open_inode(new_inode);
     if (!opened_inode) {
-        vfs_free_inode(new_inode);
+        new_inode->ref_cnt = 1;
+        vfs_put_inode(new_inode);
     }
+    release_lock(&vfs_lock);
     return opened_inode;
 }
 
 void vfs_ref_inode(struct vfs_inode *inode) {
+    acquire_lock(&vfs_lock);
     inode->ref_cnt += 1;
+    release_lock(&vfs_lock);
 }
 
 void vfs_free_inode(struct vfs_inode *inode) {
-    inode->ref_cnt -= 1;
-    if (!inode->ref_cnt) {
-        inode->fs->close_inode(inode);
-        inode->fs->ref_cnt -= 1;
-        kfree(inode);
-    }
+    acquire_lock(&vfs_lock);
+    vfs_put_inode(inode);
+    release_lock(&vfs_lock);
 }
 
 struct vfs_stat *vfs_get_stat(struct vfs_inode *inode) {
-    return inode->fs->get_stat(inode);
+    acquire_lock(&vfs_lock);
+    struct vfs_stat *stat = inode->fs->get_stat(inode);
+    release_lock(&vfs_lock);
+    return stat;
 }
 
 uint64_t vfs_is_dir(struct vfs_inode *inode) {
-    return inode->fs->is_dir(inode);
+    acquire_lock(&vfs_lock);
+    uint64_t is_dir = inode->fs->is_dir(inode);
+    release_lock(&vfs_lock);
+    return is_dir;
 }
 
 void vfs_inode_request(struct vfs_inode *inode, void *buffer, uint64_t length, uint64_t offset, uint64_t is_read) {
+    acquire_lock(&vfs_lock);
     inode->fs->inode_request(inode, buffer, length, offset, is_read);
+    release_lock(&vfs_lock);
 }
 
 struct vfs_dir_entry *vfs_inode_dir_entry(struct vfs_inode *inode, uint64_t dir_idx) {
-    return inode->fs->dir_inode(inode, dir_idx);
+    acquire_lock(&vfs_lock);
+    struct vfs_dir_entry *entry = inode->fs->dir_inode(inode, dir_idx);
+    release_lock(&vfs_lock);
+    return entry;
 }
 
 static inline int64_t vfs_pathcmp(const char *path, const char *first_name) {
@@ -97,7 +127,7 @@ struct vfs_inode *vfs_get_inode(const char *path, struct vfs_inode *cwd) {
         }
         if (name_start_p != char_p) { // path = <...>/<name>
             /* TODO: stat check */
-            if (!is_last_name && !now_inode->fs->is_dir(now_inode)) return NULL;
+            if (!is_last_name && !vfs_is_dir(now_inode)) return NULL;
             if (next_inode) { // previous next_inode
                 next_inode = vfs_search_inode_in_dir(now_inode, path + name_start_p);
                 vfs_free_inode(now_inode); // now_inode == (previous) next_inode
@@ -109,7 +139,7 @@ struct vfs_inode *vfs_get_inode(const char *path, struct vfs_inode *cwd) {
         }
         if (is_last_name) {
             if (name_start_p == char_p) { // path = <...>/
-                if (!now_inode->fs->is_dir(now_inode)) {
+                if (!vfs_is_dir(now_inode)) {
                     // (previous) next_inode != NULL == now_inode
                     if (next_inode) vfs_free_inode(now_inode);
                     return NULL;
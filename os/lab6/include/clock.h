@@ -9,9 +9,35 @@
 #include <stddef.h>
 #include <sbi.h>
 
+#define HZ 100  /**< 时钟中断频率 */
+#define CLOCK_FREQ 10000000 /**< 设备树中没有 timebase-frequency 时 time CSR 的默认计数频率，QEMU 为 10MHz */
+
+struct fdt_header;
+
 extern volatile size_t ticks;
+extern uint64_t timebase_freq;
+
+/**
+ * @brief 获取开机后经过的时钟周期数
+ * @return uint64_t
+ */
+static inline uint64_t get_cycles()
+{
+    uint64_t n;
+    __asm__ __volatile__("rdtime %0" : "=r"(n));
+    return n;
+}
 
+void clock_fdt_init(const struct fdt_header *fdt);
 void clock_init();
+void clock_init_hart();
 void clock_set_next_event();
+void clock_program_event(uint64_t next);
+void clock_event_expired();
+uint64_t cycles_to_ns(uint64_t cycles);
+uint64_t ns_to_cycles(uint64_t ns);
+uint64_t get_jiffies();
+uint64_t usecs_to_jiffies(uint64_t us);
+uint64_t sched_clock();
 
 #endif
@@ -48,6 +48,7 @@ struct device_driver {
 
 #define DEVICE_TABLE_BUFFER_LENGTH 11
 extern struct hash_table device_table;
+extern struct kmem_cache *device_cache;
 void init_device_table();
 uint32_t device_table_get_major_num(uint32_t major);
 uint32_t device_table_get_next_minor(uint32_t major, uint32_t minor_start);
@@ -206,6 +206,15 @@ static inline uint32_t fdt_get_prop_num_value(const struct fdt_property *prop, u
     return fdt32_to_cpu(values[idx]);
 }
 
+// 将从第 idx 个 cell 开始的 cells 个 cell 拼接为一个整数（如 reg 属性中的地址和长度）
+static inline uint64_t fdt_get_prop_cells_value(const struct fdt_property *prop, uint32_t idx, uint32_t cells) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < cells; i += 1) {
+        value = (value << 32) | fdt_get_prop_num_value(prop, idx + i);
+    }
+    return value;
+}
+
 static inline const char *fdt_get_prop_str_value(const struct fdt_property *prop, uint32_t offset) {
     const char *str = (const char *)prop->data;
     return str + offset;
@@ -3,6 +3,7 @@
 
 #include <device/virtio/virtio_mmio.h>
 #include <device/block.h>
+#include <timer.h>
 
 #define VIRTIO_BLK_F_BARRIER    (1 << 0)
 #define VIRTIO_BLK_F_SIZE_MAX   (1 << 1)
@@ -19,6 +20,8 @@
 
 #define VIRTIO_BLK_CONFIG_OFFSET 0x100
 
+#define VIRTIO_BLK_TIMEOUT (5 * HZ)  // 请求超过该时长（jiffies）未完成时报告
+
 struct virtio_blk_data {
     struct virtio_device *virtio_device;
     struct virtq virtio_blk_queue;
@@ -27,6 +30,7 @@ struct virtio_blk_data {
 struct virtio_blk_qmap {
     uint16_t desp_idx;
     struct block_request *request;
+    struct timer_list timeout;  // 请求超时未完成时报告
 
     struct hash_table_node hash_node;
 };
@@ -0,0 +1,44 @@
+/**
+ * @file hrtimer.h
+ * @brief 声明高精度定时器
+ *
+ * 定时器的到期时刻是 time CSR 的绝对计数值，精度为一个计数周期。每个处理器有一个按到期时刻
+ * 排序的定时器队列（红黑树），处理器的定时器硬件总是设置为队列中最早的到期时刻。
+ * 睡眠、超时和调度器的时钟中断（tick）都是定时器。
+ *
+ * 定时器加入启动它的处理器的队列，到期时在该处理器的时钟中断中调用回调函数（关中断，
+ * 不持有队列的锁），回调函数可以重新启动定时器。
+ */
+#ifndef __HRTIMER_H__
+#define __HRTIMER_H__
+
+#include <stddef.h>
+#include <utils/rbtree.h>
+
+struct hrtimer_base;
+
+/** 高精度定时器 */
+struct hrtimer {
+    struct rb_node node;                        /**< 定时器队列的红黑树节点 */
+    uint64_t expires;                           /**< 到期时刻（time CSR 计数） */
+    void (*function)(struct hrtimer *timer);    /**< 到期时在时钟中断中调用 */
+    struct hrtimer_base *base;                  /**< 最近一次启动时加入的定时器队列，未启动过为 NULL */
+    uint32_t enqueued;                          /**< 是否在定时器队列中等待到期 */
+};
+
+void hrtimers_init();
+void hrtimer_init(struct hrtimer *timer, void (*function)(struct hrtimer *));
+void hrtimer_start(struct hrtimer *timer, uint64_t expires);
+int hrtimer_try_to_cancel(struct hrtimer *timer);
+int hrtimer_cancel(struct hrtimer *timer);
+void hrtimer_interrupt();
+
+/**
+ * @brief 定时器是否在等待到期
+ */
+static inline int hrtimer_active(const struct hrtimer *timer)
+{
+    return timer->enqueued;
+}
+
+#endif /* end of include guard: __HRTIMER_H__ */
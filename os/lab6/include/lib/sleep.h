@@ -1,16 +1,26 @@
 #ifndef __SLEEP_H__
 #define __SLEEP_H__
 #include <stddef.h>
-#include <utils/linked_list.h>
+#include <hrtimer.h>
+#include <timer.h>
 
-struct usleep_queue_node {
-    int64_t remaining_time;
-    struct linked_list_node list_node;
+struct task_struct;
+
+// 不短于该时长（微秒）的睡眠使用时间轮定时器，最多晚一个 tick 醒来（不超过 1%）
+#define USLEEP_TIMER_MIN 1000000
+
+// 在定时器到期前睡眠的进程，定时器到期时唤醒进程
+struct hrtimer_sleeper {
+    struct hrtimer timer;
+    struct task_struct *task;
+};
+
+// 在时间轮定时器到期前睡眠的进程
+struct timer_sleeper {
+    struct timer_list timer;
     struct task_struct *task;
 };
 
-void usleep_queue_init();
 int64_t usleep_set(int64_t time);
-void usleep_handler();
 
 #endif
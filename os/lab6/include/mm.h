@@ -6,11 +6,14 @@
  * 本模块注释中专门写了函数参数是物理地址还是虚拟地址，如果没有写，默认是虚拟地址。
  *
  * 进程地址空间：
- *     0xFFFFFFFF----->+--------------+
- *                     |              |
+ *   0x3FFFFFFFFF----->+--------------+
+ *                     |    Device    |
+ *   0x3F00000000----->+--------------+
+ *                     |   vmalloc    |
+ *   0x3E00000000----->+--------------+
  *                     |              |
  *                     |    Kernel    |
- *                     |              |
+ *                     | (linear map) |
  *                     |              |
  *     0xC0000000----->---------------+
  *                     |    Hole      |
@@ -41,39 +44,76 @@
 #define __MM_H__
 #include <stddef.h>
 #include <riscv.h>
+#include <smp.h>
+#include <utils/linked_list.h>
+
+struct fdt_header;
+struct task_struct;
+struct kmem_cache;
+
 /// @{ @name 物理内存布局和物理地址操作
 #define PAGE_SIZE 4096
 #define FLOOR(addr) ((addr) / PAGE_SIZE * PAGE_SIZE)/**< 向下取整到 4K 边界 */
 #define CEIL(addr)               \
     (((addr) / PAGE_SIZE + ((addr) % PAGE_SIZE != 0)) * PAGE_SIZE) /**< 向上取整到 4K 边界 */
-#define DEVICE_START    0x10000000                  /**< 设备树地址空间，暂时不使用 */
-#define DEVICE_END      0x10010000
 #define MEM_START       0x80000000                  /**< 物理内存地址空间 */
-#define MEM_END         0x88000000
+#define MEM_END         mem_end                     /**< 物理内存结束地址，由 mem_init() 根据设备树确定 */
 #define SBI_START       0x80000000                  /**< SBI 物理内存起始地址 */
 #define SBI_END         0x80200000                  /**< 用户程序（包括内核）可用的物理内存地址空间开始 */
-#define HIGH_MEM        0x88000000                  /**< 空闲内存区结束 */
-#define LOW_MEM         0x82000000                  /**< 空闲内存区开始（可用于用户进程和数据放置） */
-#define PAGING_MEMORY   (1024 * 1024 * 128)         /**< 系统物理内存大小 (bytes) */
+#define HIGH_MEM        mem_end                     /**< 空闲内存区结束 */
+#define LOW_MEM         low_mem                     /**< 空闲内存区开始（内核及启动阶段分配的数据之后） */
+#define PAGING_MEMORY   (MEM_END - MEM_START)       /**< 系统物理内存大小 (bytes) */
 #define PAGING_PAGES    (PAGING_MEMORY >> 12)       /**< 系统物理内存页数 */
+#define DEFAULT_MEMORY  (1024 * 1024 * 128)         /**< 设备树中找不到内存节点时假定的物理内存大小 */
 #define MAP_NR(addr)    (((addr)-MEM_START) >> 12)  /**< 物理地址 addr 在 mem_map[] 中的下标 */
+#define PAGE_OF(addr)   (&mem_map[MAP_NR(addr)])    /**< 物理地址 addr 所在页的描述符 */
+#define PAGE_ADDR(page) (MEM_START + ((uint64_t)((page) - mem_map) << 12)) /**< 页描述符对应的物理地址 */
+#define MEGA_PAGE_SIZE  0x200000                    /**< 二级页表项映射的大页（2M） */
+#define GIGA_PAGE_SIZE  0x40000000                  /**< 页目录项映射的大页（1G） */
 /// @}
 
-/// @{ @name 虚拟
-/* BASE_ADDRESS   -- 0xC0000000 */
-/* DEVICE_ADDRESS -- 0xC8000000 */
-#define KERNEL_ADDRESS    (MEM_START + LINEAR_OFFSET)
-#define DEVICE_ADDRESS  (KERNEL_ADDRESS + PAGING_MEMORY)
+/// @{ @name 内核虚拟地址空间布局
+#define KERNEL_ADDRESS    (MEM_START + LINEAR_OFFSET)        /**< 物理内存线性映射起始地址 */
+#define VMALLOC_START     0x3E00000000                       /**< vmalloc() 映射区起始地址 */
+#define VMALLOC_END       DEVICE_ADDRESS                     /**< vmalloc() 映射区结束地址 */
+#define DEVICE_ADDRESS    0x3F00000000                       /**< 设备内存映射区起始地址 */
+#define KERNEL_END        0x4000000000                       /**< 内核地址空间结束（Sv39 低半部分上界） */
+#define MAX_PAGING_MEMORY (VMALLOC_START - KERNEL_ADDRESS)   /**< 线性映射区能容纳的最大物理内存 */
 /// @}
 
-/// @{ @name 物理页标志位
-#define USED 100
-#define UNUSED 0
+/// @{ @name 物理页标志位（struct page::flags）
+#define PG_reserved 0x01    /**< 保留页：SBI、内核镜像、启动阶段分配的数据和设备树，永不释放 */
+#define PG_buddy    0x02    /**< 伙伴系统空闲块的首页，order 有效 */
+#define PG_bucket   0x04    /**< kmalloc 桶页面，private 指向桶描述符 */
+#define PG_slab     0x08    /**< slab 页面，页首为 slab 描述符 */
+#define PG_large    0x10    /**< kmalloc() 多页分配的首页，order 有效 */
 /// @}
 
+/**
+ * 物理页描述符
+ *
+ * 每个物理页对应一个描述符，mem_map[MAP_NR(addr)] 描述物理地址 addr 所在的页。
+ * 引用计数为 0 表示页空闲（在伙伴系统中）。引用计数只能通过 page_ref_inc()、
+ * page_ref_dec_and_test() 原子地修改。
+ */
+struct page {
+    uint32_t count;                 /**< 引用计数 */
+    uint16_t flags;                 /**< 标志位，PG_* */
+    uint16_t order;                 /**< 块的阶，仅在首页 PG_buddy 或 PG_large 置位时有效 */
+    struct linked_list_node lru;    /**< 链表节点，由页的当前使用者管理（如伙伴系统空闲链表） */
+    void *private;                  /**< 页的当前使用者的私有数据（如 kmalloc 桶描述符） */
+};
+
+#define MAX_ORDER 11                                /**< 伙伴系统最大块为 2^(MAX_ORDER - 1) 页 */
+#define ZERO_POOL_SIZE 64                           /**< 预清零页池容量（页） */
+#ifndef KMALLOC_TRACE
+#define KMALLOC_TRACE 0                             /**< 为 1 时跟踪每个 kmalloc() 调用点和对象，见 kmalloc_trace.c；可用 -DKMALLOC_TRACE=1 开启 */
+#endif
+
 /// @{ @name 页表项标志位
 #define PAGE_DIRTY        0x80
 #define PAGE_ACCESSED    0x40
+#define PAGE_GLOBAL      0x20
 #define PAGE_USER        0x10
 #define PAGE_READABLE   0x02
 #define PAGE_WRITABLE   0x04
@@ -89,9 +129,29 @@
 #define USER_R         (PAGE_USER       | PAGE_READABLE)
 /// @}
 
-/** 刷新 TLB */
+/** 刷新整个 TLB（包括全局映射），应尽量使用 flush_tlb_page() 等针对性的刷新函数 */
 #define invalidate() __asm__ __volatile__("sfence.vma\n\t"::)
 
+#define FLUSH_TLB_MAX_PAGES 32                      /**< 超过此页数的区间刷新整个地址空间，而不是逐页刷新 */
+#define MMU_GATHER_BATCH    16                      /**< mmu_gather 最多延迟释放的物理页数 */
+
+/**
+ * 批量页表操作的 TLB 刷新记录
+ *
+ * 修改页表时记录被修改的虚拟地址区间，操作结束后用一条覆盖全部修改的最便宜的
+ * sfence.vma 刷新 TLB。解除映射的物理页在刷新 TLB 之后才能释放，否则其他代码可能
+ * 通过过时的 TLB 表项访问已经被重新分配的页。
+ *
+ * @see tlb_gather_init(), tlb_gather_range(), tlb_gather_page(), tlb_gather_finish()
+ */
+struct mmu_gather {
+    uint64_t start;                     /**< 待刷新区间起始虚拟地址 */
+    uint64_t end;                       /**< 待刷新区间结束虚拟地址 */
+    size_t nr;                          /**< 延迟释放的物理页数 */
+    uint32_t freed_tables;              /**< 是否延迟释放了页表，需要刷新缓存的非叶子页表项 */
+    uint64_t pages[MMU_GATHER_BATCH];   /**< 延迟释放的物理页（物理地址），最低位为 1 表示共享的三级页表 */
+};
+
 /// @{ @name 虚拟地址操作
 #define GET_VPN1(addr)     (( (addr) >> 30) & 0x1FF)
 #define GET_VPN2(addr)     (( (addr) >> 21) & 0x1FF)
@@ -99,16 +159,24 @@
 #define GET_PPN(addr)      ((addr) >> 12)
 #define GET_PAGE_ADDR(pte) (( (pte) & 0x3FFFFFFFFFFC00) << 2)
 #define GET_FLAG(pte)      ( (pte) & 0x3FF )
+#define IS_LEAF(pte)       ( (pte) & KERN_RWX )     /**< R/W/X 任一位置位即为叶子页表项，可能位于上级页表（大页） */
 #define LINEAR_OFFSET    0x40000000
 #define PHYSICAL(vaddr)  (vaddr - LINEAR_OFFSET)
 #define VIRTUAL(paddr)   (paddr + LINEAR_OFFSET)
 /* 必须保证 end > start */
-#define IS_KERNEL(start, end) (start >= KERNEL_ADDRESS && end <= KERNEL_ADDRESS + PAGING_MEMORY)
+#define IS_KERNEL(start, end) (start >= KERNEL_ADDRESS && end <= KERNEL_END)
 #define IS_USER(start, end)   (end <= KERNEL_ADDRESS)
 /// @}
 
-extern unsigned char mem_map [ PAGING_PAGES ];
-extern uint64_t *pg_dir;
+extern uint64_t mem_end;
+extern uint64_t low_mem;
+extern struct page *mem_map;
+extern uint64_t *kernel_pg_dir;
+
+/** 当前处理器正在使用的页目录 */
+#define current_pg_dir (this_cpu()->pg_dir)
+extern uint64_t zero_pool_hits;
+extern uint64_t zero_pool_misses;
 
 /// @{ @name 内核地址
 /// 可执行文件中各节的起始虚拟地址,定义在链接脚本中
@@ -120,33 +188,104 @@ extern void data_start();
 extern void bss_start();
 /// @}
 
+/**
+ * @brief 获取页的引用计数
+ */
+static inline uint32_t page_count(struct page *page)
+{
+    return *(volatile uint32_t *)&page->count;
+}
+
+/**
+ * @brief 设置页的引用计数，只能用于不被其他代码访问的页（刚分配或即将释放）
+ */
+static inline void set_page_count(struct page *page, uint32_t count)
+{
+    page->count = count;
+}
+
+/**
+ * @brief 原子地增加页的引用计数
+ */
+static inline void page_ref_inc(struct page *page)
+{
+    __sync_add_and_fetch(&page->count, 1);
+}
+
+/**
+ * @brief 原子地减少页的引用计数
+ *
+ * @return 引用计数降为 0 返回 1，否则返回 0
+ */
+static inline int page_ref_dec_and_test(struct page *page)
+{
+    return __sync_sub_and_fetch(&page->count, 1) == 0;
+}
+
 void mem_test();
-void mem_init();
+void mem_init(const struct fdt_header *fdt);
+void *bootmem_alloc(uint64_t size);
 void free_page(uint64_t addr);
 void free_page_tables(uint64_t from, uint64_t size);
+void put_pg_tb2(uint64_t table);
 int copy_page_tables(uint64_t from, uint64_t *to_pg_dir, uint64_t to, uint64_t size);
 uint64_t get_free_page(void);
-void write_verify(uint64_t addr);
+uint64_t get_free_page_nozero(void);
+int zero_pool_refill();
+void buddy_init();
+void buddy_add_range(uint64_t start, uint64_t end);
+uint64_t alloc_pages(uint32_t order);
+void free_pages(uint64_t addr, uint32_t order);
+void __free_page(uint64_t addr);
+uint64_t nr_free_pages();
+void show_free_areas();
+int write_verify(uint64_t addr);
+int do_no_page(uint64_t addr, int write);
 void get_empty_page(uint64_t addr, uint16_t flag);
 uint64_t put_page(uint64_t page, uint64_t addr, uint16_t flag);
 void show_page_tables();
+void map_range(uint64_t paddr, uint64_t vaddr, uint64_t size, uint16_t flag);
 void map_kernel();
+void share_kernel_pg_dir(uint64_t *to_pg_dir);
 void active_mapping();
+void asid_init();
+void switch_mm(struct task_struct *task);
+void flush_tlb_all();
+void flush_tlb_asid(uint64_t asid);
+void flush_tlb_page(uint64_t addr);
+void flush_tlb_range(uint64_t start, uint64_t end);
+void tlb_gather_init(struct mmu_gather *tlb);
+void tlb_gather_range(struct mmu_gather *tlb, uint64_t addr, uint64_t size);
+void tlb_gather_page(struct mmu_gather *tlb, uint64_t page);
+void tlb_gather_table(struct mmu_gather *tlb, uint64_t page);
+void tlb_gather_shared_table(struct mmu_gather *tlb, uint64_t page);
+void tlb_gather_finish(struct mmu_gather *tlb);
+void kmalloc_init();
 void * kmalloc_i(uint64_t size);       /* 通用内核内存分配函数 */
 uint64_t kfree_s_i(void * obj, uint64_t size);      /* 释放指定对象占用的内存 */
-static inline void * kmalloc(uint64_t size) {
-    disable_interrupt();
-    void *ptr = kmalloc_i(size);
-    enable_interrupt();
-    return ptr;
-}
-static inline uint64_t kfree_s(void * obj, uint64_t size) {
-    disable_interrupt();
-    uint64_t real_size = kfree_s_i(obj, size);
-    enable_interrupt();
-    return real_size;
-}
+void * kmalloc(uint64_t size);
+uint64_t kfree_s(void * obj, uint64_t size);
 #define kfree(ptr) kfree_s((ptr), 0)
+void kmalloc_show_trace();
+void kmalloc_mark_trace();
+uint64_t kmalloc_find_leaks();
+void kmalloc_trace_init();
+void kmalloc_trace_alloc(void *ptr, uint64_t size, uint64_t real_size, uint64_t caller);
+int kmalloc_trace_check_free(void *ptr, uint64_t size, uint64_t caller);
+void kmalloc_trace_free(void *ptr, uint64_t real_size);
+void kmalloc_trace_show();
+void kmalloc_trace_mark();
+uint64_t kmalloc_trace_leaks();
+struct kmem_cache *kmem_cache_create(const char *name, uint64_t size, uint64_t align,
+                                     void (*ctor)(void *));
+void *kmem_cache_alloc_i(struct kmem_cache *cache);
+void kmem_cache_free_i(struct kmem_cache *cache, void *obj);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void show_slab_info();
+void vmalloc_init();
+void *vmalloc(uint64_t size);
+void vfree(void *addr);
 void malloc_test();
 
 #endif
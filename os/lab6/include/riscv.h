@@ -61,6 +61,12 @@
 #define SSTATUS64_SD 0x8000000000000000
 /// @}
 
+/// @{ @name SATP 寄存器字段
+#define SATP_MODE_SV39  ((uint64_t)8 << 60)
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK  0xFFFFUL
+/// @}
+
 /// @{ @name RISCV 权限模式
 #define USER       0
 #define SUPERVISOR 1
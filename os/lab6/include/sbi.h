@@ -15,8 +15,16 @@
 #define BASE_EXTENSTION 0x10
 #define TIMER_EXTENTION 0x54494D45
 #define HART_STATE_EXTENTION 0x48534D
+#define IPI_EXTENTION 0x735049
+#define RFENCE_EXTENTION 0x52464E43
 #define RESET_EXTENTION 0x53525354
 
+/** hart state */
+#define SBI_HART_STARTED 0
+#define SBI_HART_STOPPED 1
+#define SBI_HART_START_PENDING 2
+#define SBI_HART_STOP_PENDING 3
+
 /** sbi implementation id */
 
 /** we only use OpenSBI */
@@ -27,6 +35,9 @@
 #define RUSTSBI 4
 #define DIOSIX 5
 
+/** OpenSBI 的实现版本号：高 16 位为主版本号，低 16 位为次版本号 */
+#define OPENSBI_VERSION(major, minor) (((major) << 16) | (minor))
+
 /** sbi ecall return type */
 struct sbiret {
     long error;
@@ -41,6 +52,10 @@ void sbi_set_timer(uint64_t stime_value);             /** set timer */
 char sbi_console_getchar();                            /** read a byte from debug console */
 void sbi_console_putchar(char ch);                     /** print character to debug console */
 void sbi_shutdown();                                  /** shutdown */
+struct sbiret sbi_hart_start(uint64_t hartid, uint64_t start_addr, uint64_t opaque); /** start hart at physical address start_addr, a0 = hartid, a1 = opaque */
+struct sbiret sbi_hart_get_status(uint64_t hartid);   /** get hart state, SBI_HART_* */
+struct sbiret sbi_send_ipi(uint64_t hart_mask, uint64_t hart_mask_base); /** send supervisor software interrupt */
+struct sbiret sbi_remote_sfence_vma(uint64_t hart_mask, uint64_t hart_mask_base, uint64_t start_addr, uint64_t size); /** sfence.vma on remote harts */
 void print_system_infomation();
 
 #endif
@@ -39,10 +39,16 @@
 #ifndef __SCHED_H__
 #define __SCHED_H__
 #include <mm.h>
+#include <clock.h>
 #include <trap.h>
 #include <riscv.h>
 #include <kdebug.h>
+#include <smp.h>
 #include <fs/vfs.h>
+#include <utils/atomic.h>
+#include <utils/linked_list.h>
+#include <utils/rbtree.h>
+#include <utils/bitops.h>
 
 #define NR_TASKS             512                              /**< 系统最大进程数 */
 
@@ -57,16 +63,78 @@
 #define TASK_STOPPED         4                                /**< 进程停止 */
 /// @}
 
+#define WNOHANG              1                                /**< waitpid() 选项：没有已退出的子进程时立即返回 */
+
+/// @{ @name 调度策略
+#define SCHED_NORMAL         0                                /**< 公平调度 */
+#define SCHED_FIFO           1                                /**< 实时，先进先出，直到阻塞或被更高优先级的进程抢占 */
+#define SCHED_RR             2                                /**< 实时，同一优先级的进程轮转 */
+/// @}
+
+#define MAX_RT_PRIO          100                              /**< 实时优先级为 1 ~ MAX_RT_PRIO - 1，越大越优先 */
+#define RR_TIMESLICE         (100 * HZ / 1000)                /**< SCHED_RR 进程的时间片（ticks） */
+#define BALANCE_INTERVAL     4                                /**< 周期性负载均衡的间隔（ticks） */
+#define CACHE_NICE_TRIES     2                                /**< 连续这么多次均衡失败后不再考虑缓存亲和性 */
+
+/// @{ @name nice 值
+#define MIN_NICE             (-20)                            /**< 最高的 nice 值（最优先） */
+#define MAX_NICE             19                               /**< 最低的 nice 值 */
+#define NICE_0_LOAD          1024                             /**< nice 值为 0 的进程的权重 */
+/// @}
+
 /// @{ 进程内存布局
 #define START_CODE 0x10000                                    /**< 代码段起始地址 */
 #define START_STACK 0xBFFFFFF0                                /**< 堆起始地址（最高地址处） */
+#define STACK_SIZE  (8 * 1024 * 1024)                         /**< 栈最大长度，栈在此范围内按需增长 */
+#define STACK_LIMIT (START_STACK - STACK_SIZE)                /**< 栈最低地址 */
 #define START_KERNEL 0xC0000000                               /**< 内核区起始地址 */
 /// @}
 
 typedef struct trapframe context;                             /**< 处理器上下文 */
 
-/** 进程控制块 PCB(Process Control Block) */
+struct rq;
+
+/** 调度参数，用于 sched_setscheduler()、sched_getparam() 系统调用 */
+struct sched_param {
+    int32_t sched_priority;       /**< 实时优先级，SCHED_NORMAL 为 0 */
+};
+
+/**
+ * 调度类
+ *
+ * 每个进程属于一个调度类，由调度类决定进程在运行队列中如何排列。
+ * schedule() 按优先级从高到低询问各调度类，第一个返回进程的调度类胜出；
+ * 所有调度类都没有可运行的进程时运行进程 0。进程 0 不属于任何调度类。
+ */
+struct sched_class {
+    const struct sched_class *next;                                         /**< 优先级更低的调度类 */
+    void (*enqueue_task)(struct rq *rq, struct task_struct *p);             /**< 进程变为可运行，加入运行队列 */
+    void (*dequeue_task)(struct rq *rq, struct task_struct *p);             /**< 进程不再可运行，移出运行队列 */
+    void (*check_preempt_curr)(struct rq *rq, struct task_struct *p);       /**< 同一调度类的进程 p 被唤醒，判断是否抢占当前进程 */
+    struct task_struct *(*pick_next_task)(struct rq *rq);                   /**< 选择下一个运行的进程，没有则返回 NULL */
+    void (*put_prev_task)(struct rq *rq, struct task_struct *p);            /**< 进程 p 即将让出处理器 */
+    void (*set_curr_task)(struct rq *rq, struct task_struct *p);            /**< 正在运行的进程 p 改变调度类后重新加入运行队列 */
+    void (*task_tick)(struct rq *rq, struct task_struct *p);                /**< 时钟中断，p 为当前进程 */
+    void (*task_fork)(struct rq *rq, struct task_struct *p);                /**< 新进程 p 加入运行队列之前调用 */
+};
+
+/** 公平调度类中进程的调度信息，运行时间统计各调度类共用 */
+struct sched_entity {
+    uint64_t weight;                  /**< 权重，由 nice 值决定 */
+    struct rb_node run_node;          /**< 红黑树节点，正在运行的进程不在树中 */
+    uint64_t exec_start;              /**< 本次开始计算运行时间的时刻（ns） */
+    uint64_t sum_exec_runtime;        /**< 累计运行时间（ns） */
+    uint64_t prev_sum_exec_runtime;   /**< 本次被选中时的累计运行时间 */
+    uint64_t vruntime;                /**< 虚拟运行时间：运行时间按 NICE_0_LOAD / weight 缩放 */
+};
+
+/**
+ * 进程控制块 PCB(Process Control Block)
+ *
+ * cpu 必须是第一个成员：从用户态进入内核时 trapentry.S 从内核栈所在页的起始处读取它恢复 tp。
+ */
 struct task_struct {
+    struct cpu *cpu;              /**< 所在运行队列的处理器 */
     uint32_t exit_code;           /**< 返回码 */
     uint32_t pid;                 /**< 进程 ID */
     uint32_t pgid;                /**< 进程组 */
@@ -78,17 +146,29 @@ struct task_struct {
     uint64_t start_stack;         /**< 堆起始地址 */
     uint64_t start_kernel;        /**< 内核区起始地址 */
     uint32_t state;               /**< 进程调度状态 */
-    uint32_t counter;             /**< 时间片大小 */
-    uint32_t priority;            /**< 进程优先级 */
+    uint32_t policy;              /**< 调度策略，SCHED_* */
+    uint32_t rt_priority;         /**< 实时优先级，SCHED_NORMAL 为 0 */
+    uint32_t time_slice;          /**< SCHED_RR 进程剩余的时间片（ticks） */
+    uint32_t on_rq;               /**< 是否在运行队列中 */
+    uint32_t need_resched;        /**< 需要重新调度（时间片耗尽） */
+    volatile uint32_t on_cpu;     /**< 正在某个处理器上运行（包括正在被切换出去） */
+    struct cpu *last_cpu;         /**< 上一次运行的处理器，用于判断是否需要刷新 TLB */
+    uint64_t cpus_allowed;        /**< 允许运行的处理器的位图，第 i 位对应 cpus[i] */
+    const struct sched_class *sched_class; /**< 调度类 */
+    struct linked_list_node run_list;      /**< 实时运行队列链表节点 */
+    int32_t nice;                 /**< nice 值，[MIN_NICE, MAX_NICE] */
+    struct sched_entity se;       /**< 公平调度类的调度信息 */
     struct vfs_inode *fd[4];
     struct task_struct *p_pptr;   /**< 父进程 */
     struct task_struct *p_cptr;   /**< 子进程 */
     struct task_struct *p_ysptr;  /**< 创建时间最晚的兄弟进程 */
     struct task_struct *p_osptr;  /**< 创建时间最早的兄弟进程 */
+    struct task_struct *wait_chldexit; /**< 在 waitpid() 中等待子进程退出的进程 */
     uint32_t utime,stime;         /**< 用户态、内核态耗时 */
     uint32_t cutime,cstime;       /**< 进程及其子进程内核、用户态总耗时 */
     size_t start_time;            /**< 进程创建的时间 */
     uint64_t *pg_dir;             /**< 页目录地址 */
+    uint64_t asid;                /**< 地址空间标识符，高位为分配时的代号 */
     context context;              /**< 处理器状态 */
 };
 
@@ -126,16 +206,104 @@ union task_union {
     char stack[PAGE_SIZE];                                    /**< 内核态堆栈 */
 };
 
-extern struct task_struct *current;
+/** 优先级数组：每个优先级一条可运行进程链表，位图记录哪些链表非空 */
+struct prio_array {
+    uint64_t bitmap[BITS_TO_LONGS(MAX_RT_PRIO)];              /**< 第 i 位置位表示下标 i 的链表非空 */
+    struct linked_list_node queue[MAX_RT_PRIO];               /**< 各优先级的进程链表，下标 0 最优先 */
+};
+
+/** 实时调度类的运行队列 */
+struct rt_rq {
+    struct prio_array active;                                 /**< 可运行的实时进程 */
+    uint64_t nr_running;                                      /**< 可运行的实时进程数 */
+    uint64_t rt_time;                                         /**< 本周期内实时进程的运行时间（ns） */
+    uint64_t period_start;                                    /**< 本周期开始的时刻（ns） */
+    uint64_t throttled;                                       /**< 实时进程用完了本周期的配额，暂停运行 */
+};
+
+/** 公平调度类的运行队列：按 vruntime 排序的红黑树 */
+struct cfs_rq {
+    uint64_t load;                                            /**< 可运行进程（含正在运行的进程）的权重之和 */
+    uint64_t nr_running;                                      /**< 可运行进程数 */
+    uint64_t min_vruntime;                                    /**< 单调递增的最小 vruntime，新进程和唤醒的进程以此为基准 */
+    struct rb_root tasks_timeline;                            /**< 等待运行的进程 */
+    struct rb_node *rb_leftmost;                              /**< 树中最左（vruntime 最小）的节点 */
+    struct sched_entity *curr;                                /**< 正在运行的进程，不在树中 */
+};
+
+/** 运行队列，每个处理器一个 */
+struct rq {
+    struct spinlock lock;                                     /**< 保护运行队列及其中进程的调度信息 */
+    uint64_t nr_running;                                      /**< 可运行进程数（不含空闲进程） */
+    struct rt_rq rt;                                          /**< 实时调度类的运行队列 */
+    struct cfs_rq cfs;                                        /**< 公平调度类的运行队列 */
+    struct cpu *cpu;                                          /**< 所属的处理器 */
+    struct task_struct *curr;                                 /**< 正在运行的进程 */
+    struct task_struct *idle;                                 /**< 空闲进程，不属于任何调度类 */
+    uint64_t balance_ticks;                                   /**< 距离下一次周期性负载均衡的 ticks */
+    uint64_t nr_balance_failed;                               /**< 连续负载均衡失败（不平衡但没能迁移进程）的次数 */
+};
+
+extern struct rq runqueues[NR_CPUS];
+
+/** 处理器 cpu 的运行队列 */
+#define cpu_rq(cpu) (&runqueues[(cpu)->id])
+/** 当前处理器的运行队列 */
+#define this_rq() cpu_rq(this_cpu())
+/** 进程 p 所在的运行队列 */
+#define task_rq(p) cpu_rq((p)->cpu)
+/** 进程 p 是否允许在处理器 cpu 上运行 */
+#define task_allowed_on(p, cpu) ((p)->cpus_allowed & (1UL << (cpu)->id))
+extern const struct sched_class rt_sched_class;
+extern const struct sched_class fair_sched_class;
+
+/// @{ @name 公平调度类参数（ns）
+extern uint64_t sched_latency_ns;
+extern uint64_t sched_min_granularity_ns;
+extern uint64_t sched_wakeup_granularity_ns;
+extern uint64_t sched_migration_cost_ns;
+/// @}
+
+/// @{ @name 实时进程带宽限制（ns）
+extern uint64_t sched_rt_period_ns;
+extern uint64_t sched_rt_runtime_ns;
+/// @}
+
+/** 当前处理器正在运行的进程 */
+#define current (this_cpu()->curr)
+
 extern struct task_struct *tasks[NR_TASKS];
+extern struct spinlock tasks_lock;
 extern union task_union init_task;
 
 void sched_init();
 void schedule();
 void save_context(context *context);
 context* push_context(char *stack, context *context);
-void switch_to(size_t task);
+void switch_to(struct task_struct *next, struct spinlock *lock);
 void interruptible_sleep_on(struct task_struct **p);
 void sleep_on(struct task_struct **p);
+void interruptible_sleep_on_lock(struct task_struct **p, struct spinlock *lock);
+void sleep_on_lock(struct task_struct **p, struct spinlock *lock);
 void wake_up(struct task_struct **p);
+void wake_up_process(struct task_struct *p);
+void wake_up_new_task(struct task_struct *p);
+struct cpu *select_task_rq(struct task_struct *p);
+struct rq *task_rq_lock(struct task_struct *p, uint64_t *flags);
+void task_rq_unlock(struct rq *rq, uint64_t flags);
+void init_idle(struct cpu *cpu, struct task_struct *idle);
+void cpu_idle();
+void resched_curr(struct rq *rq);
+uint64_t sched_tick_interval(struct rq *rq);
+int double_lock_balance(struct rq *this_rq, struct rq *busiest);
+void move_task(struct rq *src_rq, struct task_struct *p, struct rq *dst_rq);
+int load_balance(struct rq *this_rq, int idle);
+int set_cpus_allowed(struct task_struct *p, uint64_t mask);
+void scheduler_tick(uint64_t n);
+void set_user_nice(struct task_struct *p, int32_t nice);
+void rt_rq_init(struct rt_rq *rt_rq);
+void update_rt_bandwidth(struct rq *rq);
+int sched_setscheduler(struct task_struct *p, uint32_t policy, uint32_t rt_priority);
+void do_exit(uint32_t code);
+int reap_orphans();
 #endif /* end of include guard: __SCHED_H__ */
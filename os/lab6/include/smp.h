@@ -0,0 +1,72 @@
+/**
+ * @file smp.h
+ * @brief 声明多处理器（SMP）相关的数据结构和函数
+ *
+ * 每个 hart 对应一个 struct cpu。hart 处于内核态时 tp 寄存器指向自己的 struct cpu，
+ * 进入内核时由 trapentry.S 从进程控制块的第一个成员 task_struct::cpu 恢复 tp，
+ * 因此 current 等处理器私有数据只需读取 tp，不需要加锁。
+ *
+ * 启动处理器（逻辑编号 0）运行 main()，初始化完成后由 smp_init() 通过 SBI HSM 扩展
+ * 启动其余 hart。其余 hart 从 _secondary_start 进入 secondary_main()，最终运行各自的空闲进程。
+ */
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include <stddef.h>
+
+#define NR_CPUS 8                   /**< 最多支持的处理器（hart）数 */
+#define CPU_MASK_ALL ((1UL << NR_CPUS) - 1) /**< 包含所有处理器的位图，第 i 位对应 cpus[i] */
+
+struct task_struct;
+struct trapframe;
+
+/** 处理器私有数据 */
+struct cpu {
+    uint64_t id;                    /**< 逻辑编号，启动处理器为 0 */
+    uint64_t hartid;                /**< hart ID */
+    volatile uint64_t online;       /**< 已完成初始化，可以接收进程 */
+    struct task_struct *curr;       /**< 正在运行的进程 */
+    struct task_struct *idle;       /**< 空闲进程，启动处理器为进程 0 */
+    uint64_t *pg_dir;               /**< 正在使用的页目录 */
+    uint64_t asid_generation;       /**< 本处理器 TLB 中的 ASID 所属的代 */
+    uint64_t last_tick;             /**< 最近一次处理的 tick 的时刻（time CSR 计数） */
+    uint64_t next_event;            /**< 定时器硬件设置的时刻，UINT64_MAX 表示没有 */
+    uint64_t tick_interval;         /**< 当前的 tick 间隔（ticks），0 表示 tick 已停止 */
+    struct trapframe *irq_regs;     /**< 正在处理的时钟中断的 TrapFrame */
+};
+
+extern struct cpu cpus[NR_CPUS];
+extern uint64_t nr_cpus;
+
+/**
+ * @brief 获取当前处理器的私有数据
+ */
+static inline struct cpu *this_cpu()
+{
+    struct cpu *cpu;
+    __asm__ __volatile__("mv %0, tp" : "=r"(cpu));
+    return cpu;
+}
+
+/**
+ * @brief 获取在线处理器的位图
+ */
+static inline uint64_t cpu_online_mask()
+{
+    uint64_t mask = 0;
+    for (uint64_t i = 0; i < nr_cpus; ++i) {
+        if (cpus[i].online)
+            mask |= 1UL << i;
+    }
+    return mask;
+}
+
+/** 启动处理器的 hart ID，外部中断只发送给启动处理器 */
+#define boot_hartid() (cpus[0].hartid)
+
+void smp_boot_init(uint64_t hartid);
+void smp_init();
+void smp_send_reschedule(struct cpu *cpu);
+void smp_flush_tlb_kernel(uint64_t start, uint64_t size);
+
+#endif /* end of include guard: __SMP_H__ */
@@ -9,7 +9,7 @@ typedef long (*fn_ptr)(struct trapframe *);                 /**< 系统调用指
 extern fn_ptr syscall_table[];
 extern long test_fork;
 /// @{ @name 系统调用号
-#define NR_syscalls  13                                     /**< 系统调用数量 */
+#define NR_syscalls  24                                     /**< 系统调用数量 */
 #define NR_fork      1
 #define NR_test_fork 2
 #define NR_getpid    3
@@ -22,8 +22,39 @@ extern long test_fork;
 #define NR_read  10
 #define NR_reset 11
 #define NR_usleep 12
+#define NR_idle   13
+#define NR_brk    14
+#define NR_exit   15
+#define NR_waitpid 16
+#define NR_kmstat 17
+#define NR_nice   18
+#define NR_sched_setscheduler 19
+#define NR_sched_getscheduler 20
+#define NR_sched_getparam     21
+#define NR_sched_setaffinity  22
+#define NR_sched_getaffinity  23
+/// @}
+
+/// @{ @name kmstat() 命令
+#define KMSTAT_CALLSITES 0  /**< 打印 kmalloc() 各调用点的统计信息 */
+#define KMSTAT_SLAB      1  /**< 打印 slab 缓存的统计信息 */
+#define KMSTAT_MARK      2  /**< 设置泄漏检查点 */
+#define KMSTAT_LEAKS     3  /**< 列出检查点之后分配、仍未释放的对象 */
 /// @}
 
 long syscall(long number, ...);
 
+/**
+ * @brief 将堆扩大 increment 字节（可以为负数）
+ *
+ * @return 成功返回原来的堆结束地址，失败返回 (void *)-1
+ */
+static inline void *sbrk(long increment)
+{
+    long old_brk = syscall(NR_brk, 0);
+    if (increment && syscall(NR_brk, old_brk + increment) != old_brk + increment)
+        return (void *)-1;
+    return (void *)old_brk;
+}
+
 #endif /* end of include guard: __SYSCALL_H__ */
@@ -0,0 +1,45 @@
+/**
+ * @file timer.h
+ * @brief 声明时间轮定时器
+ *
+ * 定时器的到期时刻以 jiffies（开机后经过的 tick 周期数，见 get_jiffies()）为单位，精度为一个
+ * tick。每个处理器有一个分层的时间轮，加入和取消定时器都是 O(1) 的，适合大量睡眠进程和 I/O
+ * 超时这类通常在到期前就被取消的定时器；需要更高精度时使用高精度定时器（见 hrtimer.h）。
+ *
+ * 定时器加入启动它的处理器的时间轮，到期时在该处理器的 tick 中调用回调函数（关中断，
+ * 不持有时间轮的锁），回调函数可以重新启动定时器。
+ */
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stddef.h>
+#include <utils/linked_list.h>
+
+struct tvec_base;
+
+/** 时间轮定时器 */
+struct timer_list {
+    struct linked_list_node entry;                  /**< 时间轮槽位的链表节点，不在时间轮中时 next 为 NULL */
+    uint64_t expires;                               /**< 到期时刻（jiffies） */
+    void (*function)(struct timer_list *timer);     /**< 到期时在 tick 中调用 */
+    struct tvec_base *base;                         /**< 最近一次启动时加入的时间轮，未启动过为 NULL */
+};
+
+void init_timers();
+void init_timer(struct timer_list *timer, void (*function)(struct timer_list *));
+void add_timer(struct timer_list *timer);
+int mod_timer(struct timer_list *timer, uint64_t expires);
+int del_timer(struct timer_list *timer);
+int del_timer_sync(struct timer_list *timer);
+void run_timers();
+uint64_t timer_next_expiry();
+
+/**
+ * @brief 定时器是否在等待到期
+ */
+static inline int timer_pending(const struct timer_list *timer)
+{
+    return timer->entry.next != NULL;
+}
+
+#endif /* end of include guard: __TIMER_H__ */
@@ -59,6 +59,7 @@ struct trapframe {
 
 extern void set_stack(char *stack);
 extern void __trapret();
+extern void __switch_trapret(struct trapframe *tf, void *lock, volatile uint32_t *on_cpu);
 extern void __alltraps();
 
 struct trapframe * trap(struct trapframe *tf);
@@ -67,4 +67,23 @@ static inline void release_lock(struct spinlock *lk)
     __sync_lock_release(&lk->locked);
 }
 
+// Disable interrupts, then acquire the lock.
+// Returns the previous SIE bit, which must be passed to release_lock_irqrestore().
+// Use this when the lock is also taken by interrupt handlers on the same hart,
+// or when the caller may run with interrupts enabled.
+static inline uint64_t acquire_lock_irqsave(struct spinlock *lk)
+{
+    uint64_t flags = read_csr(sstatus) & SSTATUS_SIE;
+    disable_interrupt();
+    acquire_lock(lk);
+    return flags;
+}
+
+// Release the lock, then restore the SIE bit saved by acquire_lock_irqsave().
+static inline void release_lock_irqrestore(struct spinlock *lk, uint64_t flags)
+{
+    release_lock(lk);
+    set_csr(sstatus, flags);
+}
+
 #endif
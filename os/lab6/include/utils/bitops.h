@@ -0,0 +1,49 @@
+#ifndef BITOPS_H
+#define BITOPS_H
+
+#include <stddef.h>
+
+// 不依赖 libgcc 的位操作（内核不链接 libgcc，没有 Zbb 扩展时 __builtin_ctzll 会调用 __ctzdi2）
+
+// DeBruijn 序列下标表
+static const uint8_t bitops_debruijn[64] = {
+    63,  0, 58,  1, 59, 47, 53,  2,
+    60, 39, 48, 27, 54, 33, 42,  3,
+    61, 51, 37, 40, 49, 18, 28, 20,
+    55, 30, 34, 11, 43, 14, 22,  4,
+    62, 57, 46, 52, 38, 26, 32, 41,
+    50, 36, 17, 19, 29, 10, 13, 21,
+    56, 45, 25, 31, 35, 16,  9, 12,
+    44, 24, 15,  8, 23,  7,  6,  5
+};
+
+// 返回最低的置位位的下标，word 不能为 0
+static inline uint64_t __ffs64(uint64_t word) {
+    return bitops_debruijn[((word & -word) * 0x07EDD5E59A4E28C2) >> 58];
+}
+
+#define BITS_PER_LONG 64
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+// 将位图 bitmap 的第 nr 位置位
+static inline void set_bit(uint64_t nr, uint64_t *bitmap) {
+    bitmap[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+// 将位图 bitmap 的第 nr 位清零
+static inline void clear_bit(uint64_t nr, uint64_t *bitmap) {
+    bitmap[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+// 返回位图前 size 位中第一个置位位的下标，没有置位位时返回 size
+static inline uint64_t find_first_bit(const uint64_t *bitmap, uint64_t size) {
+    for (uint64_t i = 0; i * BITS_PER_LONG < size; ++i) {
+        if (bitmap[i]) {
+            uint64_t nr = i * BITS_PER_LONG + __ffs64(bitmap[i]);
+            return nr < size ? nr : size;
+        }
+    }
+    return size;
+}
+
+#endif
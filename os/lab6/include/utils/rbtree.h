@@ -0,0 +1,44 @@
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stddef.h>
+
+// 红黑树，节点放在结构体中，配合 rb_entry（即 container_of）使用。
+// 树本身不比较关键字：使用者自行从根向下查找插入位置，调用 rb_link_node() 链入后再调用 rb_insert_color() 重新平衡。
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    uint64_t color;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+#define RB_ROOT (struct rb_root) { NULL }
+
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+// 将新节点链接到 parent 的 *link 位置（*link 原来为 NULL），之后必须调用 rb_insert_color()
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link) {
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+// 插入新节点后重新平衡
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+// 删除节点并重新平衡
+void rb_erase(struct rb_node *node, struct rb_root *root);
+// 返回最小的节点（若树为空则返回 NULL）
+struct rb_node *rb_first(const struct rb_root *root);
+// 返回中序遍历的下一个节点（若为最大节点则返回 NULL）
+struct rb_node *rb_next(const struct rb_node *node);
+
+#endif
@@ -1,4 +1,4 @@
-    .globl boot_stack, boot_stack_top, _start, boot_pg_dir
+    .globl boot_stack, boot_stack_top, _start, _secondary_start, boot_pg_dir
     .section .text.entry
 
 # 本项目所用代码模型为 medany, 该代码模型下编译器生成的代码以 PC 相对寻址的方式访问任意地址，地址通过 auipc 和 addi 指令获取。
@@ -19,14 +19,41 @@ _start:
     add t0, t0, t1
     jr t0
 
+# 其他 hart 由 smp_init() 通过 SBI HSM 扩展从这里启动，此时未开启分页，a0 = hartid，a1 = 空闲进程内核栈顶（虚拟地址）。
+# 与启动处理器一样先使用启动页表跳转到高地址，空闲进程控制块（栈顶之下一页）的第一个成员是本处理器的 struct cpu。
+_secondary_start:
+    la t0, boot_pg_dir
+    srli t0, t0, 12
+    li t1, (8 << 60)
+    or t0, t0, t1
+    csrw satp, t0
+    sfence.vma
+
+    mv sp, a1
+    li t1, 4096
+    sub t0, a1, t1
+    ld tp, 0(t0)
+    li t1, 0x40000000
+    la t0, secondary_main
+    add t0, t0, t1
+    jr t0
+
     # .section .bss
     .section .data
 boot_stack:
     .space 4096 * 4
 boot_stack_top:
 
+# 启动页表使用 1G 大页：
+#   虚拟地址 0x80000000 恒等映射到物理地址 0x80000000，用于开启分页后跳转到高地址之前；
+#   虚拟地址 [0xC0000000, 0x3E00000000) 线性映射到物理地址 [0x80000000, 0x3D80000000)，
+#   使 mem_init() 在确定内存大小之前就能访问全部物理内存。
 boot_pg_dir:
     .zero 2 * 8
     .quad (0x80000000 >> 2) | 0x0F
-    .quad (0x80000000 >> 2) | 0x0F
-    .zero 508 * 8
+    .set n, 0
+    .rept 245
+    .quad ((0x80000000 + (n << 30)) >> 2) | 0x0F
+    .set n, n + 1
+    .endr
+    .zero 264 * 8
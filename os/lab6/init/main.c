@@ -3,18 +3,20 @@
 #include <mm.h>
 #include <trap.h>
 #include <sched.h>
+#include <smp.h>
 #include <clock.h>
 #include <syscall.h>
 #include <device/loader.h>
 #include <fs/vfs.h>
-#include <lib/sleep.h>
 #include <lib/stdio.h>
 
 int main(const char* args, const struct fdt_header *fdt)
 {
+    smp_boot_init((uint64_t)args);  /* OpenSBI 通过 a0 传入 hart ID */
     kputs("\nLZU OS STARTING....................");
     print_system_infomation();
-    mem_init();
+    clock_fdt_init(fdt);
+    mem_init(fdt);
     mem_test();
     malloc_test();
     init_device_table();
@@ -23,8 +25,8 @@ int main(const char* args, const struct fdt_header *fdt)
     vfs_init();
     sched_init();
     clock_init();
+    smp_init();
     kputs("Hello LZU OS");
-    usleep_queue_init();
 
     enable_interrupt();
     init_task0();
@@ -95,6 +97,20 @@ int main(const char* args, const struct fdt_header *fdt)
                     syscall(NR_close, fd);
                     continue;
                 }
+                if (!strcmp(buffer, "kmstat")) {
+                    if (!arg1 || !strlen(arg1)) {
+                        syscall(NR_kmstat, KMSTAT_CALLSITES);
+                    } else if (!strcmp(arg1, "slab")) {
+                        syscall(NR_kmstat, KMSTAT_SLAB);
+                    } else if (!strcmp(arg1, "mark")) {
+                        syscall(NR_kmstat, KMSTAT_MARK);
+                    } else if (!strcmp(arg1, "leak")) {
+                        syscall(NR_kmstat, KMSTAT_LEAKS);
+                    } else {
+                        puts("Usage: kmstat [slab|mark|leak]\n");
+                    }
+                    continue;
+                }
                 if (buffer[0]) {
                     puts(buffer); puts(": command not found\n");
                 }
@@ -102,6 +118,6 @@ int main(const char* args, const struct fdt_header *fdt)
         }
     }
     while (1)
-        ; /* infinite loop */
+        syscall(NR_idle); /* 空闲时补充预清零页池 */
     return 0;
 }
@@ -2,48 +2,328 @@
  * @file clock.c
  * @author Hanabichan (93yutf@gmail.com)
  * @brief 实现时钟中断
+ *
+ * time CSR 的计数频率从设备树 /cpus 节点的 timebase-frequency 属性读取。
+ *
+ * 处理器支持 Sstc 扩展且固件允许 S 模式访问 stimecmp 时直接写 stimecmp 设置定时器硬件，
+ * 否则通过 SBI 调用设置。
+ *
+ * 处理器的定时器硬件由高精度定时器（见 hrtimer.c）设置为最早的到期时刻，调度器的时钟中断（tick）
+ * 也是每个处理器上的一个定时器。
+ *
+ * 动态时钟：每个处理器只在需要时启动 tick。运行队列为空的处理器停止 tick，
+ * 只有一个可运行进程时延长 tick 的间隔（见 sched_tick_interval()）。tick 总是对齐到
+ * 1 / HZ 秒，处理 tick 时按实际经过的 tick 数更新时间统计。
+ *
+ * 时间轮定时器（见 timer.c）在 tick 中推进，有等待到期的时间轮定时器时 tick 不会停止到其到期之后。
  */
 #include <clock.h>
 #include <sbi.h>
 #include <riscv.h>
 #include <kdebug.h>
+#include <sched.h>
+#include <hrtimer.h>
+#include <timer.h>
+#include <device/fdt.h>
+#include <string.h>
 
 /** 时钟中断发生次数 */
 volatile size_t ticks;
 
+/** time CSR 的计数频率（Hz） */
+uint64_t timebase_freq = CLOCK_FREQ;
+
 /** 每隔 timebase 次时钟周期发生一次时钟中断 */
 static uint64_t timebase;
 
+/** 各处理器的 tick */
+static struct hrtimer tick_timers[NR_CPUS];
+
+/** 处理器支持 Sstc 扩展，可以在 S 模式直接写 stimecmp。在 mem_init() 清零 .bss 段之前设置，因此放在 .data 段 */
+static int has_sstc __attribute__((section(".data")));
+
+/**
+ * @brief riscv,isa 字符串（如 rv64imafdc_zicsr_sstc）中是否有多字母扩展 ext
+ *
+ * @param isa 属性值
+ * @param len 属性值长度（包括结尾的 '\0'）
+ * @param ext 扩展名（小写）
+ */
+static int isa_has_extension(const char *isa, uint32_t len, const char *ext)
+{
+    const char *end = isa + len;
+    size_t ext_len = strlen(ext);
+    const char *p = strchr(isa, '_'); /* 第一个 '_' 之前是基本指令集和单字母扩展 */
+    while (p && p < end && *p == '_') {
+        const char *name = ++p;
+        while (p < end && *p && *p != '_')
+            ++p;
+        if ((size_t)(p - name) == ext_len) {
+            size_t i = 0;
+            while (i < ext_len && name[i] == ext[i])
+                ++i;
+            if (i == ext_len)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 启动处理器的设备树节点是否声明了 Sstc 扩展
+ *
+ * 依次检查 riscv,isa-extensions（字符串列表）和 riscv,isa 属性。QEMU virt 的各处理器相同，
+ * 只检查启动处理器。
+ */
+static int fdt_cpu_has_sstc(const struct fdt_header *fdt)
+{
+    char path[32] = "/cpus/cpu@";
+    char digits[20];
+    size_t len = strlen(path), n = 0;
+    uint64_t hartid = boot_hartid();
+    do {
+        digits[n++] = '0' + hartid % 10;
+        hartid /= 10;
+    } while (hartid);
+    while (n)
+        path[len++] = digits[--n];
+    path[len] = '\0';
+
+    struct fdt_node_header *node = fdt_find_node_by_path(fdt, path);
+    if (!node)
+        return 0;
+    struct fdt_property *prop = fdt_get_prop(fdt, node, "riscv,isa-extensions");
+    if (prop) {
+        uint32_t prop_len = fdt_get_prop_value_len(prop);
+        for (uint32_t offset = 0; offset < prop_len; ) {
+            const char *ext = fdt_get_prop_str_value(prop, offset);
+            if (!strcmp(ext, "sstc"))
+                return 1;
+            offset += strlen(ext) + 1;
+        }
+        return 0;
+    }
+    prop = fdt_get_prop(fdt, node, "riscv,isa");
+    if (!prop)
+        return 0;
+    return isa_has_extension(fdt_get_prop_str_value(prop, 0), fdt_get_prop_value_len(prop), "sstc");
+}
+
+/**
+ * @brief M 模式固件是否允许 S 模式访问 stimecmp
+ *
+ * S 模式访问 stimecmp 需要固件设置 menvcfg.STCE，否则触发非法指令异常。
+ * OpenSBI 从 v1.1 开始在处理器支持 Sstc 时设置该位，其他固件和旧版 OpenSBI
+ * （如 tools/fw_jump.bin 的 v0.9）使用 SBI 调用设置定时器。
+ */
+static int sbi_enables_sstc()
+{
+    struct sbiret ret = sbi_get_impl_id();
+    if (ret.error || ret.value != OPENSBI)
+        return 0;
+    ret = sbi_get_impl_version();
+    return !ret.error && ret.value >= OPENSBI_VERSION(1, 1);
+}
+
+/**
+ * @brief 从设备树读取 time CSR 的计数频率，检测 Sstc 扩展
+ *
+ * 在 mem_init() 之前调用，此时启动页表线性映射了全部可能的物理内存。
+ * 读取失败时保持默认值 CLOCK_FREQ。
+ *
+ * @param fdt 设备树物理地址
+ */
+void clock_fdt_init(const struct fdt_header *fdt)
+{
+    if (!fdt)
+        return;
+    fdt = (const struct fdt_header *)VIRTUAL((uint64_t)fdt);
+    if (fdt->magic != FDT_MAGIC)
+        return;
+    has_sstc = fdt_cpu_has_sstc(fdt) && sbi_enables_sstc();
+    if (has_sstc)
+        kputs("clock: Sstc extension available, using stimecmp");
+    struct fdt_node_header *node = fdt_find_node_by_path(fdt, "/cpus");
+    struct fdt_property *prop;
+    if (!node || !(prop = fdt_get_prop(fdt, node, "timebase-frequency"))) {
+        kputs("clock: timebase-frequency not found");
+        return;
+    }
+    timebase_freq = fdt_get_prop_num_value(prop, 0);
+}
+
+/**
+ * @brief 将 time CSR 计数换算为纳秒
+ */
+uint64_t cycles_to_ns(uint64_t cycles)
+{
+    return cycles / timebase_freq * 1000000000 + cycles % timebase_freq * 1000000000 / timebase_freq;
+}
+
+/**
+ * @brief 将纳秒换算为 time CSR 计数（向上取整）
+ */
+uint64_t ns_to_cycles(uint64_t ns)
+{
+    return ns / 1000000000 * timebase_freq + (ns % 1000000000 * timebase_freq + 999999999) / 1000000000;
+}
+
+/**
+ * @brief 获取开机后经过的 tick 周期数，时间轮定时器以此为单位
+ *
+ * 与 ticks 不同，动态时钟停止 tick 时也保持准确。
+ */
+uint64_t get_jiffies()
+{
+    return get_cycles() / timebase;
+}
+
+/**
+ * @brief 将微秒换算为 tick 周期数（向上取整）
+ */
+uint64_t usecs_to_jiffies(uint64_t us)
+{
+    return (us * HZ + 999999) / 1000000;
+}
+
 /**
- * @brief 获取开机后经过的时钟周期数
- * @return uint64_t
+ * @brief 推进处理器的 tick 计数
+ *
+ * @return 自上次推进以来经过的 tick 数
  */
-static inline uint64_t get_cycles()
+static uint64_t tick_advance(struct cpu *cpu)
 {
-    uint64_t n;
-    __asm__ __volatile__("rdtime %0" : "=r"(n));
+    uint64_t n = (get_cycles() - cpu->last_tick) / timebase;
+    cpu->last_tick += n * timebase;
+    if (cpu->id == 0)
+        ticks += n;
     return n;
 }
 
+/**
+ * @brief tick 到期，更新时间统计并通知调度器
+ *
+ * 动态时钟下一次 tick 可能对应多个 tick 周期。停止的 tick 重新启动时 last_tick 已推进到当前时刻
+ * （见 clock_set_next_event()），停止期间的 tick 不会在这里补计。
+ */
+static void tick_sched_timer(struct hrtimer *timer)
+{
+    struct cpu *cpu = this_cpu();
+    uint64_t n = tick_advance(cpu);
+    run_timers();
+    /* 空闲时 tick 的间隔可能很长，经过的时间不计入任何进程 */
+    if (current != cpu->idle) {
+        if (trap_in_kernel(cpu->irq_regs))
+            current->cstime += n;
+        else
+            current->cutime += n;
+    }
+    scheduler_tick(n);
+    cpu->tick_interval = 0; /* tick 已经到期，由 clock_set_next_event() 重新启动 */
+    clock_set_next_event();
+}
+
 /**
  * @brief 初始化时钟
- * 设置时钟响应的频率与开启时钟中断
+ * 设置时钟响应的频率与开启启动处理器的时钟中断
  */
 void clock_init()
 {
-    /* QEMU 的时钟频率为 10MHz，设置timebase = 100000表示时钟中断频率为100Hz */
-    timebase = 100000;
+    /* timebase = timebase_freq / HZ 使时钟中断频率为 HZ */
+    timebase = timebase_freq / HZ;
     ticks = 0;
+    for (size_t i = 0; i < NR_CPUS; ++i)
+        hrtimer_init(&tick_timers[i], tick_sched_timer);
+    hrtimers_init();
+    init_timers();
+    clock_init_hart();
+    kprintf("Setup Timer! timebase-frequency = %u Hz\n", timebase_freq);
+}
+
+/**
+ * @brief 开启当前处理器的时钟中断，每个处理器都有自己的定时器
+ */
+void clock_init_hart()
+{
+    struct cpu *cpu = this_cpu();
+    cpu->last_tick = get_jiffies() * timebase; /* 与 jiffies 的边界对齐 */
+    cpu->next_event = 0; /* 定时器硬件尚未设置 */
+    cpu->tick_interval = 0;
     /* 开启时钟中断（设置CSR_MIE） */
     set_csr(sie, 1 << IRQ_S_TIMER);
     clock_set_next_event();
-    kputs("Setup Timer!");
 }
 
 /**
- * @brief 设置下一次时钟中断
+ * @brief 获取开机后经过的时间，供调度器计算进程运行时间
+ *
+ * 精度为 time CSR 的一个计数周期，比时钟中断细得多。
+ *
+ * @return 纳秒数
+ */
+uint64_t sched_clock()
+{
+    return cycles_to_ns(get_cycles());
+}
+
+/**
+ * @brief 按调度器需要的间隔重新设置当前处理器的 tick
+ *
+ * 本处理器的时间轮中有定时器时，tick 不晚于其中最早的到期时刻。
+ * 间隔没有变化时什么也不做。重新启动停止了的 tick 时，停止期间的 tick 不计入任何进程。
  */
 void clock_set_next_event()
 {
-    sbi_set_timer(get_cycles() + timebase);
+    struct cpu *cpu = this_cpu();
+    struct hrtimer *tick = &tick_timers[cpu->id];
+    uint64_t interval = sched_tick_interval(this_rq());
+    uint64_t expires = timer_next_expiry();
+    if (expires != UINT64_MAX) {
+        /* 间隔从 last_tick 算起，tick 停止时先推进到当前时刻 */
+        if (!cpu->tick_interval)
+            tick_advance(cpu);
+        uint64_t now = cpu->last_tick / timebase;
+        uint64_t delta = expires > now ? expires - now : 1;
+        if (!interval || delta < interval)
+            interval = delta;
+    }
+    if (interval == cpu->tick_interval)
+        return;
+    if (!cpu->tick_interval)
+        tick_advance(cpu);
+    cpu->tick_interval = interval;
+    if (interval)
+        hrtimer_start(tick, cpu->last_tick + interval * timebase);
+    else /* 在 tick 自己的回调函数中（时间轮定时器重新启动了 tick）取消失败，多发生一次 tick */
+        hrtimer_try_to_cancel(tick);
+}
+
+/**
+ * @brief 设置当前处理器的定时器硬件
+ *
+ * 时刻没有变化时不重新设置。支持 Sstc 扩展时直接写 stimecmp，不需要陷入 M 模式；
+ * 否则通过 SBI 调用设置。两种方式都会清除待处理的时钟中断。
+ *
+ * @param next 时钟中断的时刻（time CSR 计数），UINT64_MAX 表示不需要时钟中断
+ */
+void clock_program_event(uint64_t next)
+{
+    struct cpu *cpu = this_cpu();
+    if (next == cpu->next_event)
+        return;
+    cpu->next_event = next;
+    if (has_sstc)
+        write_csr(0x14d, next); /* stimecmp，旧版汇编器不认识其名称 */
+    else
+        sbi_set_timer(next);
+}
+
+/**
+ * @brief 定时器硬件已经到期，下一次 clock_program_event() 必须重新设置
+ *
+ * 否则时钟中断保持待处理状态。
+ */
+void clock_event_expired()
+{
+    this_cpu()->next_event = 0;
 }
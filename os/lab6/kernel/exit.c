@@ -0,0 +1,186 @@
+/**
+ * @file exit.c
+ * @brief 实现系统调用 exit() 和 waitpid()
+ *
+ * 进程退出时释放用户地址空间和打开的文件，进入僵尸状态（TASK_ZOMBIE），
+ * 等待父进程调用 waitpid() 回收进程控制块、内核堆栈（同一页）和页目录。
+ * 这些资源在进程退出时仍在使用，不能由进程自己释放。
+ *
+ * 父进程先于子进程退出时，子进程被进程 0 收养。进程 0 不调用 waitpid()，
+ * 而是在空闲时通过 reap_orphans() 回收子进程。
+ *
+ * 进程树和 tasks[] 由 tasks_lock 保护。
+ */
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <mm.h>
+#include <fs/vfs.h>
+
+/**
+ * @brief 将进程 p 从父进程的子进程链表中移除
+ *
+ * @param p 进程控制块
+ */
+static void unlink_task(struct task_struct *p)
+{
+    if (p->p_ysptr)
+        p->p_ysptr->p_osptr = p->p_osptr;
+    else
+        p->p_pptr->p_cptr = p->p_osptr;
+    if (p->p_osptr)
+        p->p_osptr->p_ysptr = p->p_ysptr;
+}
+
+/**
+ * @brief 将进程 p 加入父进程 parent 的子进程链表，成为最年轻的子进程
+ *
+ * @param p 进程控制块
+ * @param parent 父进程控制块
+ */
+static void link_task(struct task_struct *p, struct task_struct *parent)
+{
+    p->p_pptr = parent;
+    p->p_ysptr = NULL;
+    p->p_osptr = parent->p_cptr;
+    if (p->p_osptr)
+        p->p_osptr->p_ysptr = p;
+    parent->p_cptr = p;
+}
+
+/**
+ * @brief 回收僵尸进程 p 的全部资源
+ *
+ * 释放 PID、页目录和进程控制块所在页，耗时累加到父进程。
+ *
+ * @param p 僵尸进程
+ * @note 调用者持有 tasks_lock
+ */
+static void release(struct task_struct *p)
+{
+    /* p 可能还在其他处理器上切换出去，内核栈仍在使用 */
+    while (p->on_cpu)
+        ;
+    p->p_pptr->cutime += p->cutime;
+    p->p_pptr->cstime += p->cstime;
+    unlink_task(p);
+    tasks[p->pid] = NULL;
+    /* 用户地址空间的页表已在 exit() 时释放，内核页表被所有进程共享 */
+    free_page(PHYSICAL((uint64_t)p->pg_dir));
+    free_page(PHYSICAL((uint64_t)p));
+}
+
+/**
+ * @brief 结束当前进程
+ *
+ * 释放用户地址空间（页、三级页表和二级页表）和打开的文件，子进程交给进程 0 收养，
+ * 唤醒等待的父进程，然后切换到其他进程，永不返回。
+ *
+ * @param code 退出码
+ */
+void do_exit(uint32_t code)
+{
+    if (current == tasks[0])
+        panic("task[0] trying to exit");
+    free_page_tables(0, current->start_kernel);
+    for (size_t i = 0; i < 4; ++i) {
+        if (current->fd[i]) {
+            vfs_free_inode(current->fd[i]);
+            current->fd[i] = NULL;
+        }
+    }
+    acquire_lock(&tasks_lock);
+    while (current->p_cptr) {
+        struct task_struct *child = current->p_cptr;
+        unlink_task(child);
+        link_task(child, tasks[0]);
+    }
+    current->exit_code = code;
+    current->state = TASK_ZOMBIE;
+    wake_up(&current->p_pptr->wait_chldexit);
+    release_lock(&tasks_lock);
+    schedule();
+    panic("do_exit(): zombie task %u is scheduled", (uint64_t)current->pid);
+}
+
+/**
+ * @brief 实现系统调用 exit()
+ *
+ * @param 参数1 - 退出码
+ */
+long sys_exit(struct trapframe *tf)
+{
+    do_exit(tf->gpr.a0);
+    return 0;
+}
+
+/**
+ * @brief 实现系统调用 waitpid()
+ *
+ * 等待子进程退出并回收。pid 为 -1 时等待任一子进程，pid 为 0 时等待同一进程组的子进程，
+ * pid 小于 -1 时等待进程组 -pid 中的子进程，否则等待指定的子进程。
+ *
+ * @param 参数1 - pid
+ * @param 参数2 - 退出码存放地址（int *），可以为 NULL
+ * @param 参数3 - 选项，WNOHANG 表示没有已退出的子进程时立即返回
+ * @return 被回收的子进程 PID；设置了 WNOHANG 且子进程均未退出时返回 0；没有符合条件的子进程返回 -ECHILD
+ */
+long sys_waitpid(struct trapframe *tf)
+{
+    int64_t pid = tf->gpr.a0;
+    int *stat_addr = (int *)tf->gpr.a1;
+    uint64_t options = tf->gpr.a2;
+
+    acquire_lock(&tasks_lock);
+    while (1) {
+        int found = 0;
+        for (struct task_struct *p = current->p_cptr; p; p = p->p_osptr) {
+            if (pid > 0 && p->pid != pid)
+                continue;
+            if (pid == 0 && p->pgid != current->pgid)
+                continue;
+            if (pid < -1 && p->pgid != -pid)
+                continue;
+            found = 1;
+            if (p->state == TASK_ZOMBIE) {
+                long ret = p->pid;
+                int exit_code = p->exit_code;
+                release(p);
+                release_lock(&tasks_lock);
+                /* 写用户内存可能发生缺页异常，在锁外进行 */
+                if (stat_addr)
+                    *stat_addr = exit_code;
+                return ret;
+            }
+        }
+        if (!found || (options & WNOHANG)) {
+            release_lock(&tasks_lock);
+            return found ? 0 : -ECHILD;
+        }
+        interruptible_sleep_on_lock(&current->wait_chldexit, &tasks_lock);
+    }
+}
+
+/**
+ * @brief 回收进程 0 的僵尸子进程
+ *
+ * 由进程 0 在空闲时调用（系统调用`idle()`）。
+ *
+ * @return 回收的进程数
+ */
+int reap_orphans()
+{
+    int cnt = 0;
+    acquire_lock(&tasks_lock);
+    struct task_struct *p = tasks[0]->p_cptr;
+    while (p) {
+        struct task_struct *next = p->p_osptr;
+        if (p->state == TASK_ZOMBIE) {
+            release(p);
+            ++cnt;
+        }
+        p = next;
+    }
+    release_lock(&tasks_lock);
+    return cnt;
+}
@@ -14,12 +14,14 @@
 /**
  * @brief 将当前进程的虚拟地址空间拷贝给进程 p
  *
+ * 用户地址空间写时复制，内核地址空间直接共享内核页表。
+ *
  * @param p task_struct 指针
  */
 int copy_mem(struct task_struct * p)
 {
     copy_page_tables(0, p->pg_dir, 0, current->start_kernel);
-    copy_page_tables(current->start_kernel, p->pg_dir, p->start_kernel, 0x100000000 - current->start_kernel);
+    share_kernel_pg_dir(p->pg_dir);
     return 1;
 }
 
@@ -46,6 +48,7 @@ void verify_area(uint64_t addr,int size)
  * PID 被实现为`tasks[]`数组下标。
  *
  * @return 返回可用的 PID;无可用 PID 则返回 NR_TASKS。
+ * @note 调用者持有 tasks_lock
  */
 static uint32_t find_empty_process()
 {
@@ -69,10 +72,6 @@ static uint32_t find_empty_process()
  */
 long sys_fork(struct trapframe *tf)
 {
-    uint32_t nr = find_empty_process();
-    if (nr == NR_TASKS) {
-        return -EAGAIN;
-    }
     uint64_t page = get_free_page();
     if (!page) {
         return -EAGAIN;
@@ -89,23 +88,48 @@ long sys_fork(struct trapframe *tf)
     p->context = *tf;
     p->context.epc += INST_LEN(p->context.epc);
     p->pg_dir = (uint64_t *)VIRTUAL(page_dir);
-    tasks[nr] = p;
-    kprintf("process %x forks process %x\n", (uint64_t)current->pid, (uint64_t)nr);
-
-    /* 在此之间发生错误，将不会创建进程，系统处于安全状态 */
-    copy_mem(p);
-
+    p->asid = 0; /* 首次调度时分配 ASID */
     p->state = TASK_UNINTERRUPTIBLE;
-    p->pid = nr;
-    p->counter = p->priority = 15;
+    /* 子进程继承父进程的调度策略和优先级 */
+    p->on_rq = p->need_resched = p->on_cpu = 0;
+    p->last_cpu = NULL;
+    if (!p->sched_class) /* 进程 0 不属于任何调度类，其子进程使用公平调度类 */
+        p->sched_class = &fair_sched_class;
     p->start_time = ticks;
+    p->utime = p->stime = p->cutime = p->cstime = 0;
+    p->wait_chldexit = NULL;
+    p->cpu = select_task_rq(p);
+
+    acquire_lock(&tasks_lock);
+    uint32_t nr = find_empty_process();
+    if (nr == NR_TASKS) {
+        release_lock(&tasks_lock);
+        free_page(page_dir);
+        free_page(page);
+        return -EAGAIN;
+    }
+    p->pid = nr;
+    tasks[nr] = p;
+    /* 新进程是父进程最年轻的子进程 */
     p->p_pptr = current;
-    p->p_osptr = current->p_ysptr;
+    p->p_cptr = NULL;
+    p->p_ysptr = NULL;
+    p->p_osptr = current->p_cptr;
     if (p->p_osptr) {
-        p->p_osptr->p_ysptr = current;
+        p->p_osptr->p_ysptr = p;
     }
     current->p_cptr = p;
+    release_lock(&tasks_lock);
+    kprintf("process %x forks process %x\n", (uint64_t)current->pid, (uint64_t)nr);
+
+    copy_mem(p);
+    /* 子进程与父进程共享打开的文件 */
+    for (size_t i = 0; i < 4; ++i) {
+        if (p->fd[i]) {
+            vfs_ref_inode(p->fd[i]);
+        }
+    }
     p->context.gpr.a0 = 0; /* 新进程 fork() 返回值 */
-    p->state= TASK_RUNNING;
+    wake_up_new_task(p);
     return nr;
 }
@@ -0,0 +1,209 @@
+/**
+ * @file hrtimer.c
+ * @brief 实现高精度定时器
+ *
+ * 每个处理器一个定时器队列，由队列的锁保护。回调函数运行时不持有锁，队列记录正在运行的定时器，
+ * hrtimer_cancel() 等待其运行结束，返回后调用者可以释放定时器。
+ *
+ * 锁的顺序：运行队列的锁在前，定时器队列的锁在后（schedule() 持有运行队列的锁时会重新设置 tick）。
+ */
+#include <hrtimer.h>
+#include <clock.h>
+#include <smp.h>
+#include <kdebug.h>
+#include <utils/atomic.h>
+
+/** 处理器的定时器队列 */
+struct hrtimer_base {
+    struct spinlock lock;                       /**< 保护定时器队列 */
+    struct rb_root active;                      /**< 等待到期的定时器，按到期时刻排序 */
+    struct rb_node *leftmost;                   /**< 最早到期的定时器 */
+    struct hrtimer *volatile running;           /**< 正在运行回调函数的定时器 */
+    struct cpu *cpu;                            /**< 所属的处理器 */
+};
+
+static struct hrtimer_base hrtimer_bases[NR_CPUS];
+
+/**
+ * @brief 初始化各处理器的定时器队列
+ */
+void hrtimers_init()
+{
+    for (size_t i = 0; i < NR_CPUS; ++i) {
+        struct hrtimer_base *base = &hrtimer_bases[i];
+        init_lock(&base->lock, "hrtimer");
+        base->active = RB_ROOT;
+        base->leftmost = NULL;
+        base->running = NULL;
+        base->cpu = &cpus[i];
+    }
+}
+
+/**
+ * @brief 初始化定时器
+ *
+ * @param timer 定时器
+ * @param function 到期时调用的函数
+ */
+void hrtimer_init(struct hrtimer *timer, void (*function)(struct hrtimer *))
+{
+    timer->expires = 0;
+    timer->function = function;
+    timer->base = NULL;
+    timer->enqueued = 0;
+}
+
+/**
+ * @brief 将定时器设置为队列中最早的到期时刻
+ *
+ * @note 调用者持有 base->lock，base 是本处理器的定时器队列
+ */
+static void hrtimer_reprogram(struct hrtimer_base *base)
+{
+    uint64_t next = UINT64_MAX;
+    if (base->leftmost)
+        next = rb_entry(base->leftmost, struct hrtimer, node)->expires;
+    clock_program_event(next);
+}
+
+/**
+ * @brief 将定时器加入队列，到期时刻相同的定时器按加入的顺序到期
+ */
+static void enqueue_hrtimer(struct hrtimer_base *base, struct hrtimer *timer)
+{
+    struct rb_node **link = &base->active.node;
+    struct rb_node *parent = NULL;
+    int leftmost = 1;
+    while (*link) {
+        parent = *link;
+        if (timer->expires < rb_entry(parent, struct hrtimer, node)->expires) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+    if (leftmost)
+        base->leftmost = &timer->node;
+    rb_link_node(&timer->node, parent, link);
+    rb_insert_color(&timer->node, &base->active);
+    timer->base = base;
+    timer->enqueued = 1;
+}
+
+/**
+ * @brief 将定时器移出队列
+ */
+static void remove_hrtimer(struct hrtimer_base *base, struct hrtimer *timer)
+{
+    if (base->leftmost == &timer->node)
+        base->leftmost = rb_next(&timer->node);
+    rb_erase(&timer->node, &base->active);
+    timer->enqueued = 0;
+}
+
+/**
+ * @brief 启动定时器
+ *
+ * 定时器加入本处理器的队列，已经启动的定时器先从原来的队列中移除。回调函数正在其他处理器上
+ * 运行时定时器留在原来的队列中，使 hrtimer_cancel() 能够等待到回调函数结束。
+ * 到期时刻已经过去的定时器在下一次时钟中断（立即发生）中到期。
+ *
+ * @param timer 定时器
+ * @param expires 到期时刻（time CSR 计数）
+ */
+void hrtimer_start(struct hrtimer *timer, uint64_t expires)
+{
+    struct hrtimer_base *base = &hrtimer_bases[this_cpu()->id];
+    struct hrtimer_base *old = timer->base;
+    if (old && old != base) {
+        uint64_t flags = acquire_lock_irqsave(&old->lock);
+        if (timer->enqueued)
+            remove_hrtimer(old, timer);
+        if (old->running == timer) {
+            /* 原处理器运行完回调函数后会重新设置时钟，不必在这里设置 */
+            timer->expires = expires;
+            enqueue_hrtimer(old, timer);
+            release_lock_irqrestore(&old->lock, flags);
+            return;
+        }
+        release_lock_irqrestore(&old->lock, flags);
+    }
+    uint64_t flags = acquire_lock_irqsave(&base->lock);
+    if (timer->enqueued)
+        remove_hrtimer(base, timer);
+    timer->expires = expires;
+    enqueue_hrtimer(base, timer);
+    if (base->leftmost == &timer->node)
+        hrtimer_reprogram(base);
+    release_lock_irqrestore(&base->lock, flags);
+}
+
+/**
+ * @brief 尝试取消定时器，不等待正在运行的回调函数
+ *
+ * @param timer 定时器
+ * @return 定时器在等待到期返回 1，否则返回 0；回调函数正在运行时不取消，返回 -1
+ */
+int hrtimer_try_to_cancel(struct hrtimer *timer)
+{
+    struct hrtimer_base *base = timer->base;
+    if (!base)
+        return 0;
+    uint64_t flags = acquire_lock_irqsave(&base->lock);
+    int ret = -1;
+    if (base->running != timer) {
+        ret = timer->enqueued;
+        if (ret) {
+            remove_hrtimer(base, timer);
+            /* 远程处理器的定时器不能在这里重新设置，多余的时钟中断不会产生影响 */
+            if (base->cpu == this_cpu())
+                hrtimer_reprogram(base);
+        }
+    }
+    release_lock_irqrestore(&base->lock, flags);
+    return ret;
+}
+
+/**
+ * @brief 取消定时器
+ *
+ * 定时器的回调函数正在其他处理器上运行时等待其结束。
+ *
+ * @param timer 定时器
+ * @return 定时器在等待到期返回 1，否则返回 0
+ * @note 不能在定时器自己的回调函数中调用
+ */
+int hrtimer_cancel(struct hrtimer *timer)
+{
+    int ret;
+    while ((ret = hrtimer_try_to_cancel(timer)) < 0)
+        ;
+    return ret;
+}
+
+/**
+ * @brief 时钟中断处理程序，运行本处理器上所有到期的定时器
+ *
+ * 最后将定时器设置为剩余定时器中最早的到期时刻。
+ */
+void hrtimer_interrupt()
+{
+    struct hrtimer_base *base = &hrtimer_bases[this_cpu()->id];
+    clock_event_expired();
+    acquire_lock(&base->lock);
+    uint64_t now = get_cycles();
+    while (base->leftmost) {
+        struct hrtimer *timer = rb_entry(base->leftmost, struct hrtimer, node);
+        if (timer->expires > now)
+            break;
+        remove_hrtimer(base, timer);
+        base->running = timer;
+        release_lock(&base->lock);
+        timer->function(timer);
+        acquire_lock(&base->lock);
+        base->running = NULL;
+    }
+    hrtimer_reprogram(base);
+    release_lock(&base->lock);
+}
@@ -1,6 +1,21 @@
 /**
  * @file sched.c
  * @brief 实现绝大部分和进程有关的函数
+ *
+ * 每个处理器有自己的运行队列（struct rq），由运行队列的锁保护。schedule() 只从本处理器的
+ * 运行队列中选择进程；唤醒进程时锁住进程所在的运行队列，被唤醒的进程应抢占远程处理器上的
+ * 进程时通过处理器间中断（IPI）通知它重新调度。
+ *
+ * 负载均衡：各处理器每 BALANCE_INTERVAL 个 tick 从最忙的运行队列拉取进程，运行队列为空时
+ * 立即尝试拉取（work stealing），见 load_balance()。进程只在 cpus_allowed 允许的处理器上运行，
+ * 正在运行的进程不再允许在当前处理器上运行时，由 schedule() 把它推到其他处理器。
+ *
+ * 动态时钟：空闲的处理器停止时钟中断，只有一个可运行进程的处理器延长时钟中断间隔，
+ * 见 sched_tick_interval()。停止了时钟的空闲处理器由忙碌的处理器在周期性负载均衡时
+ * 用处理器间中断唤醒，从而拉取进程。
+ *
+ * 锁的顺序：tasks_lock、驱动和睡眠队列的锁在前，运行队列的锁在后；同时持有两个运行队列的锁时
+ * 按地址从低到高加锁，见 double_lock_balance()。
  */
 #include <assert.h>
 #include <clock.h>
@@ -16,12 +31,18 @@ extern void boot_stack_top(void); /** 启动阶段内核堆栈最高地址处 */
 /** 进程 0 */
 union task_union init_task;
 
-/** 当前进程进程控制块 */
-struct task_struct* current = NULL;
-
 /** 系统所有进程的进程控制块指针数组 */
 struct task_struct* tasks[NR_TASKS];
 
+/** 保护 tasks[] 和进程树（父子、兄弟关系），不在中断处理程序中使用 */
+struct spinlock tasks_lock;
+
+/** 运行队列，每个处理器一个 */
+struct rq runqueues[NR_CPUS];
+
+/** 优先级最高的调度类 */
+static const struct sched_class *const sched_class_highest = &rt_sched_class;
+
 /**
  * @brief 将进程处理器状态 context 压入进程内核堆栈
  *
@@ -47,21 +68,46 @@ void save_context(context* context)
     current->context = *context;
 }
 
+/**
+ * @brief 初始化处理器 cpu 的运行队列
+ */
+static void rq_init(struct rq *rq, struct cpu *cpu)
+{
+    init_lock(&rq->lock, "rq");
+    rq->cpu = cpu;
+    rq->curr = rq->idle = NULL;
+    rq->nr_running = 0;
+    rq->balance_ticks = BALANCE_INTERVAL;
+    rq->nr_balance_failed = 0;
+    rt_rq_init(&rq->rt);
+    rq->cfs.load = 0;
+    rq->cfs.nr_running = 0;
+    rq->cfs.min_vruntime = 0;
+    rq->cfs.tasks_timeline = RB_ROOT;
+    rq->cfs.rb_leftmost = NULL;
+    rq->cfs.curr = NULL;
+}
+
 /**
  * @brief 初始化进程模块
  *
- * 主要负责初始化进程 0
+ * 主要负责初始化各处理器的运行队列和进程 0，进程 0 是启动处理器的空闲进程
  */
 void sched_init()
 {
+    for (size_t i = 0; i < NR_CPUS; ++i)
+        rq_init(&runqueues[i], &cpus[i]);
+    init_lock(&tasks_lock, "tasks");
     tasks[0] = (struct task_struct*)&init_task;
     for (size_t i = 1; i < NR_TASKS; ++i) {
         tasks[i] = NULL;
     }
     init_task.task = (struct task_struct) {
         .state = TASK_RUNNING,
-        .counter = 15,
-        .priority = 15,
+        .policy = SCHED_NORMAL,
+        .nice = 0,
+        .se = { .weight = NICE_0_LOAD },
+        .cpus_allowed = CPU_MASK_ALL,
         .start_code = START_CODE,
         .start_stack = START_STACK,
         .start_kernel = START_KERNEL,
@@ -70,16 +116,51 @@ void sched_init()
         .start_data = (uint64_t)&data_start - (0xC0200000 - 0x00010000),
         .end_data = (uint64_t)&kernel_end - (0xC0200000 - 0x00010000),
         .brk = (uint64_t)kernel_end - (0xC0200000 - 0x00010000),
-        .pg_dir = pg_dir,
+        .pg_dir = current_pg_dir,
     };
+    init_idle(&cpus[0], &init_task.task);
+}
 
-    current = &init_task.task;
+/**
+ * @brief 设置处理器 cpu 的空闲进程
+ *
+ * 空闲进程不属于任何调度类，不在运行队列中，运行队列为空时运行。
+ *
+ * @param cpu 处理器
+ * @param idle 空闲进程，即处理器上当前的执行流
+ */
+void init_idle(struct cpu *cpu, struct task_struct *idle)
+{
+    struct rq *rq = cpu_rq(cpu);
+    idle->cpu = idle->last_cpu = cpu;
+    idle->on_cpu = 1;
+    rq->curr = rq->idle = idle;
+    cpu->curr = cpu->idle = idle;
+}
+
+/**
+ * @brief 除启动处理器外其他处理器的空闲进程
+ *
+ * 没有需要运行的进程时用 wfi 等待中断，被唤醒的进程加入本处理器的运行队列后
+ * 由时钟中断或处理器间中断设置 need_resched。空闲进程运行在内核态，中断返回时不会调度，
+ * 由本函数调用 schedule()。
+ */
+void cpu_idle()
+{
+    while (1) {
+        disable_interrupt();
+        if (current->need_resched)
+            schedule();
+        else
+            __asm__ __volatile__("wfi");
+        enable_interrupt(); /* 处理唤醒处理器的中断 */
+    }
 }
 
 /**
  * @brief 切换进程
  *
- * 保存当前进程处理器状态 `context`，切换到进程号为 `task` 的进程。
+ * 保存当前进程处理器状态 `context`，切换到进程 `next`。
  *
  * 本函数仅实现进程切换，发生进程切换时，进程从此函数切换到别的进程，
  * 恢复时返回到本函数并直接退出，不做多余的事情。
@@ -88,16 +169,18 @@ void sched_init()
  * 会在本函数返回时恢复。因此，只要只需要存储必要的信息，确保退出函数栈帧
  * 时能够恢复 callee-saved registers 即可，不需要保存全部通用寄存器。
  *
- * @return 目标进程的处理器状态指针
+ * 运行队列的锁 lock 由调用者持有，在切换到 next 的内核栈之后才释放，同时清除当前进程的
+ * on_cpu：在此之前其他处理器不能运行或释放当前进程。
+ *
+ * @param next 下一个进程，不能是当前进程
+ * @param lock 调用者持有的运行队列的锁
  */
-void switch_to(size_t task)
+void switch_to(struct task_struct *next, struct spinlock *lock)
 {
-    if (current == tasks[task]) {
-        return;
-    }
-
+    struct task_struct *prev = current;
+    struct cpu *cpu = this_cpu();
 
-    register uint64_t t0 asm("t0") = (uint64_t)&current->context;
+    register uint64_t t0 asm("t0") = (uint64_t)&prev->context;
     __asm__ __volatile__ (
             "sd sp, 16(%0)\n\t"
             "sd s0, 64(%0)\n\t"
@@ -111,69 +194,583 @@ void switch_to(size_t task)
             : "r" (t0)
             : "memory", "t1"
             );
-    current->context.status |= SSTATUS_SPP; /* 确保切换后处理器处于 S-mode */
-    current->context.epc = (uint64_t)&&ret; /* 返回后直接退出函数 */
+    /* 确保切换后处理器处于 S-mode，并且与调用 schedule() 时一样关中断 */
+    prev->context.status = (prev->context.status | SSTATUS_SPP) & ~SSTATUS_SPIE;
+    prev->context.epc = (uint64_t)&&ret; /* 返回后直接退出函数 */
 
-    current = tasks[task];
-    pg_dir = current->pg_dir;
-    active_mapping();
+    /* next 刚被迁移过来，可能还没有在原来的处理器上完成切换 */
+    while (next->on_cpu)
+        ;
+    next->on_cpu = 1;
+    cpu->curr = next;
+    cpu->pg_dir = next->pg_dir;
+    switch_mm(next);
     char* stack;
 
     /* 用户态：内核堆栈为空 */
-    if (current->context.gpr.sp < START_KERNEL) {
-        stack  = (char*)current + PAGE_SIZE;
+    if (next->context.gpr.sp < START_KERNEL) {
+        stack  = (char*)next + PAGE_SIZE;
     } else { /* 内核态：堆栈不为空 */
-        stack = (char*)current->context.gpr.sp;
+        stack = (char*)next->context.gpr.sp;
     }
-    __trapret(push_context(stack, &current->context));
+    /* 在内核态恢复时 tp 必须指向本处理器，进程可能上一次运行在其他处理器上 */
+    if (next->context.status & SSTATUS_SPP)
+        next->context.gpr.tp = (uint64_t)cpu;
+    __switch_trapret(push_context(stack, &next->context), lock, &prev->on_cpu);
 ret:
     return;
 }
 
 /**
- * @brief 进程调度函数
+ * @brief 计算运行队列所在处理器需要的时钟中断间隔
  *
- * 使用公平调度算法(CFS)。
- * 进程 0 不参加调度，当且仅当只有进程 0 时选择进程 0
+ * - 运行队列为空：不需要时钟中断，进程被唤醒时由处理器间中断或其他中断唤醒处理器
+ * - 只有一个公平调度类的进程：不会发生时间片轮转，只需要周期性的负载均衡和时间统计
+ * - 其他情况：每个 tick 检查时间片和实时进程的带宽
  *
- * @return 目标进程的进程号
+ * @return 间隔（ticks），0 表示不需要时钟中断
  */
-void schedule()
+uint64_t sched_tick_interval(struct rq *rq)
+{
+    if (!rq->nr_running)
+        return 0;
+    if (rq->nr_running == 1 && !rq->rt.nr_running)
+        return BALANCE_INTERVAL;
+    return 1;
+}
+
+/**
+ * @brief 运行队列需要更频繁的时钟中断时，让其处理器重新设置时钟中断
+ *
+ * 远程处理器通过处理器间中断通知，中断处理程序重新设置时钟中断。
+ */
+static void tick_update(struct rq *rq)
+{
+    if (rq->cpu->tick_interval == 1 || sched_tick_interval(rq) != 1)
+        return;
+    if (rq->cpu == this_cpu())
+        clock_set_next_event();
+    else
+        smp_send_reschedule(rq->cpu);
+}
+
+/**
+ * @brief 将进程加入运行队列
+ */
+static void enqueue_task(struct rq *rq, struct task_struct *p)
+{
+    p->sched_class->enqueue_task(rq, p);
+    p->on_rq = 1;
+    ++rq->nr_running;
+    tick_update(rq);
+}
+
+/**
+ * @brief 将进程移出运行队列
+ */
+static void dequeue_task(struct rq *rq, struct task_struct *p)
 {
-    int i, next, c;
-    struct task_struct** p;
+    p->sched_class->dequeue_task(rq, p);
+    p->on_rq = 0;
+    --rq->nr_running;
+}
 
+/**
+ * @brief 锁住进程 p 所在的运行队列（关中断）
+ *
+ * 加锁后重新检查：等待锁期间进程可能被移到了其他运行队列。
+ *
+ * @param p 进程
+ * @param flags 保存中断状态，传给 task_rq_unlock()
+ * @return 进程所在的运行队列
+ */
+struct rq *task_rq_lock(struct task_struct *p, uint64_t *flags)
+{
+    struct rq *rq;
     while (1) {
-        c = -1;
-        next = 0;
-        i = NR_TASKS;
-        p = &tasks[NR_TASKS];
-        while (--i) {
-            if (!*--p)
-                continue;
-            /* 小心混用无符号数和有符号数！ */
-            if ((*p)->state == TASK_RUNNING && (int32_t)(*p)->counter > c) {
-                c = (*p)->counter;
-                next = i;
-            }
+        rq = task_rq(p);
+        *flags = acquire_lock_irqsave(&rq->lock);
+        if (rq == task_rq(p))
+            return rq;
+        release_lock_irqrestore(&rq->lock, *flags);
+    }
+}
+
+/**
+ * @brief 解锁 task_rq_lock() 锁住的运行队列
+ */
+void task_rq_unlock(struct rq *rq, uint64_t flags)
+{
+    release_lock_irqrestore(&rq->lock, flags);
+}
+
+/**
+ * @brief 要求运行队列 rq 上正在运行的进程重新调度
+ *
+ * 远程处理器上的进程通过处理器间中断通知，中断返回前（或空闲进程的循环中）调用 schedule()。
+ *
+ * @note 调用者持有 rq->lock
+ */
+void resched_curr(struct rq *rq)
+{
+    rq->curr->need_resched = 1;
+    if (rq->cpu != this_cpu())
+        smp_send_reschedule(rq->cpu);
+}
+
+/**
+ * @brief 判断刚加入运行队列的进程 p 是否应抢占运行队列上正在运行的进程
+ *
+ * 空闲进程总是被抢占；调度类不同时优先级高的调度类抢占；调度类相同时由调度类判断。
+ */
+static void check_preempt_curr(struct rq *rq, struct task_struct *p)
+{
+    struct task_struct *curr = rq->curr;
+    if (curr == rq->idle) {
+        resched_curr(rq);
+        return;
+    }
+    if (p->sched_class == curr->sched_class) {
+        p->sched_class->check_preempt_curr(rq, p);
+        return;
+    }
+    for (const struct sched_class *class = sched_class_highest; class; class = class->next) {
+        if (class == curr->sched_class)
+            return;
+        if (class == p->sched_class) {
+            resched_curr(rq);
+            return;
         }
+    }
+}
+
+/**
+ * @brief 在持有 this_rq->lock 的情况下再锁住运行队列 busiest
+ *
+ * 两个运行队列的锁按地址从低到高获取，必要时先释放 this_rq->lock 再按顺序重新加锁。
+ *
+ * @param this_rq 调用者持有其锁的运行队列
+ * @param busiest 另一个运行队列，不能与 this_rq 相同
+ * @return 释放过 this_rq->lock 返回 1，此时 this_rq 可能已经改变，调用者需要重新检查；否则返回 0
+ */
+int double_lock_balance(struct rq *this_rq, struct rq *busiest)
+{
+    if (busiest > this_rq) {
+        acquire_lock(&busiest->lock);
+        return 0;
+    }
+    release_lock(&this_rq->lock);
+    acquire_lock(&busiest->lock);
+    acquire_lock(&this_rq->lock);
+    return 1;
+}
+
+/**
+ * @brief 将运行队列 src_rq 中的进程 p 迁移到运行队列 dst_rq
+ *
+ * 公平调度类的进程保留相对于 min_vruntime 的偏移，各运行队列的 vruntime 互不相关。
+ *
+ * @param src_rq 进程所在的运行队列
+ * @param p 进程，在运行队列中但不是 src_rq 正在运行的进程
+ * @param dst_rq 目标运行队列
+ * @note 调用者持有两个运行队列的锁
+ */
+void move_task(struct rq *src_rq, struct task_struct *p, struct rq *dst_rq)
+{
+    dequeue_task(src_rq, p);
+    p->se.vruntime -= src_rq->cfs.min_vruntime;
+    p->cpu = dst_rq->cpu;
+    p->se.vruntime += dst_rq->cfs.min_vruntime;
+    enqueue_task(dst_rq, p);
+    check_preempt_curr(dst_rq, p);
+}
+
+/**
+ * @brief 设置进程允许运行的处理器
+ *
+ * 进程所在的处理器不再被允许时：在运行队列中等待的进程立即迁移；正在运行的进程要求重新调度，
+ * 由 schedule() 迁移；睡眠的进程直接改变处理器，被唤醒时加入新处理器的运行队列。
+ *
+ * @param p 进程，不能是空闲进程
+ * @param mask 处理器位图，第 i 位对应 cpus[i]
+ * @return 成功返回 0，mask 不包含在线处理器返回 -EINVAL
+ */
+int set_cpus_allowed(struct task_struct *p, uint64_t mask)
+{
+    if (!(mask & cpu_online_mask()))
+        return -EINVAL;
+    uint64_t flags;
+    struct rq *rq = task_rq_lock(p, &flags);
+    p->cpus_allowed = mask;
+    if (task_allowed_on(p, rq->cpu)) {
+        task_rq_unlock(rq, flags);
+        return 0;
+    }
+    struct rq *dst_rq = cpu_rq(select_task_rq(p));
+    if (p == rq->curr) {
+        resched_curr(rq);
+    } else if (!p->on_rq) {
+        p->cpu = dst_rq->cpu;
+    } else {
+        double_lock_balance(rq, dst_rq);
+        /* 释放锁期间进程可能已被迁移或开始运行 */
+        if (p->on_rq && task_rq(p) == rq && p != rq->curr)
+            move_task(rq, p, dst_rq);
+        else if (p == rq->curr)
+            resched_curr(rq);
+        else if (!p->on_rq && task_rq(p) == rq)
+            p->cpu = dst_rq->cpu;
+        release_lock(&dst_rq->lock);
+    }
+    task_rq_unlock(rq, flags);
+    return 0;
+}
+
+/**
+ * @brief 唤醒进程
+ *
+ * 将进程状态设为 TASK_RUNNING 并加入它所在处理器的运行队列。进程状态只能通过本函数改为 TASK_RUNNING。
+ * 被唤醒的进程应抢占该处理器上正在运行的进程时要求其重新调度。
+ *
+ * @param p 进程控制块
+ */
+void wake_up_process(struct task_struct *p)
+{
+    uint64_t flags;
+    struct rq *rq = task_rq_lock(p, &flags);
+    p->state = TASK_RUNNING;
+    if (p != rq->idle && !p->on_rq) {
+        enqueue_task(rq, p);
+        check_preempt_curr(rq, p);
+    }
+    task_rq_unlock(rq, flags);
+}
 
-        /* 没有用户进程 */
-        if (c)
-            break;
+/**
+ * @brief 新进程第一次加入运行队列
+ *
+ * 由调度类初始化新进程的调度信息，然后唤醒新进程。
+ *
+ * @param p 新进程，调度类和处理器已设置
+ */
+void wake_up_new_task(struct task_struct *p)
+{
+    uint64_t flags;
+    struct rq *rq = task_rq_lock(p, &flags);
+    p->sched_class->task_fork(rq, p);
+    p->state = TASK_RUNNING;
+    enqueue_task(rq, p);
+    check_preempt_curr(rq, p);
+    task_rq_unlock(rq, flags);
+}
 
-        /* 所有可运行的进程都耗尽了时间片 */
-        for (p = &LAST_TASK; p > &FIRST_TASK; --p) {
-            if (*p) {
-                (*p)->counter = ((*p)->counter >> 1) + (*p)->priority;
-            }
+/**
+ * @brief 为新进程选择处理器
+ *
+ * 在 cpus_allowed 允许的在线处理器中选择可运行进程最少的，相同时优先选择当前处理器。
+ *
+ * @param p 进程，cpus_allowed 至少包含一个在线处理器
+ * @return 处理器
+ */
+struct cpu *select_task_rq(struct task_struct *p)
+{
+    struct cpu *best = NULL;
+    uint64_t load = 0;
+    if (task_allowed_on(p, this_cpu())) {
+        best = this_cpu();
+        load = cpu_rq(best)->nr_running;
+    }
+    for (uint64_t i = 0; i < nr_cpus; ++i) {
+        struct cpu *cpu = &cpus[i];
+        if (!cpu->online || !task_allowed_on(p, cpu))
+            continue;
+        if (!best || cpu_rq(cpu)->nr_running < load) {
+            best = cpu;
+            load = cpu_rq(cpu)->nr_running;
         }
     }
-    // kprintf("switch to %u\n", next);
-    switch_to(next);
+    assert(best, "select_task_rq(): no allowed cpu online");
+    return best;
 }
 
-static inline void __sleep_on(struct task_struct **p, int state)
+/**
+ * @brief 唤醒一个停止了时钟的空闲处理器，让它从忙碌的运行队列 busiest 拉取进程
+ *
+ * 处理器间中断使空闲进程重新调度，运行队列为空的 schedule() 会进行负载均衡。
+ */
+static void kick_idle_cpu(struct rq *busiest)
+{
+    for (uint64_t i = 0; i < nr_cpus; ++i) {
+        struct cpu *cpu = &cpus[i];
+        struct rq *rq = cpu_rq(cpu);
+        if (rq == busiest || !cpu->online || cpu->tick_interval || rq->nr_running)
+            continue;
+        smp_send_reschedule(cpu);
+        return;
+    }
+}
+
+/**
+ * @brief 时钟中断时调用，更新当前进程的时间片
+ *
+ * 当前进程需要让出处理器时设置 need_resched，由中断返回前调用 schedule()。
+ * 每个处理器在自己的时钟中断中处理自己的运行队列，并周期性地进行负载均衡。
+ *
+ * @param n 自上次时钟中断以来经过的 tick 数，动态时钟下可能大于 1，也可能为 0
+ */
+void scheduler_tick(uint64_t n)
+{
+    struct rq *rq = this_rq();
+    acquire_lock(&rq->lock);
+    update_rt_bandwidth(rq);
+    if (rq->curr != rq->idle)
+        rq->curr->sched_class->task_tick(rq, rq->curr);
+    if (rq->balance_ticks <= n) {
+        rq->balance_ticks = BALANCE_INTERVAL;
+        load_balance(rq, rq->curr == rq->idle);
+        if (rq->nr_running > 1)
+            kick_idle_cpu(rq);
+    } else {
+        rq->balance_ticks -= n;
+    }
+    if (rq->curr == rq->idle)
+        rq->curr->need_resched |= rq->nr_running > 0;
+    release_lock(&rq->lock);
+}
+
+/**
+ * @brief 设置进程的调度策略和实时优先级
+ *
+ * 进程在运行队列中时先移出，改变调度类后重新加入；正在运行的进程随后重新调度。
+ *
+ * @param p 进程，不能是进程 0
+ * @param policy 调度策略，SCHED_*
+ * @param rt_priority 实时优先级，SCHED_FIFO、SCHED_RR 为 1 ~ MAX_RT_PRIO - 1，SCHED_NORMAL 为 0
+ * @return 成功返回 0，参数无效返回 -EINVAL，p 为进程 0 返回 -EPERM
+ */
+int sched_setscheduler(struct task_struct *p, uint32_t policy, uint32_t rt_priority)
+{
+    if (policy != SCHED_NORMAL && policy != SCHED_FIFO && policy != SCHED_RR)
+        return -EINVAL;
+    if (rt_priority >= MAX_RT_PRIO || (policy == SCHED_NORMAL) != (rt_priority == 0))
+        return -EINVAL;
+    if (p == tasks[0])
+        return -EPERM;
+    uint64_t flags;
+    struct rq *rq = task_rq_lock(p, &flags);
+    uint32_t on_rq = p->on_rq;
+    uint32_t running = p == rq->curr;
+    if (on_rq)
+        dequeue_task(rq, p);
+    if (running)
+        p->sched_class->put_prev_task(rq, p);
+    p->policy = policy;
+    p->rt_priority = rt_priority;
+    p->sched_class = policy == SCHED_NORMAL ? &fair_sched_class : &rt_sched_class;
+    p->time_slice = RR_TIMESLICE;
+    if (on_rq)
+        enqueue_task(rq, p);
+    if (running) {
+        p->sched_class->set_curr_task(rq, p);
+        resched_curr(rq);
+    } else if (on_rq) {
+        check_preempt_curr(rq, p);
+    }
+    task_rq_unlock(rq, flags);
+    return 0;
+}
+
+/**
+ * @brief 按进程号查找进程
+ *
+ * @param pid 进程号，为 0 表示当前进程
+ * @return 进程控制块，进程不存在或已退出时返回 NULL
+ * @note 调用者持有 tasks_lock，防止返回的进程被回收
+ */
+static struct task_struct *find_task(uint64_t pid)
+{
+    if (!pid)
+        return current;
+    if (pid >= NR_TASKS || !tasks[pid] || tasks[pid]->state == TASK_ZOMBIE)
+        return NULL;
+    return tasks[pid];
+}
+
+/**
+ * @brief 设置进程的调度策略和调度参数
+ *
+ * @param 参数1 - 进程号，为 0 表示当前进程
+ * @param 参数2 - 调度策略，SCHED_*
+ * @param 参数3 - struct sched_param 指针
+ * @return 成功返回 0，进程不存在返回 -ESRCH，参数无效返回 -EINVAL
+ */
+long sys_sched_setscheduler(struct trapframe *tf)
+{
+    struct sched_param *param = (struct sched_param *)tf->gpr.a2;
+    if (!param || param->sched_priority < 0)
+        return -EINVAL;
+    int32_t priority = param->sched_priority;
+    acquire_lock(&tasks_lock);
+    struct task_struct *p = find_task(tf->gpr.a0);
+    long ret = p ? sched_setscheduler(p, tf->gpr.a1, priority) : -ESRCH;
+    release_lock(&tasks_lock);
+    return ret;
+}
+
+/**
+ * @brief 获取进程的调度策略
+ *
+ * @param 参数1 - 进程号，为 0 表示当前进程
+ * @return 调度策略，进程不存在返回 -ESRCH
+ */
+long sys_sched_getscheduler(struct trapframe *tf)
+{
+    acquire_lock(&tasks_lock);
+    struct task_struct *p = find_task(tf->gpr.a0);
+    long ret = p ? (long)p->policy : -ESRCH;
+    release_lock(&tasks_lock);
+    return ret;
+}
+
+/**
+ * @brief 获取进程的调度参数
+ *
+ * @param 参数1 - 进程号，为 0 表示当前进程
+ * @param 参数2 - struct sched_param 指针，用于保存调度参数
+ * @return 成功返回 0，进程不存在返回 -ESRCH，参数无效返回 -EINVAL
+ */
+long sys_sched_getparam(struct trapframe *tf)
+{
+    struct sched_param *param = (struct sched_param *)tf->gpr.a1;
+    if (!param)
+        return -EINVAL;
+    acquire_lock(&tasks_lock);
+    struct task_struct *p = find_task(tf->gpr.a0);
+    int32_t priority = p ? (int32_t)p->rt_priority : -1;
+    release_lock(&tasks_lock);
+    if (!p)
+        return -ESRCH;
+    /* 写用户内存可能发生缺页异常，在锁外进行 */
+    param->sched_priority = priority;
+    return 0;
+}
+
+/**
+ * @brief 设置进程允许运行的处理器
+ *
+ * @param 参数1 - 进程号，为 0 表示当前进程
+ * @param 参数2 - 处理器位图的长度（字节），至少为 sizeof(uint64_t)
+ * @param 参数3 - 处理器位图指针，第 i 位对应第 i 个处理器
+ * @return 成功返回 0，进程不存在返回 -ESRCH，参数无效或位图不包含在线处理器返回 -EINVAL
+ */
+long sys_sched_setaffinity(struct trapframe *tf)
+{
+    uint64_t *user_mask = (uint64_t *)tf->gpr.a2;
+    if (!user_mask || tf->gpr.a1 < sizeof(uint64_t))
+        return -EINVAL;
+    uint64_t mask = *user_mask & CPU_MASK_ALL;
+    acquire_lock(&tasks_lock);
+    struct task_struct *p = find_task(tf->gpr.a0);
+    long ret = -ESRCH;
+    if (p)
+        ret = p == tasks[0] ? -EPERM : set_cpus_allowed(p, mask);
+    release_lock(&tasks_lock);
+    return ret;
+}
+
+/**
+ * @brief 获取进程允许运行的处理器
+ *
+ * @param 参数1 - 进程号，为 0 表示当前进程
+ * @param 参数2 - 处理器位图的长度（字节），至少为 sizeof(uint64_t)
+ * @param 参数3 - 处理器位图指针，用于保存结果
+ * @return 成功返回写入的字节数，进程不存在返回 -ESRCH，参数无效返回 -EINVAL
+ */
+long sys_sched_getaffinity(struct trapframe *tf)
+{
+    uint64_t *user_mask = (uint64_t *)tf->gpr.a2;
+    if (!user_mask || tf->gpr.a1 < sizeof(uint64_t))
+        return -EINVAL;
+    acquire_lock(&tasks_lock);
+    struct task_struct *p = find_task(tf->gpr.a0);
+    uint64_t mask = p ? p->cpus_allowed & cpu_online_mask() : 0;
+    release_lock(&tasks_lock);
+    if (!p)
+        return -ESRCH;
+    *user_mask = mask;
+    return sizeof(uint64_t);
+}
+
+/**
+ * @brief 按优先级从高到低询问各调度类，选择下一个进程
+ *
+ * @return 下一个进程，运行队列为空时返回 NULL
+ */
+static struct task_struct *pick_next_task(struct rq *rq)
+{
+    struct task_struct *next;
+    for (const struct sched_class *class = sched_class_highest; class; class = class->next) {
+        if ((next = class->pick_next_task(rq)))
+            return next;
+    }
+    return NULL;
+}
+
+/**
+ * @brief 进程调度函数
+ *
+ * 当前进程不再可运行时将其移出运行队列，通知其调度类它即将让出处理器，
+ * 然后按优先级从高到低询问各调度类，选择下一个进程。
+ * 当前进程不再允许在本处理器上运行时迁移到其他处理器。
+ * 空闲进程不参加调度，本处理器的运行队列为空时先尝试从其他处理器拉取进程，
+ * 仍然没有可运行进程时选择空闲进程。
+ *
+ * @note 调用时必须关中断
+ */
+void schedule()
+{
+    struct rq *rq = this_rq();
+    struct task_struct *prev = current;
+    struct task_struct *next = NULL;
+
+    acquire_lock(&rq->lock);
+    /* 在可能暂时释放运行队列锁的操作之前清除，期间的唤醒设置的标志不会丢失 */
+    prev->need_resched = 0;
+    if (prev->on_rq && prev->state != TASK_RUNNING)
+        dequeue_task(rq, prev);
+    if (prev->sched_class)
+        prev->sched_class->put_prev_task(rq, prev);
+    if (prev->on_rq && !task_allowed_on(prev, rq->cpu)) {
+        struct rq *dst_rq = cpu_rq(select_task_rq(prev));
+        double_lock_balance(rq, dst_rq);
+        move_task(rq, prev, dst_rq);
+        release_lock(&dst_rq->lock);
+    }
+    next = pick_next_task(rq);
+    if (!next) {
+        /* load_balance() 可能暂时释放锁，期间唤醒的进程也会加入本运行队列，无论是否拉取成功都重新选择 */
+        load_balance(rq, 1);
+        next = pick_next_task(rq);
+    }
+    if (!next)
+        next = rq->idle;
+    rq->curr = next;
+    clock_set_next_event(); /* 可运行进程数可能改变，重新确定时钟中断间隔 */
+    if (next == prev) {
+        release_lock(&rq->lock);
+        return;
+    }
+    // kprintf("switch to %u\n", (uint64_t)next->pid);
+    switch_to(next, &rq->lock);
+}
+
+/**
+ * @brief 在等待队列 *p 上睡眠
+ *
+ * lock 不为 NULL 时调用者持有它，检查睡眠条件和加入等待队列都在锁内进行；
+ * 调度前释放，被唤醒后重新获得。唤醒者持有同一把锁，因此不会丢失唤醒。
+ */
+static inline void __sleep_on(struct task_struct **p, int state, struct spinlock *lock)
 {
 	struct task_struct *tmp;
 
@@ -186,9 +783,16 @@ static inline void __sleep_on(struct task_struct **p, int state)
 	tmp = *p;
 	*p = current;
 	current->state = state;
-repeat:	schedule();
+repeat:
+	if (lock) {
+		release_lock(lock);
+	}
+	schedule();
+	if (lock) {
+		acquire_lock(lock);
+	}
 	if (*p && *p != current) {
-		(**p).state = TASK_RUNNING;
+		wake_up_process(*p);
 		current->state = TASK_UNINTERRUPTIBLE;
 		goto repeat;
 	}
@@ -196,18 +800,40 @@ repeat:	schedule();
 		kputs("Warning: *P = NULL\n\r");
 	}
 	if ((*p = tmp)) {
-		tmp->state = TASK_RUNNING;
+		wake_up_process(tmp);
 	}
 }
 
 void interruptible_sleep_on(struct task_struct **p)
 {
-	__sleep_on(p, TASK_INTERRUPTIBLE);
+	__sleep_on(p, TASK_INTERRUPTIBLE, NULL);
 }
 
 void sleep_on(struct task_struct **p)
 {
-	__sleep_on(p, TASK_UNINTERRUPTIBLE);
+	__sleep_on(p, TASK_UNINTERRUPTIBLE, NULL);
+}
+
+/**
+ * @brief 释放 lock 并在等待队列 *p 上可中断睡眠，被唤醒后重新获得 lock
+ *
+ * @param p 等待队列
+ * @param lock 调用者持有的保护等待队列的锁
+ */
+void interruptible_sleep_on_lock(struct task_struct **p, struct spinlock *lock)
+{
+	__sleep_on(p, TASK_INTERRUPTIBLE, lock);
+}
+
+/**
+ * @brief 释放 lock 并在等待队列 *p 上不可中断睡眠，被唤醒后重新获得 lock
+ *
+ * @param p 等待队列
+ * @param lock 调用者持有的保护等待队列的锁
+ */
+void sleep_on_lock(struct task_struct **p, struct spinlock *lock)
+{
+	__sleep_on(p, TASK_UNINTERRUPTIBLE, lock);
 }
 
 /**
@@ -224,7 +850,7 @@ void wake_up(struct task_struct **p)
 		if ((**p).state == TASK_ZOMBIE) {
 			kputs("wake_up: TASK_ZOMBIE");
 		}
-		(**p).state = TASK_RUNNING;
+		wake_up_process(*p);
 	}
 }
 
@@ -243,7 +869,7 @@ static void map_segment(uint64_t start, uint64_t end, uint16_t flag)
     while (start != end) {
         put_page(physical, start, flag);
         start += PAGE_SIZE;
-        ++mem_map[MAP_NR(physical)];
+        page_ref_inc(PAGE_OF(physical));
         physical += PAGE_SIZE;
     }
 }
@@ -268,12 +894,9 @@ long sys_init(struct trapframe* tf)
     /*
      * 创建进程 0 堆栈（从 0xBFFFFFF0 开始）
      *
-     * 内核堆栈已使用的空间远小于一页，因此仅为用户态堆栈分配一页虚拟页。
+     * 栈是匿名区域，不预先映射，访问时由缺页异常按需分配。
      * 为了确保切换到应用态后正确执行，将内核态堆栈的数据全部拷贝到用用户态堆栈中。
      */
-    get_empty_page(START_STACK - PAGE_SIZE, USER_RW);
-    get_empty_page(START_STACK, USER_RW);
-    invalidate();
     memcpy((void*)((uint64_t)START_STACK - PAGE_SIZE), (const void*)FLOOR(tf->gpr.sp), PAGE_SIZE);
     tf->gpr.sp = START_STACK - ((uint64_t)boot_stack_top - tf->gpr.sp);
     /* GCC 使用 s0 指向函数栈帧起始地址（高地址），因此这里也要修改，否则切换到进程0会访问到内核区 */
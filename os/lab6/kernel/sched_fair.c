@@ -0,0 +1,423 @@
+/**
+ * @file sched_fair.c
+ * @brief 实现完全公平调度类（CFS）
+ *
+ * 每个进程有一个虚拟运行时间 vruntime：进程运行 delta 纳秒，vruntime 增加
+ * delta * NICE_0_LOAD / weight，权重由 nice 值决定，nice 值每差 1 权重约差 1.25 倍。
+ * 可运行的进程按 vruntime 排列在红黑树中，调度器总是选择 vruntime 最小（最左）的进程，
+ * 因此各进程得到的处理器时间与权重成正比。
+ *
+ * 调度周期：所有可运行的进程在 sched_latency_ns 内各运行一次；进程较多时调度周期延长为
+ * nr_running * sched_min_granularity_ns，避免过于频繁的切换。进程在一个调度周期中的
+ * 时间片与权重成正比。
+ *
+ * 唤醒：睡眠的进程被唤醒时 vruntime 至少为 min_vruntime - sched_latency_ns / 2，
+ * 既补偿了它睡眠的时间（交互式进程被唤醒后能很快运行），又不会因为睡得太久而长期独占处理器。
+ * 被唤醒的进程的 vruntime 比当前进程小 sched_wakeup_granularity_ns 以上时立即抢占。
+ *
+ * 新进程的 vruntime 从 min_vruntime 之后一个时间片开始，fork() 不能用来获取更多处理器时间。
+ *
+ * 进程运行时间由 sched_clock() 计量，精度远高于时钟中断；时钟中断只负责检查是否需要抢占。
+ *
+ * 负载均衡只迁移公平调度类的进程：处理器从可运行进程最多的运行队列拉取进程，直到两者相差不超过 1。
+ * 刚运行过的进程数据可能还在原处理器的缓存中，忙碌的处理器不拉取这样的进程，
+ * 除非连续 CACHE_NICE_TRIES 次均衡都失败了；空闲的处理器总是拉取。
+ */
+#include <clock.h>
+#include <sched.h>
+
+/** 调度周期的目标长度：可运行进程不多时，每个进程在这段时间内至少运行一次 */
+uint64_t sched_latency_ns = 40000000UL;
+
+/** 进程被抢占前至少运行的时间，默认为一个时钟中断周期 */
+uint64_t sched_min_granularity_ns = 10000000UL;
+
+/** 唤醒抢占的门槛：被唤醒的进程 vruntime 至少小这么多才抢占当前进程 */
+uint64_t sched_wakeup_granularity_ns = 5000000UL;
+
+/** 进程停止运行后这段时间内认为它的数据还在缓存中，迁移代价较高 */
+uint64_t sched_migration_cost_ns = 500000UL;
+
+/**
+ * nice 值到权重的映射，下标为 nice - MIN_NICE
+ *
+ * 相邻 nice 值的权重之比约为 1.25，使 nice 值每差 1，处理器时间约差 10%。
+ */
+static const uint32_t prio_to_weight[MAX_NICE - MIN_NICE + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+static inline uint64_t max_vruntime(uint64_t min_vruntime, uint64_t vruntime)
+{
+    return (int64_t)(vruntime - min_vruntime) > 0 ? vruntime : min_vruntime;
+}
+
+static inline uint64_t min_vruntime(uint64_t min_vruntime, uint64_t vruntime)
+{
+    return (int64_t)(vruntime - min_vruntime) < 0 ? vruntime : min_vruntime;
+}
+
+static inline struct sched_entity *entity_of(struct rb_node *node)
+{
+    return rb_entry(node, struct sched_entity, run_node);
+}
+
+static inline struct task_struct *task_of(struct sched_entity *se)
+{
+    return container_of(se, struct task_struct, se);
+}
+
+/**
+ * @brief 将实际运行时间换算为虚拟运行时间
+ */
+static inline uint64_t calc_delta_fair(uint64_t delta, struct sched_entity *se)
+{
+    if (se->weight != NICE_0_LOAD)
+        delta = delta * NICE_0_LOAD / se->weight;
+    return delta;
+}
+
+/**
+ * @brief 计算调度周期
+ *
+ * @param nr_running 可运行进程数
+ */
+static uint64_t sched_period(uint64_t nr_running)
+{
+    uint64_t period = sched_latency_ns;
+    if (nr_running * sched_min_granularity_ns > period)
+        period = nr_running * sched_min_granularity_ns;
+    return period;
+}
+
+/**
+ * @brief 计算进程在一个调度周期中的时间片
+ *
+ * @param cfs_rq 运行队列
+ * @param p 进程，不在运行队列中时按已加入计算
+ * @return 时间片（ns）
+ */
+static uint64_t sched_slice(struct cfs_rq *cfs_rq, struct task_struct *p)
+{
+    uint64_t nr_running = cfs_rq->nr_running;
+    uint64_t load = cfs_rq->load;
+    if (!p->on_rq) {
+        ++nr_running;
+        load += p->se.weight;
+    }
+    return sched_period(nr_running) * p->se.weight / load;
+}
+
+/**
+ * @brief 更新 min_vruntime，保证其单调递增
+ */
+static void update_min_vruntime(struct cfs_rq *cfs_rq)
+{
+    uint64_t vruntime = cfs_rq->min_vruntime;
+    if (cfs_rq->curr)
+        vruntime = cfs_rq->curr->vruntime;
+    if (cfs_rq->rb_leftmost) {
+        struct sched_entity *se = entity_of(cfs_rq->rb_leftmost);
+        if (!cfs_rq->curr)
+            vruntime = se->vruntime;
+        else
+            vruntime = min_vruntime(vruntime, se->vruntime);
+    }
+    cfs_rq->min_vruntime = max_vruntime(cfs_rq->min_vruntime, vruntime);
+}
+
+/**
+ * @brief 将当前进程自上次更新以来的运行时间计入 vruntime
+ */
+static void update_curr(struct cfs_rq *cfs_rq)
+{
+    struct sched_entity *curr = cfs_rq->curr;
+    if (!curr)
+        return;
+    uint64_t now = sched_clock();
+    uint64_t delta_exec = now - curr->exec_start;
+    if ((int64_t)delta_exec <= 0)
+        return;
+    curr->exec_start = now;
+    curr->sum_exec_runtime += delta_exec;
+    curr->vruntime += calc_delta_fair(delta_exec, curr);
+    update_min_vruntime(cfs_rq);
+}
+
+/**
+ * @brief 将进程插入红黑树
+ *
+ * vruntime 相同的进程插在右边，先入队的先运行。
+ */
+static void __enqueue_entity(struct cfs_rq *cfs_rq, struct sched_entity *se)
+{
+    struct rb_node **link = &cfs_rq->tasks_timeline.node;
+    struct rb_node *parent = NULL;
+    int leftmost = 1;
+    while (*link) {
+        parent = *link;
+        if ((int64_t)(se->vruntime - entity_of(parent)->vruntime) < 0) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+    if (leftmost)
+        cfs_rq->rb_leftmost = &se->run_node;
+    rb_link_node(&se->run_node, parent, link);
+    rb_insert_color(&se->run_node, &cfs_rq->tasks_timeline);
+}
+
+/**
+ * @brief 将进程移出红黑树
+ */
+static void __dequeue_entity(struct cfs_rq *cfs_rq, struct sched_entity *se)
+{
+    if (cfs_rq->rb_leftmost == &se->run_node)
+        cfs_rq->rb_leftmost = rb_next(&se->run_node);
+    rb_erase(&se->run_node, &cfs_rq->tasks_timeline);
+}
+
+/**
+ * @brief 确定新进程或被唤醒的进程的 vruntime
+ *
+ * @param cfs_rq 运行队列
+ * @param p 进程
+ * @param initial 为 1 表示新进程，为 0 表示被唤醒的进程
+ */
+static void place_entity(struct cfs_rq *cfs_rq, struct task_struct *p, int initial)
+{
+    uint64_t vruntime = cfs_rq->min_vruntime;
+    if (initial)
+        vruntime += calc_delta_fair(sched_slice(cfs_rq, p), &p->se);
+    else
+        vruntime -= sched_latency_ns / 2;
+    p->se.vruntime = max_vruntime(p->se.vruntime, vruntime);
+}
+
+static void enqueue_task_fair(struct rq *rq, struct task_struct *p)
+{
+    struct cfs_rq *cfs_rq = &rq->cfs;
+    update_curr(cfs_rq);
+    place_entity(cfs_rq, p, 0);
+    __enqueue_entity(cfs_rq, &p->se);
+    cfs_rq->load += p->se.weight;
+    ++cfs_rq->nr_running;
+}
+
+static void dequeue_task_fair(struct rq *rq, struct task_struct *p)
+{
+    struct cfs_rq *cfs_rq = &rq->cfs;
+    update_curr(cfs_rq);
+    if (&p->se != cfs_rq->curr)
+        __dequeue_entity(cfs_rq, &p->se);
+    cfs_rq->load -= p->se.weight;
+    --cfs_rq->nr_running;
+    update_min_vruntime(cfs_rq);
+}
+
+static void check_preempt_curr_fair(struct rq *rq, struct task_struct *p)
+{
+    struct cfs_rq *cfs_rq = &rq->cfs;
+    struct sched_entity *curr = cfs_rq->curr;
+    if (!curr)
+        return;
+    update_curr(cfs_rq);
+    int64_t gran = calc_delta_fair(sched_wakeup_granularity_ns, &p->se);
+    if ((int64_t)(curr->vruntime - p->se.vruntime) > gran)
+        resched_curr(rq);
+}
+
+static void set_curr_task_fair(struct rq *rq, struct task_struct *p)
+{
+    struct cfs_rq *cfs_rq = &rq->cfs;
+    struct sched_entity *se = &p->se;
+    __dequeue_entity(cfs_rq, se);
+    se->exec_start = sched_clock();
+    se->prev_sum_exec_runtime = se->sum_exec_runtime;
+    cfs_rq->curr = se;
+}
+
+static struct task_struct *pick_next_task_fair(struct rq *rq)
+{
+    struct cfs_rq *cfs_rq = &rq->cfs;
+    if (!cfs_rq->rb_leftmost)
+        return NULL;
+    struct task_struct *p = task_of(entity_of(cfs_rq->rb_leftmost));
+    set_curr_task_fair(rq, p);
+    return p;
+}
+
+static void put_prev_task_fair(struct rq *rq, struct task_struct *p)
+{
+    struct cfs_rq *cfs_rq = &rq->cfs;
+    update_curr(cfs_rq);
+    if (p->on_rq)
+        __enqueue_entity(cfs_rq, &p->se);
+    cfs_rq->curr = NULL;
+}
+
+/**
+ * @brief 时钟中断时检查当前进程是否应被抢占
+ *
+ * 当前进程用完了时间片，或者已经运行了最小粒度且 vruntime 领先最左进程一个时间片以上时抢占。
+ */
+static void task_tick_fair(struct rq *rq, struct task_struct *p)
+{
+    struct cfs_rq *cfs_rq = &rq->cfs;
+    struct sched_entity *se = &p->se;
+    update_curr(cfs_rq);
+    if (cfs_rq->nr_running < 2)
+        return;
+    uint64_t ideal_runtime = sched_slice(cfs_rq, p);
+    uint64_t delta_exec = se->sum_exec_runtime - se->prev_sum_exec_runtime;
+    if (delta_exec > ideal_runtime) {
+        p->need_resched = 1;
+        return;
+    }
+    if (delta_exec < sched_min_granularity_ns || !cfs_rq->rb_leftmost)
+        return;
+    if ((int64_t)(se->vruntime - entity_of(cfs_rq->rb_leftmost)->vruntime) > (int64_t)ideal_runtime)
+        p->need_resched = 1;
+}
+
+static void task_fork_fair(struct rq *rq, struct task_struct *p)
+{
+    struct cfs_rq *cfs_rq = &rq->cfs;
+    update_curr(cfs_rq);
+    /* p->se 复制自父进程，vruntime 从父进程的 vruntime 和 min_vruntime 之后一个时间片中较大者开始；
+     * 子进程放到其他处理器上时父进程的 vruntime 没有意义，从 min_vruntime 开始 */
+    if (rq != this_rq())
+        p->se.vruntime = cfs_rq->min_vruntime;
+    p->se.sum_exec_runtime = p->se.prev_sum_exec_runtime = 0;
+    p->se.exec_start = 0; /* 还没有运行过，没有缓存亲和性 */
+    place_entity(cfs_rq, p, 1);
+}
+
+/**
+ * @brief 进程的数据是否可能还在缓存中
+ *
+ * 等待运行的进程的 exec_start 是它上一次停止运行的时刻。
+ */
+static inline int task_hot(struct task_struct *p, uint64_t now)
+{
+    return now - p->se.exec_start < sched_migration_cost_ns;
+}
+
+/**
+ * @brief 判断能否将进程 p 从 busiest 迁移到 this_rq
+ */
+static int can_migrate_task(struct task_struct *p, struct rq *this_rq, int idle, uint64_t now)
+{
+    if (!task_allowed_on(p, this_rq->cpu) || p->on_cpu)
+        return 0;
+    if (!idle && this_rq->nr_balance_failed < CACHE_NICE_TRIES && task_hot(p, now))
+        return 0;
+    return 1;
+}
+
+/**
+ * @brief 找出可运行进程最多的运行队列
+ *
+ * 不加锁读取 nr_running，结果只作为参考，迁移前加锁重新检查。
+ *
+ * @return 可运行进程比 this_rq 至少多 2 个的运行队列，没有则返回 NULL
+ */
+static struct rq *find_busiest_queue(struct rq *this_rq)
+{
+    struct rq *busiest = NULL;
+    uint64_t max_load = this_rq->nr_running + 1;
+    for (uint64_t i = 0; i < nr_cpus; ++i) {
+        struct rq *rq = cpu_rq(&cpus[i]);
+        if (rq == this_rq || !cpus[i].online)
+            continue;
+        if (rq->nr_running > max_load) {
+            busiest = rq;
+            max_load = rq->nr_running;
+        }
+    }
+    return busiest;
+}
+
+/**
+ * @brief 从最忙的运行队列拉取公平调度类的进程到 this_rq
+ *
+ * 从 vruntime 最小的进程开始检查，它们最久没有得到运行，通常缓存最冷。
+ *
+ * @param this_rq 本处理器的运行队列
+ * @param idle 本处理器是否空闲，空闲时不考虑缓存亲和性
+ * @return 迁移的进程数
+ * @note 调用者持有 this_rq->lock，本函数可能暂时释放它
+ */
+int load_balance(struct rq *this_rq, int idle)
+{
+    struct rq *busiest = find_busiest_queue(this_rq);
+    if (!busiest)
+        return 0;
+    double_lock_balance(this_rq, busiest);
+    int pulled = 0;
+    uint64_t now = sched_clock();
+    struct rb_node *node = busiest->cfs.rb_leftmost;
+    while (node && busiest->nr_running > this_rq->nr_running + 1) {
+        struct task_struct *p = task_of(entity_of(node));
+        node = rb_next(node);
+        if (!can_migrate_task(p, this_rq, idle, now))
+            continue;
+        move_task(busiest, p, this_rq);
+        ++pulled;
+    }
+    release_lock(&busiest->lock);
+    if (pulled)
+        this_rq->nr_balance_failed = 0;
+    else if (!idle)
+        ++this_rq->nr_balance_failed;
+    return pulled;
+}
+
+/**
+ * @brief 设置进程的 nice 值
+ *
+ * @param p 进程
+ * @param nice nice 值，超出 [MIN_NICE, MAX_NICE] 时取边界值
+ */
+void set_user_nice(struct task_struct *p, int32_t nice)
+{
+    if (nice < MIN_NICE)
+        nice = MIN_NICE;
+    if (nice > MAX_NICE)
+        nice = MAX_NICE;
+    uint64_t weight = prio_to_weight[nice - MIN_NICE];
+    uint64_t flags;
+    struct rq *rq = task_rq_lock(p, &flags);
+    struct cfs_rq *cfs_rq = &rq->cfs;
+    p->nice = nice;
+    if (p->sched_class == &fair_sched_class && p->on_rq) {
+        /* 已经经过的运行时间按旧权重计入 vruntime，红黑树中的位置不变 */
+        if (&p->se == cfs_rq->curr)
+            update_curr(cfs_rq);
+        cfs_rq->load += weight - p->se.weight;
+    }
+    p->se.weight = weight;
+    task_rq_unlock(rq, flags);
+}
+
+/** 公平调度类 */
+const struct sched_class fair_sched_class = {
+    .next = NULL,
+    .enqueue_task = enqueue_task_fair,
+    .dequeue_task = dequeue_task_fair,
+    .check_preempt_curr = check_preempt_curr_fair,
+    .pick_next_task = pick_next_task_fair,
+    .put_prev_task = put_prev_task_fair,
+    .set_curr_task = set_curr_task_fair,
+    .task_tick = task_tick_fair,
+    .task_fork = task_fork_fair,
+};
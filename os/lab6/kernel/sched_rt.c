@@ -0,0 +1,176 @@
+/**
+ * @file sched_rt.c
+ * @brief 实现实时调度类（SCHED_FIFO、SCHED_RR）
+ *
+ * 实时进程有 1 ~ MAX_RT_PRIO - 1 共 99 个静态优先级，数值越大越优先。实时调度类排在公平调度类之前，
+ * 只要有可运行的实时进程，公平调度类的进程就不会运行；高优先级的实时进程被唤醒时立即抢占低优先级的进程。
+ *
+ * 运行队列是一个优先级数组：每个优先级一条进程链表，位图记录非空的链表，选择进程只需一次
+ * find-first-set，与进程数无关。正在运行的进程留在链表头部。
+ * - SCHED_FIFO 进程一直运行，直到阻塞、主动让出或被更高优先级的进程抢占
+ * - SCHED_RR 进程用完 RR_TIMESLICE 个 tick 的时间片后移到同一优先级链表的尾部
+ *
+ * 带宽限制：每 sched_rt_period_ns 内实时进程最多运行 sched_rt_runtime_ns，用完后实时调度类
+ * 暂停（throttled）到下一个周期，失控的实时进程不会让公平调度类的进程（如 shell）完全得不到运行。
+ * sched_rt_runtime_ns 不小于 sched_rt_period_ns 时不限制。
+ */
+#include <clock.h>
+#include <sched.h>
+#include <utils/bitops.h>
+
+/** 实时进程带宽限制的周期 */
+uint64_t sched_rt_period_ns = 1000000000UL;
+
+/** 每个周期内实时进程最多运行的时间 */
+uint64_t sched_rt_runtime_ns = 950000000UL;
+
+/**
+ * @brief 进程在优先级数组中的下标，0 最优先
+ */
+static inline uint64_t rt_prio(struct task_struct *p)
+{
+    return MAX_RT_PRIO - 1 - p->rt_priority;
+}
+
+/**
+ * @brief 初始化实时运行队列
+ */
+void rt_rq_init(struct rt_rq *rt_rq)
+{
+    for (size_t i = 0; i < BITS_TO_LONGS(MAX_RT_PRIO); ++i)
+        rt_rq->active.bitmap[i] = 0;
+    for (size_t i = 0; i < MAX_RT_PRIO; ++i)
+        linked_list_init(&rt_rq->active.queue[i]);
+    rt_rq->nr_running = 0;
+    rt_rq->rt_time = 0;
+    rt_rq->period_start = 0;
+    rt_rq->throttled = 0;
+}
+
+/**
+ * @brief 将当前进程自上次更新以来的运行时间计入实时带宽
+ *
+ * 本周期的配额用完时暂停实时调度类并让出处理器。
+ */
+static void update_curr_rt(struct rq *rq, struct task_struct *p)
+{
+    struct rt_rq *rt_rq = &rq->rt;
+    uint64_t now = sched_clock();
+    uint64_t delta_exec = now - p->se.exec_start;
+    if ((int64_t)delta_exec <= 0)
+        return;
+    p->se.exec_start = now;
+    p->se.sum_exec_runtime += delta_exec;
+    if (sched_rt_runtime_ns >= sched_rt_period_ns)
+        return;
+    rt_rq->rt_time += delta_exec;
+    if (!rt_rq->throttled && rt_rq->rt_time > sched_rt_runtime_ns) {
+        rt_rq->throttled = 1;
+        p->need_resched = 1;
+    }
+}
+
+/**
+ * @brief 每个时钟中断调用，周期结束时补充实时进程的配额
+ *
+ * 配额恢复后如有等待的实时进程则重新调度。
+ */
+void update_rt_bandwidth(struct rq *rq)
+{
+    struct rt_rq *rt_rq = &rq->rt;
+    uint64_t now = sched_clock();
+    if (now - rt_rq->period_start < sched_rt_period_ns)
+        return;
+    if (rq->curr->sched_class == &rt_sched_class)
+        update_curr_rt(rq, rq->curr);
+    uint64_t periods = (now - rt_rq->period_start) / sched_rt_period_ns;
+    uint64_t refill = periods * sched_rt_runtime_ns;
+    rt_rq->period_start += periods * sched_rt_period_ns;
+    rt_rq->rt_time = rt_rq->rt_time > refill ? rt_rq->rt_time - refill : 0;
+    if (rt_rq->throttled && rt_rq->rt_time < sched_rt_runtime_ns) {
+        rt_rq->throttled = 0;
+        if (rt_rq->nr_running)
+            resched_curr(rq);
+    }
+}
+
+static void enqueue_task_rt(struct rq *rq, struct task_struct *p)
+{
+    struct prio_array *array = &rq->rt.active;
+    uint64_t prio = rt_prio(p);
+    linked_list_push(&array->queue[prio], &p->run_list);
+    set_bit(prio, array->bitmap);
+    ++rq->rt.nr_running;
+}
+
+static void dequeue_task_rt(struct rq *rq, struct task_struct *p)
+{
+    struct prio_array *array = &rq->rt.active;
+    uint64_t prio = rt_prio(p);
+    if (p == rq->curr)
+        update_curr_rt(rq, p);
+    linked_list_remove(&p->run_list);
+    if (linked_list_empty(&array->queue[prio]))
+        clear_bit(prio, array->bitmap);
+    --rq->rt.nr_running;
+}
+
+static void check_preempt_curr_rt(struct rq *rq, struct task_struct *p)
+{
+    if (p->rt_priority > rq->curr->rt_priority)
+        resched_curr(rq);
+}
+
+static struct task_struct *pick_next_task_rt(struct rq *rq)
+{
+    struct rt_rq *rt_rq = &rq->rt;
+    if (!rt_rq->nr_running || rt_rq->throttled)
+        return NULL;
+    uint64_t prio = find_first_bit(rt_rq->active.bitmap, MAX_RT_PRIO);
+    struct linked_list_node *node = linked_list_first(&rt_rq->active.queue[prio]);
+    struct task_struct *p = container_of(node, struct task_struct, run_list);
+    p->se.exec_start = sched_clock();
+    return p;
+}
+
+static void put_prev_task_rt(struct rq *rq, struct task_struct *p)
+{
+    update_curr_rt(rq, p);
+}
+
+static void set_curr_task_rt(struct rq *rq, struct task_struct *p)
+{
+    p->se.exec_start = sched_clock();
+}
+
+static void task_tick_rt(struct rq *rq, struct task_struct *p)
+{
+    update_curr_rt(rq, p);
+    if (p->policy != SCHED_RR || --p->time_slice)
+        return;
+    p->time_slice = RR_TIMESLICE;
+    /* 同一优先级还有其他进程时轮转到链表尾部 */
+    if (p->run_list.prev != p->run_list.next) {
+        linked_list_remove(&p->run_list);
+        linked_list_push(&rq->rt.active.queue[rt_prio(p)], &p->run_list);
+        p->need_resched = 1;
+    }
+}
+
+static void task_fork_rt(struct rq *rq, struct task_struct *p)
+{
+    p->time_slice = RR_TIMESLICE;
+}
+
+/** 实时调度类 */
+const struct sched_class rt_sched_class = {
+    .next = &fair_sched_class,
+    .enqueue_task = enqueue_task_rt,
+    .dequeue_task = dequeue_task_rt,
+    .check_preempt_curr = check_preempt_curr_rt,
+    .pick_next_task = pick_next_task_rt,
+    .put_prev_task = put_prev_task_rt,
+    .set_curr_task = set_curr_task_rt,
+    .task_tick = task_tick_rt,
+    .task_fork = task_fork_rt,
+};
@@ -0,0 +1,138 @@
+/**
+ * @file smp.c
+ * @brief 实现多处理器的启动与处理器间通信
+ *
+ * 启动处理器在 main() 一开始调用 smp_boot_init() 设置 tp，在调度器和时钟初始化完成后调用
+ * smp_init()，通过 SBI HSM 扩展逐个启动处于停止状态的 hart，并等待其完成初始化。
+ *
+ * 处理器间中断（重新调度）和远程 TLB 刷新分别通过 SBI IPI、RFENCE 扩展实现。
+ */
+#include <sched.h>
+#include <sbi.h>
+#include <smp.h>
+#include <mm.h>
+#include <trap.h>
+#include <clock.h>
+#include <riscv.h>
+#include <kdebug.h>
+
+#define MAX_HARTID 64               /**< 探测的 hart ID 上限 */
+
+/**
+ * 处理器私有数据
+ *
+ * mem_init() 会清零 .bss 段，而 cpus[0] 在此之前已由 smp_boot_init() 设置，因此放在 .data 段。
+ */
+struct cpu cpus[NR_CPUS] __attribute__((section(".data")));
+
+/** 已启动的处理器数 */
+uint64_t nr_cpus = 1;
+
+/**
+ * @brief 初始化启动处理器的私有数据
+ *
+ * 必须在 main() 中最先调用，此后才能使用 this_cpu() 和 current。
+ *
+ * @param hartid 启动处理器的 hart ID，由 OpenSBI 通过 a0 传入
+ */
+void smp_boot_init(uint64_t hartid)
+{
+    extern uint64_t boot_pg_dir[];
+    struct cpu *cpu = &cpus[0];
+    __asm__ __volatile__("mv tp, %0" : : "r"(cpu));
+    cpu->id = 0;
+    cpu->hartid = hartid;
+    cpu->pg_dir = boot_pg_dir;
+}
+
+/**
+ * @brief 启动其余 hart
+ *
+ * 为每个处于停止状态的 hart 分配一页作为空闲进程的控制块和内核栈，从 _secondary_start 启动，
+ * 等待其上线后再启动下一个。SBI 不支持 HSM 扩展时只使用启动处理器。
+ */
+void smp_init()
+{
+    extern void _secondary_start(void);
+    cpus[0].online = 1;
+    if (!sbi_probe_extension(HART_STATE_EXTENTION).value) {
+        kputs("smp_init(): SBI HSM extension unavailable, running on one hart");
+        return;
+    }
+    for (uint64_t hartid = 0; hartid < MAX_HARTID && nr_cpus < NR_CPUS; ++hartid) {
+        if (hartid == boot_hartid())
+            continue;
+        struct sbiret ret = sbi_hart_get_status(hartid);
+        if (ret.error || ret.value != SBI_HART_STOPPED)
+            continue;
+        uint64_t page = get_free_page();
+        assert(page, "smp_init(): out of memory");
+        struct task_struct *idle = (struct task_struct *)VIRTUAL(page);
+        *idle = (struct task_struct) {
+            .state = TASK_RUNNING,
+            .policy = SCHED_NORMAL,
+            .se = { .weight = NICE_0_LOAD },
+            .start_kernel = START_KERNEL,
+            .pg_dir = kernel_pg_dir,
+        };
+        struct cpu *cpu = &cpus[nr_cpus];
+        cpu->id = nr_cpus;
+        cpu->hartid = hartid;
+        cpu->pg_dir = kernel_pg_dir;
+        init_idle(cpu, idle);
+        ret = sbi_hart_start(hartid, PHYSICAL((uint64_t)_secondary_start), (uint64_t)idle + PAGE_SIZE);
+        if (ret.error) {
+            kprintf("smp_init(): failed to start hart %u\n", hartid);
+            free_page(page);
+            continue;
+        }
+        while (!cpu->online)
+            ;
+        ++nr_cpus;
+    }
+    kprintf("smp_init(): %u hart(s) online\n", nr_cpus);
+}
+
+/**
+ * @brief 其余 hart 的 C 语言入口，由 _secondary_start 跳转而来
+ *
+ * 切换到内核页表，设置中断向量和时钟后上线，成为本处理器的空闲进程。
+ *
+ * @param hartid hart ID
+ */
+void secondary_main(uint64_t hartid)
+{
+    struct cpu *cpu = this_cpu();
+    assert(cpu->hartid == hartid, "secondary_main(): wrong struct cpu");
+    write_csr(sscratch, 0);
+    switch_mm(cpu->idle);
+    set_stvec();
+    clock_init_hart();
+    __sync_synchronize();
+    cpu->online = 1;
+    cpu_idle();
+}
+
+/**
+ * @brief 向处理器 cpu 发送处理器间中断，使其重新调度
+ *
+ * 目标处理器在中断返回前检查 need_resched。
+ */
+void smp_send_reschedule(struct cpu *cpu)
+{
+    sbi_send_ipi(1, cpu->hartid);
+}
+
+/**
+ * @brief 刷新其他处理器上内核地址范围 [start, start + size) 的 TLB
+ *
+ * SBI 在所有目标 hart 完成刷新后才返回。
+ */
+void smp_flush_tlb_kernel(uint64_t start, uint64_t size)
+{
+    struct cpu *self = this_cpu();
+    for (uint64_t i = 0; i < nr_cpus; ++i) {
+        if (&cpus[i] != self && cpus[i].online)
+            sbi_remote_sfence_vma(1, cpus[i].hartid, start, size);
+    }
+}
@@ -20,6 +20,13 @@
 
 extern long sys_init(struct trapframe *);
 extern long sys_fork(struct trapframe *);
+extern long sys_exit(struct trapframe *);
+extern long sys_waitpid(struct trapframe *);
+extern long sys_sched_setscheduler(struct trapframe *);
+extern long sys_sched_getscheduler(struct trapframe *);
+extern long sys_sched_getparam(struct trapframe *);
+extern long sys_sched_setaffinity(struct trapframe *);
+extern long sys_sched_getaffinity(struct trapframe *);
 
 /**
  * @brief 测试 fork() 是否正常工作
@@ -150,12 +157,103 @@ static int64_t sys_usleep(struct trapframe *tf)
     return usleep_set((int64_t)tf->gpr.a0);
 }
 
+/**
+ * @brief 进程 0 空闲时调用
+ *
+ * 回收进程 0 的僵尸子进程，或向预清零页池补充一页。只有进程 0 可以调用。
+ * 无事可做时用 wfi 等待中断，不再空转：关中断时待处理的中断同样会唤醒 wfi，
+ * 返回用户态后立即进入该中断的处理程序。
+ *
+ * @return 做了工作返回 1，无事可做返回 0
+ */
+static long sys_idle(struct trapframe *tf)
+{
+    if (current != tasks[0])
+        return -EPERM;
+    if (reap_orphans() || zero_pool_refill())
+        return 1;
+    if (!current->need_resched)
+        __asm__ __volatile__("wfi");
+    return 0;
+}
+
+/**
+ * @brief 设置堆结束地址（program break）
+ *
+ * 扩大堆只保留地址空间，物理页在第一次访问时由缺页异常分配；
+ * 缩小堆时释放 [新 brk, 旧 brk) 中的物理页和页表。
+ * 堆不能低于数据段结束地址，也不能进入栈区域。
+ *
+ * @param 参数1 - 新的堆结束地址，为 0 时仅查询
+ * @return 返回新的堆结束地址，失败时返回原来的堆结束地址（与 Linux 的 brk 系统调用一致）
+ */
+static long sys_brk(struct trapframe *tf)
+{
+    uint64_t brk = tf->gpr.a0;
+    if (brk < current->end_data || brk > FLOOR(STACK_LIMIT))
+        return current->brk;
+    uint64_t old_end = CEIL(current->brk);
+    uint64_t new_end = CEIL(brk);
+    if (new_end < old_end)
+        free_page_tables(new_end, old_end - new_end);
+    current->brk = brk;
+    return brk;
+}
+
+/**
+ * @brief 查看内核内存分配统计信息
+ *
+ * 统计信息由内核直接打印。
+ *
+ * @param 参数1 - 命令，KMSTAT_*
+ * @return 成功返回 0（KMSTAT_LEAKS 返回疑似泄漏的对象数）；未开启 kmalloc 跟踪返回 -ENOSYS；
+ *         命令无效返回 -EINVAL
+ */
+static long sys_kmstat(struct trapframe *tf)
+{
+    uint64_t cmd = tf->gpr.a0;
+    if (cmd == KMSTAT_SLAB) {
+        show_slab_info();
+        return 0;
+    }
+    if (!KMALLOC_TRACE)
+        return -ENOSYS;
+    switch (cmd) {
+    case KMSTAT_CALLSITES:
+        kmalloc_show_trace();
+        return 0;
+    case KMSTAT_MARK:
+        kmalloc_mark_trace();
+        return 0;
+    case KMSTAT_LEAKS:
+        return kmalloc_find_leaks();
+    default:
+        return -EINVAL;
+    }
+}
+
+/**
+ * @brief 调整当前进程的 nice 值
+ *
+ * nice 值越大，进程在公平调度类中的权重越小，得到的处理器时间越少。
+ *
+ * @param 参数1 - nice 值的增量（可以为负数），结果超出 [MIN_NICE, MAX_NICE] 时取边界值
+ * @return 新的 nice 值
+ */
+static long sys_nice(struct trapframe *tf)
+{
+    set_user_nice(current, current->nice + (int64_t)tf->gpr.a0);
+    return current->nice;
+}
+
 /**
  * @brief 系统调用表
  * 存储所有系统调用的指针的数组，系统调用号是其中的下标。
  * 所有系统调用都通过系统调用表调用
  */
-fn_ptr syscall_table[] = {sys_init, sys_fork, sys_test_fork, sys_getpid, sys_getppid, sys_char, sys_block, sys_open, sys_close, sys_stat, sys_read, sys_reset, sys_usleep};
+fn_ptr syscall_table[] = {sys_init, sys_fork, sys_test_fork, sys_getpid, sys_getppid, sys_char, sys_block, sys_open, sys_close, sys_stat, sys_read, sys_reset, sys_usleep, sys_idle, sys_brk, sys_exit, sys_waitpid, sys_kmstat, sys_nice,
+                         sys_sched_setscheduler, sys_sched_getscheduler, sys_sched_getparam,
+                         sys_sched_setaffinity, sys_sched_getaffinity};
 
 /**
  * @brief 通过系统调用号调用对应的系统调用
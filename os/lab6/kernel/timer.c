@@ -0,0 +1,322 @@
+/**
+ * @file timer.c
+ * @brief 实现分层时间轮定时器
+ *
+ * 每个处理器一个时间轮，分为 5 级：第 1 级 256 个槽位，每个槽位对应一个 jiffy；第 2 ~ 5 级各 64 个
+ * 槽位，每个槽位分别对应 2^8、2^14、2^20、2^26 个 jiffies。定时器按到期时刻与时间轮当前时刻
+ * （timer_jiffies）之差放入某一级的槽位，加入和取消只需操作槽位的链表。
+ * 第 1 级转完一圈时，把第 2 级下一个槽位中的定时器重新分配到第 1 级（级联），依此类推。
+ *
+ * 时间轮在 tick 中推进，见 run_timers()。动态时钟下 tick 可能停止，clock_set_next_event()
+ * 通过 timer_next_expiry() 保证 tick 在时间轮的下一个到期时刻之前重新发生。
+ *
+ * 锁的顺序：驱动的锁和运行队列的锁在前，时间轮的锁在后，高精度定时器队列的锁最后。
+ * 回调函数运行时不持有时间轮的锁，del_timer_sync() 等待其运行结束，返回后调用者可以释放定时器。
+ */
+#include <timer.h>
+#include <assert.h>
+#include <clock.h>
+#include <smp.h>
+#include <kdebug.h>
+#include <utils/atomic.h>
+
+#define TVR_BITS 8                              /**< 第 1 级的槽位数位数 */
+#define TVN_BITS 6                              /**< 第 2 ~ 5 级的槽位数位数 */
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4                            /**< 第 2 ~ 5 级 */
+#define MAX_TVAL ((1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1) /**< 时间轮能表示的最长时间 */
+
+/** 第 level + 2 级时间轮中，时刻 j 所在的槽位 */
+#define TVN_INDEX(j, level) (((j) >> (TVR_BITS + (level) * TVN_BITS)) & TVN_MASK)
+
+/** 处理器的时间轮 */
+struct tvec_base {
+    struct spinlock lock;                       /**< 保护时间轮 */
+    struct timer_list *volatile running;        /**< 正在运行回调函数的定时器 */
+    uint64_t timer_jiffies;                     /**< 下一个要处理的 jiffy */
+    uint64_t nr_pending;                        /**< 等待到期的定时器数 */
+    uint64_t next_expiry;                       /**< timer_next_expiry() 的结果，可能早于实际的到期时刻 */
+    uint32_t next_expiry_valid;                 /**< next_expiry 是否有效 */
+    struct linked_list_node tv1[TVR_SIZE];      /**< 第 1 级 */
+    struct linked_list_node tvn[TVN_LEVELS][TVN_SIZE]; /**< 第 2 ~ 5 级 */
+};
+
+static struct tvec_base tvec_bases[NR_CPUS];
+
+/**
+ * @brief 初始化各处理器的时间轮
+ */
+void init_timers()
+{
+    uint64_t jiffies = get_jiffies();
+    for (size_t i = 0; i < NR_CPUS; ++i) {
+        struct tvec_base *base = &tvec_bases[i];
+        init_lock(&base->lock, "timer");
+        base->running = NULL;
+        base->timer_jiffies = jiffies;
+        base->nr_pending = 0;
+        base->next_expiry_valid = 0;
+        for (size_t j = 0; j < TVR_SIZE; ++j)
+            linked_list_init(&base->tv1[j]);
+        for (size_t level = 0; level < TVN_LEVELS; ++level)
+            for (size_t j = 0; j < TVN_SIZE; ++j)
+                linked_list_init(&base->tvn[level][j]);
+    }
+}
+
+/**
+ * @brief 初始化定时器
+ *
+ * @param timer 定时器
+ * @param function 到期时调用的函数
+ */
+void init_timer(struct timer_list *timer, void (*function)(struct timer_list *))
+{
+    timer->entry.prev = timer->entry.next = NULL;
+    timer->expires = 0;
+    timer->function = function;
+    timer->base = NULL;
+}
+
+/**
+ * @brief 将槽位中的定时器全部移到链表 list 中，槽位变为空
+ */
+static void take_slot(struct linked_list_node *slot, struct linked_list_node *list)
+{
+    if (linked_list_empty(slot)) {
+        linked_list_init(list);
+        return;
+    }
+    list->next = slot->next;
+    list->prev = slot->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    linked_list_init(slot);
+}
+
+/**
+ * @brief 按到期时刻将定时器放入时间轮的槽位
+ *
+ * 已经过期的定时器放入下一个要处理的槽位，超出时间轮范围的定时器放入最高级，级联时重新分配。
+ *
+ * @note 调用者持有 base->lock
+ */
+static void internal_add_timer(struct tvec_base *base, struct timer_list *timer)
+{
+    uint64_t expires = timer->expires;
+    uint64_t idx = expires - base->timer_jiffies;
+    struct linked_list_node *slot;
+    if ((int64_t)idx < 0) {
+        slot = &base->tv1[base->timer_jiffies & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        slot = &base->tv1[expires & TVR_MASK];
+    } else {
+        if (idx > MAX_TVAL) {
+            idx = MAX_TVAL;
+            expires = base->timer_jiffies + idx;
+        }
+        size_t level = 0;
+        while (idx >> (TVR_BITS + (level + 1) * TVN_BITS))
+            ++level;
+        slot = &base->tvn[level][TVN_INDEX(expires, level)];
+    }
+    linked_list_push(slot, &timer->entry);
+}
+
+/**
+ * @brief 将定时器移出时间轮
+ *
+ * @note 调用者持有 base->lock，定时器在 base 中等待到期
+ */
+static void detach_timer(struct tvec_base *base, struct timer_list *timer)
+{
+    linked_list_remove(&timer->entry);
+    timer->entry.prev = timer->entry.next = NULL;
+    --base->nr_pending;
+}
+
+/**
+ * @brief 将第 level + 2 级槽位 index 中的定时器重新分配到低一级
+ *
+ * @return index，为 0 时还需要级联更高一级
+ */
+static uint64_t cascade(struct tvec_base *base, size_t level, uint64_t index)
+{
+    struct linked_list_node list;
+    take_slot(&base->tvn[level][index], &list);
+    struct linked_list_node *node;
+    while ((node = linked_list_shift(&list)))
+        internal_add_timer(base, container_of(node, struct timer_list, entry));
+    return index;
+}
+
+/**
+ * @brief 启动定时器
+ *
+ * 定时器加入本处理器的时间轮，已经启动的定时器先从原来的时间轮中移除。
+ * 到期时刻已经过去的定时器在下一个 tick 到期。
+ *
+ * @param timer 定时器
+ * @param expires 到期时刻（jiffies）
+ * @return 定时器原来在等待到期返回 1，否则返回 0
+ */
+int mod_timer(struct timer_list *timer, uint64_t expires)
+{
+    struct tvec_base *base = &tvec_bases[this_cpu()->id];
+    struct tvec_base *old = timer->base;
+    int ret = 0;
+    if (old && old != base && timer_pending(timer)) {
+        uint64_t flags = acquire_lock_irqsave(&old->lock);
+        if (timer_pending(timer)) {
+            detach_timer(old, timer);
+            ret = 1;
+        }
+        release_lock_irqrestore(&old->lock, flags);
+    }
+    uint64_t flags = acquire_lock_irqsave(&base->lock);
+    if (timer_pending(timer)) {
+        detach_timer(base, timer);
+        ret = 1;
+    }
+    /* 时间轮为空时 timer_jiffies 可能停在很久以前，先追上当前时刻 */
+    if (!base->nr_pending) {
+        base->timer_jiffies = get_jiffies();
+        base->next_expiry_valid = 0;
+    }
+    timer->expires = expires;
+    timer->base = base;
+    internal_add_timer(base, timer);
+    ++base->nr_pending;
+    if (base->next_expiry_valid && expires < base->next_expiry)
+        base->next_expiry = expires;
+    release_lock_irqrestore(&base->lock, flags);
+    /* 定时器可能早于当前 tick 到期 */
+    clock_set_next_event();
+    return ret;
+}
+
+/**
+ * @brief 按 timer->expires 启动定时器
+ *
+ * @param timer 已经设置好到期时刻的定时器，不能在等待到期
+ */
+void add_timer(struct timer_list *timer)
+{
+    assert(!timer_pending(timer), "add_timer(): timer already pending");
+    mod_timer(timer, timer->expires);
+}
+
+/**
+ * @brief 取消定时器
+ *
+ * 不等待正在运行的回调函数。移除的定时器不更新 next_expiry，最多多发生一次 tick。
+ *
+ * @param timer 定时器
+ * @return 定时器在等待到期返回 1，否则返回 0
+ */
+int del_timer(struct timer_list *timer)
+{
+    struct tvec_base *base = timer->base;
+    if (!base)
+        return 0;
+    uint64_t flags = acquire_lock_irqsave(&base->lock);
+    int ret = timer_pending(timer);
+    if (ret)
+        detach_timer(base, timer);
+    release_lock_irqrestore(&base->lock, flags);
+    return ret;
+}
+
+/**
+ * @brief 取消定时器，定时器的回调函数正在其他处理器上运行时等待其结束
+ *
+ * @param timer 定时器
+ * @return 定时器在等待到期返回 1，否则返回 0
+ * @note 不能在定时器自己的回调函数中调用
+ */
+int del_timer_sync(struct timer_list *timer)
+{
+    struct tvec_base *base = timer->base;
+    if (!base)
+        return 0;
+    uint64_t flags = acquire_lock_irqsave(&base->lock);
+    int ret = timer_pending(timer);
+    if (ret)
+        detach_timer(base, timer);
+    while (base->running == timer) {
+        release_lock_irqrestore(&base->lock, flags);
+        flags = acquire_lock_irqsave(&base->lock);
+    }
+    release_lock_irqrestore(&base->lock, flags);
+    return ret;
+}
+
+/**
+ * @brief 推进本处理器的时间轮到当前时刻，运行所有到期的定时器
+ *
+ * 由 tick 调用。时间轮为空时直接跳到当前时刻，停止 tick 期间的 jiffies 不需要逐个处理。
+ */
+void run_timers()
+{
+    struct tvec_base *base = &tvec_bases[this_cpu()->id];
+    uint64_t jiffies = get_jiffies();
+    acquire_lock(&base->lock);
+    while (base->nr_pending && base->timer_jiffies <= jiffies) {
+        uint64_t index = base->timer_jiffies & TVR_MASK;
+        if (!index &&
+            !cascade(base, 0, TVN_INDEX(base->timer_jiffies, 0)) &&
+            !cascade(base, 1, TVN_INDEX(base->timer_jiffies, 1)) &&
+            !cascade(base, 2, TVN_INDEX(base->timer_jiffies, 2)))
+            cascade(base, 3, TVN_INDEX(base->timer_jiffies, 3));
+        ++base->timer_jiffies;
+        /* 回调函数运行时可能取消其他到期的定时器，它们也在 list 中 */
+        struct linked_list_node list;
+        take_slot(&base->tv1[index], &list);
+        while (!linked_list_empty(&list)) {
+            struct timer_list *timer = container_of(list.next, struct timer_list, entry);
+            detach_timer(base, timer);
+            base->running = timer;
+            release_lock(&base->lock);
+            timer->function(timer);
+            acquire_lock(&base->lock);
+            base->running = NULL;
+        }
+    }
+    if (base->timer_jiffies <= jiffies)
+        base->timer_jiffies = jiffies + 1;
+    base->next_expiry_valid = 0;
+    release_lock(&base->lock);
+}
+
+/**
+ * @brief 本处理器的时间轮需要在何时推进
+ *
+ * 只查找第 1 级，第 1 级在本圈内没有定时器时返回下一次级联的时刻，因此结果可能早于实际的
+ * 到期时刻，最多多发生一次 tick。结果在下一次 run_timers() 之前缓存。
+ *
+ * @return 时刻（jiffies），可能已经过去；时间轮为空时返回 UINT64_MAX
+ */
+uint64_t timer_next_expiry()
+{
+    struct tvec_base *base = &tvec_bases[this_cpu()->id];
+    uint64_t flags = acquire_lock_irqsave(&base->lock);
+    uint64_t expires = UINT64_MAX;
+    if (base->nr_pending) {
+        if (!base->next_expiry_valid) {
+            uint64_t j = base->timer_jiffies;
+            /* 位于第 1 级开头时先要级联 */
+            if (j & TVR_MASK) {
+                while (linked_list_empty(&base->tv1[j & TVR_MASK]) && (++j & TVR_MASK))
+                    ;
+            }
+            base->next_expiry = j;
+            base->next_expiry_valid = 1;
+        }
+        expires = base->next_expiry;
+    }
+    release_lock_irqrestore(&base->lock, flags);
+    return expires;
+}
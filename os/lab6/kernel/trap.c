@@ -21,7 +21,7 @@
 #include <syscall.h>
 #include <trap.h>
 #include <device/irq.h>
-#include <lib/sleep.h>
+#include <hrtimer.h>
 
 static inline struct trapframe* trap_dispatch(struct trapframe* tf);
 static struct trapframe* interrupt_handler(struct trapframe* tf);
@@ -29,14 +29,72 @@ static struct trapframe* exception_handler(struct trapframe* tf);
 static struct trapframe* syscall_handler(struct trapframe* tf);
 
 /**
- *@brief 写保护异常处理函数
+ * @brief 写保护异常处理函数
+ *
+ * @return 写时复制成功返回 0，写只读区域或未映射的地址返回 -EFAULT
  */
-void wp_page_handler(struct trapframe* tf)
+static int wp_page_handler(struct trapframe* tf)
 {
     uint64_t badvaddr = tf->badvaddr;
     if (badvaddr < current->start_data)
-        panic("Try to write read-only memory");
-    write_verify(badvaddr);
+        return -EFAULT;
+    return write_verify(badvaddr);
+}
+
+/**
+ * @brief 判断用户地址是否位于当前进程的匿名区域
+ *
+ * 匿名区域包括堆 [end_data, brk) 和栈 [STACK_LIMIT, START_KERNEL)，
+ * 它们在进程创建时只保留地址范围，第一次访问时才分配物理页。
+ *
+ * @param addr 虚拟地址
+ */
+static int is_anonymous(uint64_t addr)
+{
+    return (addr >= current->end_data && addr < current->brk) ||
+           (addr >= STACK_LIMIT && addr < START_KERNEL);
+}
+
+/**
+ * @brief 非法访问内存
+ *
+ * 用户态的非法访问只结束当前进程；内核态的非法访问（包括系统调用访问非法的用户地址）
+ * 可能发生在持有锁时，无法安全地结束进程，仍然 panic。
+ */
+static void bad_area(struct trapframe* tf)
+{
+    const char *type = tf->cause == CAUSE_STORE_PAGE_FAULT ? "store" :
+                       tf->cause == CAUSE_LOAD_PAGE_FAULT ? "load" : "instruction";
+    if (trap_in_kernel(tf)) {
+        print_trapframe(tf);
+        panic("%s page fault in kernel at %p", type, tf->badvaddr);
+    }
+    kprintf("task %u: %s page fault at %p, epc %p, killed\n",
+            (uint64_t)current->pid, type, tf->badvaddr, tf->epc);
+    do_exit(-EFAULT);
+}
+
+/**
+ * @brief 缺页异常处理函数
+ *
+ * 匿名区域中未映射的页按需分配（读映射零页，写分配新页），
+ * 用户地址中已映射页上的写异常交给写时复制处理，其余情况是非法访问。
+ * 内核访问用户地址（如系统调用读写用户缓冲区）时发生的缺页异常同样在此处理。
+ */
+static void page_fault_handler(struct trapframe* tf)
+{
+    uint64_t addr = tf->badvaddr;
+    int write = tf->cause == CAUSE_STORE_PAGE_FAULT;
+    if (tf->cause != CAUSE_INSTRUCTION_PAGE_FAULT && is_anonymous(addr)) {
+        int ret = do_no_page(addr, write);
+        if (!ret)
+            return;
+        if (ret == -ENOMEM)
+            panic("page_fault_handler(): memory exhausts");
+    }
+    if (write && IS_USER(addr, addr + 1) && !wp_page_handler(tf))
+        return;
+    bad_area(tf);
 }
 
 static struct trapframe* external_handler(struct trapframe* tf)
@@ -59,16 +117,23 @@ void set_stvec()
     extern void __alltraps(void);
     /* 设置STVEC的值，MODE=00，因为地址的最后两位四字节对齐后必为0，因此不用单独设置MODE */
     write_csr(stvec, &__alltraps);
-    set_csr(sie, 1 << IRQ_S_EXT);
+    set_csr(sie, (1 << IRQ_S_EXT) | (1 << IRQ_S_SOFT));
 }
 
 /**
  * @brief 中断处理函数，从 trapentry.s 跳转而来
+ *
+ * 返回用户态前检查 need_resched：时间片用完或唤醒了更应运行的进程时重新调度。
+ *
  * @param tf 中断保存栈
  */
 struct trapframe* trap(struct trapframe* tf)
 {
-    return trap_dispatch(tf);
+    tf = trap_dispatch(tf);
+    if (current->need_resched && !trap_in_kernel(tf)) {
+        schedule();
+    }
+    return tf;
 }
 
 /**
@@ -93,9 +158,15 @@ struct trapframe* interrupt_handler(struct trapframe* tf)
     case IRQ_U_SOFT:
         kputs("User software interrupt\n");
         break;
-    case IRQ_S_SOFT:
-        kputs("Supervisor software interrupt\n");
+    case IRQ_S_SOFT: {
+        /* 其他处理器发来的处理器间中断：need_resched 已由发送方设置，或者要求本处理器重新设置时钟中断；
+         * 空闲进程被唤醒时重新调度，从其他处理器拉取进程 */
+        clear_csr(sip, 1 << IRQ_S_SOFT);
+        if (current == this_rq()->idle)
+            current->need_resched = 1;
+        clock_set_next_event();
         break;
+    }
     case IRQ_H_SOFT:
         kputs("Hypervisor software interrupt\n");
         break;
@@ -104,19 +175,9 @@ struct trapframe* interrupt_handler(struct trapframe* tf)
         break;
     case IRQ_U_TIMER:
     case IRQ_S_TIMER:
-        clock_set_next_event();
-        usleep_handler();
+        this_cpu()->irq_regs = tf;
         // enable_interrupt(); /* 允许嵌套中断 */
-        if (trap_in_kernel(tf)) {
-            ++current->cstime;
-        } else {
-            ++current->cutime;
-        }
-        if (current->counter && --current->counter)
-            return tf;
-        if (!trap_in_kernel(tf)) {
-            schedule();
-        }
+        hrtimer_interrupt(); /* tick 也是一个定时器 */
         break;
     case IRQ_H_TIMER:
         kputs("Hypervisor timer interrupt\n");
@@ -207,17 +268,9 @@ struct trapframe* exception_handler(struct trapframe* tf)
         sbi_shutdown();
         break;
     case CAUSE_INSTRUCTION_PAGE_FAULT:
-        kputs("instruction page fault");
-        print_trapframe(tf);
-        sbi_shutdown();
-        break;
     case CAUSE_LOAD_PAGE_FAULT:
-        kputs("load page fault");
-        print_trapframe(tf);
-        sbi_shutdown();
-        break;
     case CAUSE_STORE_PAGE_FAULT:
-        wp_page_handler(tf);
+        page_fault_handler(tf);
         break;
     default:
         kputs("unknown exception");
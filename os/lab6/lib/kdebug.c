@@ -2,21 +2,52 @@
 #include <sbi.h>
 #include <stdarg.h>
 #include <string.h>
+#include <smp.h>
+#include <utils/atomic.h>
 
 static uint64_t kpow(uint64_t x, uint64_t y);
+static int vkprintf(const char* fmt, va_list ap);
+
+// 控制台锁，使一次 kputs()/kprintf() 的输出不与其他处理器的输出交错
+// 中断处理程序也会输出，因此关中断加锁；同一处理器重入（如输出时 panic）不再加锁
+static struct spinlock console_lock = { .locked = 0, .name = "console" };
+static struct cpu *volatile console_owner;
+#define CONSOLE_NESTED (-1UL)
+
+static uint64_t console_lock_irqsave()
+{
+    struct cpu *cpu = this_cpu();
+    if (console_owner == cpu)
+        return CONSOLE_NESTED;
+    uint64_t flags = acquire_lock_irqsave(&console_lock);
+    console_owner = cpu;
+    return flags;
+}
+
+static void console_unlock_irqrestore(uint64_t flags)
+{
+    if (flags == CONSOLE_NESTED)
+        return;
+    console_owner = NULL;
+    release_lock_irqrestore(&console_lock, flags);
+}
 
 void kputchar(char ch)
 {
+    uint64_t flags = console_lock_irqsave();
     sbi_console_putchar(ch);
+    console_unlock_irqrestore(flags);
 }
 
 int kputs(const char* msg)
 {
+    uint64_t flags = console_lock_irqsave();
     const char* ret = msg;
     for (; *msg != '\0'; ++msg) {
-        kputchar(*msg);
+        sbi_console_putchar(*msg);
     }
-    kputchar('\n');
+    sbi_console_putchar('\n');
+    console_unlock_irqrestore(flags);
     return ret == msg;
 }
 
@@ -24,6 +55,7 @@ void do_panic(const char* file, int line, const char* fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
+    console_lock_irqsave(); /* 关机前不再释放 */
     kprintf("--------------------------------------------------------------------------\n");
     kprintf("Panic at %s: %u\n", file, line);
     if (strlen(fmt)) {
@@ -40,6 +72,16 @@ void do_panic(const char* file, int line, const char* fmt, ...)
 int kprintf(const char* fmt, ...)
 {
     va_list ap;
+    va_start(ap, fmt);
+    uint64_t flags = console_lock_irqsave();
+    int rev = vkprintf(fmt, ap);
+    console_unlock_irqrestore(flags);
+    va_end(ap);
+    return rev;
+}
+
+static int vkprintf(const char* fmt, va_list ap)
+{
     uint64_t val;
     uint64_t temp;
     uint64_t len;
@@ -47,7 +89,6 @@ int kprintf(const char* fmt, ...)
     int ch;
     const char* str = NULL;
 
-    va_start(ap, fmt);
     while (*fmt != '\0')
     {
         switch (*fmt)
@@ -138,7 +179,6 @@ int kprintf(const char* fmt, ...)
         }
         fmt++;
     }
-    va_end(ap);
     return rev;
 }
 
@@ -0,0 +1,222 @@
+#include <utils/rbtree.h>
+
+/*
+ * 红黑树的性质：
+ * 1. 节点是红色或黑色，根节点是黑色
+ * 2. 红色节点的子节点都是黑色（NULL 视为黑色）
+ * 3. 从任一节点到其下各个 NULL 的路径包含相同数目的黑色节点
+ * 因此最长路径不超过最短路径的两倍，插入、删除、查找都是 O(log n)。
+ */
+
+static inline uint64_t rb_is_black(const struct rb_node *node)
+{
+    return !node || node->color == RB_BLACK;
+}
+
+// 用 new 替换 parent 的子节点 old，parent 为 NULL 时替换根节点
+static inline void rb_change_child(struct rb_node *old, struct rb_node *new,
+                                   struct rb_node *parent, struct rb_root *root)
+{
+    if (!parent)
+        root->node = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *right = node->right;
+    if ((node->right = right->left))
+        right->left->parent = node;
+    right->parent = node->parent;
+    rb_change_child(node, right, node->parent, root);
+    right->left = node;
+    node->parent = right;
+}
+
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *left = node->left;
+    if ((node->left = left->right))
+        left->right->parent = node;
+    left->parent = node->parent;
+    rb_change_child(node, left, node->parent, root);
+    left->right = node;
+    node->parent = left;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *parent, *gparent, *uncle, *tmp;
+
+    while ((parent = node->parent) && parent->color == RB_RED) {
+        gparent = parent->parent; /* 父节点是红色，不是根节点 */
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+            if (!rb_is_black(uncle)) {
+                uncle->color = parent->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rb_rotate_left(parent, root);
+                tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(gparent, root);
+        } else {
+            uncle = gparent->left;
+            if (!rb_is_black(uncle)) {
+                uncle->color = parent->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rb_rotate_right(parent, root);
+                tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+// 删除黑色节点后，node（可能为 NULL）所在的路径少了一个黑色节点，向上修复
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent, struct rb_root *root)
+{
+    struct rb_node *other;
+
+    while (rb_is_black(node) && node != root->node) {
+        if (parent->left == node) {
+            other = parent->right;
+            if (other->color == RB_RED) {
+                other->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(parent, root);
+                other = parent->right;
+            }
+            if (rb_is_black(other->left) && rb_is_black(other->right)) {
+                other->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+            } else {
+                if (rb_is_black(other->right)) {
+                    other->left->color = RB_BLACK;
+                    other->color = RB_RED;
+                    rb_rotate_right(other, root);
+                    other = parent->right;
+                }
+                other->color = parent->color;
+                parent->color = RB_BLACK;
+                other->right->color = RB_BLACK;
+                rb_rotate_left(parent, root);
+                node = root->node;
+                break;
+            }
+        } else {
+            other = parent->left;
+            if (other->color == RB_RED) {
+                other->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(parent, root);
+                other = parent->left;
+            }
+            if (rb_is_black(other->left) && rb_is_black(other->right)) {
+                other->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+            } else {
+                if (rb_is_black(other->left)) {
+                    other->right->color = RB_BLACK;
+                    other->color = RB_RED;
+                    rb_rotate_left(other, root);
+                    other = parent->left;
+                }
+                other->color = parent->color;
+                parent->color = RB_BLACK;
+                other->left->color = RB_BLACK;
+                rb_rotate_right(parent, root);
+                node = root->node;
+                break;
+            }
+        }
+    }
+    if (node)
+        node->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *child, *parent;
+    uint64_t color;
+
+    if (node->left && node->right) {
+        /* 用后继节点（右子树的最小节点）代替被删除的节点 */
+        struct rb_node *old = node;
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        child = node->right;
+        parent = node->parent;
+        color = node->color;
+        if (child)
+            child->parent = parent;
+        if (parent == old) {
+            parent->right = child;
+            parent = node;
+        } else {
+            parent->left = child;
+        }
+        node->parent = old->parent;
+        node->color = old->color;
+        node->left = old->left;
+        node->right = old->right;
+        rb_change_child(old, node, old->parent, root);
+        old->left->parent = node;
+        if (old->right)
+            old->right->parent = node;
+    } else {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+        if (child)
+            child->parent = parent;
+        rb_change_child(node, child, parent, root);
+    }
+    if (color == RB_BLACK)
+        rb_erase_color(child, parent, root);
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+    struct rb_node *node = root->node;
+    if (!node)
+        return NULL;
+    while (node->left)
+        node = node->left;
+    return node;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return (struct rb_node *)node;
+    }
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
@@ -99,6 +99,61 @@ void sbi_shutdown()
                  : "memory");
 }
 
+struct sbiret sbi_hart_start(uint64_t hartid, uint64_t start_addr, uint64_t opaque)
+{
+    register uint64_t a7 asm("a7") = HART_STATE_EXTENTION;
+    register uint64_t a6 asm("a6") = 0;
+    register uint64_t error asm("a0") = hartid;
+    register uint64_t value asm("a1") = start_addr;
+    register uint64_t a2 asm("a2") = opaque;
+    __asm__ __volatile__("ecall \n\t"
+                 : "+r"(error), "+r"(value)
+                 : "r"(a2), "r"(a6), "r"(a7)
+                 : "memory");
+    return (struct sbiret){ error, value };
+}
+
+struct sbiret sbi_hart_get_status(uint64_t hartid)
+{
+    register uint64_t a7 asm("a7") = HART_STATE_EXTENTION;
+    register uint64_t a6 asm("a6") = 2;
+    register uint64_t error asm("a0") = hartid;
+    register uint64_t value asm("a1");
+    __asm__ __volatile__("ecall \n\t"
+                 : "+r"(error), "=r"(value)
+                 : "r"(a6), "r"(a7)
+                 : "memory");
+    return (struct sbiret){ error, value };
+}
+
+struct sbiret sbi_send_ipi(uint64_t hart_mask, uint64_t hart_mask_base)
+{
+    register uint64_t a7 asm("a7") = IPI_EXTENTION;
+    register uint64_t a6 asm("a6") = 0;
+    register uint64_t error asm("a0") = hart_mask;
+    register uint64_t value asm("a1") = hart_mask_base;
+    __asm__ __volatile__("ecall \n\t"
+                 : "+r"(error), "+r"(value)
+                 : "r"(a6), "r"(a7)
+                 : "memory");
+    return (struct sbiret){ error, value };
+}
+
+struct sbiret sbi_remote_sfence_vma(uint64_t hart_mask, uint64_t hart_mask_base, uint64_t start_addr, uint64_t size)
+{
+    register uint64_t a7 asm("a7") = RFENCE_EXTENTION;
+    register uint64_t a6 asm("a6") = 1;
+    register uint64_t error asm("a0") = hart_mask;
+    register uint64_t value asm("a1") = hart_mask_base;
+    register uint64_t a2 asm("a2") = start_addr;
+    register uint64_t a3 asm("a3") = size;
+    __asm__ __volatile__("ecall \n\t"
+                 : "+r"(error), "+r"(value)
+                 : "r"(a2), "r"(a3), "r"(a6), "r"(a7)
+                 : "memory");
+    return (struct sbiret){ error, value };
+}
+
 void print_system_infomation()
 {
     struct sbiret ret;
@@ -114,6 +169,18 @@ void print_system_infomation()
     else
         kputs("HART_STATE_EXTENTION: unavailable");
 
+    ret = sbi_probe_extension(IPI_EXTENTION);
+    if (ret.value != 0)
+        kputs("IPI_EXTENTION: available");
+    else
+        kputs("IPI_EXTENTION: unavailable");
+
+    ret = sbi_probe_extension(RFENCE_EXTENTION);
+    if (ret.value != 0)
+        kputs("RFENCE_EXTENTION: available");
+    else
+        kputs("RFENCE_EXTENTION: unavailable");
+
     ret = sbi_probe_extension(RESET_EXTENTION);
     if (ret.value != 0)
         kputs("RESET_EXTENTION: available");
@@ -0,0 +1,237 @@
+/**
+ * @file buddy.c
+ * @brief 实现伙伴系统（Buddy System）物理页分配器
+ *
+ * 物理内存 [LOW_MEM, HIGH_MEM) 被划分为大小为 2^order 页的块，每个阶（order）
+ * 维护一条空闲链表。分配时从满足要求的最小阶取块，多余部分逐级拆分放回低阶链表；
+ * 释放时检查伙伴块是否空闲，空闲则合并成高一阶的块，直到无法合并为止。
+ * 分配和释放的时间复杂度均为 O(MAX_ORDER)。
+ *
+ * 空闲块通过首页描述符的 lru 节点链入空闲链表，首页描述符的 PG_buddy 标志和 order
+ * 记录块的阶，不需要访问空闲页本身。
+ * 块号使用`MAP_NR()`（相对 MEM_START 的页号），MEM_START 按 2G 对齐，因此
+ * 2^order 页的块在物理地址上也按 2^order 页对齐。
+ *
+ * 与原来的线性扫描一致，本分配器优先分配高地址内存。
+ *
+ * 空闲链表由 zone_lock 保护，可以在任意处理器、任意上下文（包括中断处理）中分配和释放。
+ */
+#include <assert.h>
+#include <kdebug.h>
+#include <mm.h>
+#include <stddef.h>
+#include <utils/atomic.h>
+#include <utils/linked_list.h>
+
+/** 某一阶的空闲块链表 */
+struct free_area {
+    struct linked_list_node free_list;  /**< 空闲块链表，节点为空闲块首页描述符的 lru */
+    uint64_t nr_free;                   /**< 空闲块数量 */
+};
+
+static struct free_area free_area[MAX_ORDER];
+
+/** 保护空闲链表 */
+static struct spinlock zone_lock;
+
+/** 页号转换为空闲链表节点 */
+#define PFN_TO_NODE(pfn) (&mem_map[pfn].lru)
+/** 空闲链表节点转换为页号 */
+#define NODE_TO_PFN(node) ((uint64_t)(container_of(node, struct page, lru) - mem_map))
+
+/**
+ * @brief 将一个空闲块放入空闲链表
+ *
+ * @param pfn 块首页页号
+ * @param order 块的阶
+ */
+static inline void add_free_block(uint64_t pfn, uint32_t order)
+{
+    mem_map[pfn].flags |= PG_buddy;
+    mem_map[pfn].order = order;
+    linked_list_unshift(&free_area[order].free_list, PFN_TO_NODE(pfn));
+    ++free_area[order].nr_free;
+}
+
+/**
+ * @brief 将一个空闲块移出空闲链表
+ *
+ * @param pfn 块首页页号
+ * @param order 块的阶
+ */
+static inline void del_free_block(uint64_t pfn, uint32_t order)
+{
+    mem_map[pfn].flags &= ~PG_buddy;
+    linked_list_remove(PFN_TO_NODE(pfn));
+    --free_area[order].nr_free;
+}
+
+/**
+ * @brief 释放一个块，并与空闲的伙伴块合并
+ *
+ * @param pfn 块首页页号
+ * @param order 块的阶
+ */
+static void free_block(uint64_t pfn, uint32_t order)
+{
+    while (order < MAX_ORDER - 1) {
+        uint64_t buddy = pfn ^ (1UL << order);
+        if (buddy >= PAGING_PAGES || !(mem_map[buddy].flags & PG_buddy) ||
+            mem_map[buddy].order != order)
+            break;
+        del_free_block(buddy, order);
+        pfn &= buddy;
+        ++order;
+    }
+    add_free_block(pfn, order);
+}
+
+/**
+ * @brief 初始化伙伴系统
+ *
+ * 初始化空闲链表。
+ */
+void buddy_init()
+{
+    for (size_t i = 0; i < MAX_ORDER; ++i) {
+        linked_list_init(&free_area[i].free_list);
+        free_area[i].nr_free = 0;
+    }
+    init_lock(&zone_lock, "zone");
+}
+
+/**
+ * @brief 将空闲物理内存交给伙伴系统
+ *
+ * 将物理地址区间 [start, end) 按最大对齐块放入空闲链表，区间内物理页引用计数应为 0。
+ *
+ * @param start 起始物理地址
+ * @param end 结束物理地址
+ * @note 地址必须按页对齐
+ */
+void buddy_add_range(uint64_t start, uint64_t end)
+{
+    uint64_t pfn = MAP_NR(start);
+    uint64_t end_pfn = MAP_NR(end);
+    while (pfn < end_pfn) {
+        uint32_t order = MAX_ORDER - 1;
+        while ((pfn & ((1UL << order) - 1)) || pfn + (1UL << order) > end_pfn)
+            --order;
+        add_free_block(pfn, order);
+        pfn += 1UL << order;
+    }
+}
+
+/**
+ * @brief 分配 2^order 个物理上连续的页
+ *
+ * 分配得到的每一页引用计数均为 1，本函数不会清零页面。
+ *
+ * @param order 阶
+ * @return 成功则返回块首页物理地址（按 2^order 页对齐），失败返回 0
+ * @see free_pages(), get_free_page()
+ */
+uint64_t alloc_pages(uint32_t order)
+{
+    if (order >= MAX_ORDER)
+        return 0;
+    uint64_t flags = acquire_lock_irqsave(&zone_lock);
+    uint32_t cur = order;
+    while (cur < MAX_ORDER && linked_list_empty(&free_area[cur].free_list))
+        ++cur;
+    if (cur == MAX_ORDER) {
+        release_lock_irqrestore(&zone_lock, flags);
+        return 0;
+    }
+
+    uint64_t pfn = NODE_TO_PFN(linked_list_first(&free_area[cur].free_list));
+    del_free_block(pfn, cur);
+    /* 拆分：低地址一半放回空闲链表，继续拆分高地址一半 */
+    while (cur > order) {
+        --cur;
+        add_free_block(pfn, cur);
+        pfn += 1UL << cur;
+    }
+    for (uint64_t i = 0; i < (1UL << order); ++i) {
+        assert(page_count(&mem_map[pfn + i]) == 0,
+               "alloc_pages(): page %p is in use",
+               MEM_START + ((pfn + i) << 12));
+        set_page_count(&mem_map[pfn + i], 1);
+    }
+    release_lock_irqrestore(&zone_lock, flags);
+    return MEM_START + (pfn << 12);
+}
+
+/**
+ * @brief 释放 alloc_pages() 分配的 2^order 个页
+ *
+ * 每一页引用计数减 1。若全部页引用计数都降为 0，则整块归还伙伴系统；
+ * 否则（部分页被共享）只归还引用计数降为 0 的页。
+ *
+ * @param addr 块首页物理地址
+ * @param order 阶
+ */
+void free_pages(uint64_t addr, uint32_t order)
+{
+    if (addr < LOW_MEM)
+        return;
+    if (addr + (PAGE_SIZE << order) > HIGH_MEM)
+        panic("free_pages(): trying to free nonexistent page");
+    assert(!(MAP_NR(addr) & ((1UL << order) - 1)),
+           "free_pages(): block %p is not aligned to order %u", addr, (uint64_t)order);
+    uint64_t pfn = MAP_NR(addr);
+    uint64_t nr = 1UL << order;
+    uint64_t shared = 0;
+    uint64_t flags = acquire_lock_irqsave(&zone_lock);
+    for (uint64_t i = 0; i < nr; ++i) {
+        assert(page_count(&mem_map[pfn + i]) != 0,
+               "free_pages(): trying to free free page");
+        shared |= page_count(&mem_map[pfn + i]) != 1;
+    }
+    if (!shared) {
+        for (uint64_t i = 0; i < nr; ++i)
+            set_page_count(&mem_map[pfn + i], 0);
+        free_block(pfn, order);
+    } else {
+        for (uint64_t i = 0; i < nr; ++i) {
+            if (page_ref_dec_and_test(&mem_map[pfn + i]))
+                free_block(pfn + i, 0);
+        }
+    }
+    release_lock_irqrestore(&zone_lock, flags);
+}
+
+/**
+ * @brief 引用计数已降为 0 的单个物理页归还伙伴系统
+ *
+ * 供 free_page() 使用。
+ *
+ * @param addr 物理地址
+ */
+void __free_page(uint64_t addr)
+{
+    uint64_t flags = acquire_lock_irqsave(&zone_lock);
+    free_block(MAP_NR(addr), 0);
+    release_lock_irqrestore(&zone_lock, flags);
+}
+
+/**
+ * @brief 获取空闲物理页总数
+ */
+uint64_t nr_free_pages()
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < MAX_ORDER; ++i)
+        sum += free_area[i].nr_free << i;
+    return sum;
+}
+
+/**
+ * @brief 打印各阶空闲块数量
+ */
+void show_free_areas()
+{
+    for (size_t i = 0; i < MAX_ORDER; ++i)
+        kprintf("order %u: %u\n", (uint64_t)i, free_area[i].nr_free);
+    kprintf("free pages: %u\n", nr_free_pages());
+}
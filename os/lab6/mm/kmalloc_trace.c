@@ -0,0 +1,231 @@
+/**
+ * @file kmalloc_trace.c
+ * @brief 跟踪 kmalloc() 的使用情况
+ *
+ * KMALLOC_TRACE 不为 0 时，kmalloc() 的每个调用点（调用 kmalloc() 的指令地址）在调用点表中
+ * 有一项，记录分配次数、释放次数、未释放的对象数及其峰值和分配速率；每个未释放的对象在对象表中
+ * 有一条记录，保存对象所属的调用点和申请的大小。两张表都是哈希表，分配和释放的额外开销为 O(1)。
+ *
+ * 借助对象表可以发现以下错误：
+ * - 释放未分配的地址（包括重复释放）：报告并拒绝释放，避免破坏分配器
+ * - kfree_s() 的 size 与 kmalloc() 申请的大小不一致：报告
+ * - 内存泄漏：kmalloc_trace_mark() 设置检查点后，kmalloc_trace_leaks() 列出检查点之后分配、
+ *   仍未释放的对象
+ *
+ * 对象记录从专门的 slab 缓存分配，不会递归调用 kmalloc()。
+ * 本模块的函数都在关中断并持有 kmalloc_lock 时调用：分配和释放由 kmalloc()/kfree_s() 调用，
+ * 统计和泄漏检查通过 malloc.c 中加锁的 kmalloc_show_trace() 等函数调用。
+ */
+#include <clock.h>
+#include <kdebug.h>
+#include <mm.h>
+#include <stddef.h>
+
+#define CALLSITE_HASH_BITS 8
+#define NR_CALLSITES (1 << CALLSITE_HASH_BITS)          /**< 调用点表大小 */
+#define OBJECT_HASH_BITS 10
+#define NR_OBJECT_HASH (1 << OBJECT_HASH_BITS)          /**< 对象表桶数 */
+#define MAX_LEAK_REPORT 64                              /**< 最多列出的泄漏对象数 */
+
+/** 调用点统计信息 */
+struct kmalloc_callsite {
+    uint64_t caller;        /**< 调用 kmalloc() 的指令地址，0 表示空项 */
+    uint64_t first_cycle;   /**< 第一次分配时的 time CSR 计数 */
+    uint64_t nr_allocs;     /**< 分配次数 */
+    uint64_t nr_frees;      /**< 释放次数 */
+    uint64_t live;          /**< 未释放的对象数 */
+    uint64_t peak;          /**< 未释放对象数的峰值 */
+    uint64_t live_bytes;    /**< 未释放对象实际占用的字节数 */
+    uint64_t size_classes;  /**< 分配过的块大小，第 i 位表示 2^i 字节 */
+};
+
+/** 对象记录 */
+struct kmalloc_object {
+    struct kmalloc_object *next;    /**< 对象表同一桶中的下一个记录 */
+    uint64_t addr;                  /**< 对象地址 */
+    uint32_t size;                  /**< 申请的大小 */
+    uint16_t site;                  /**< 所属调用点在调用点表中的下标 */
+    uint16_t generation;            /**< 分配时的检查点编号 */
+};
+
+static struct kmalloc_callsite callsites[NR_CALLSITES];
+static struct kmalloc_object *objects[NR_OBJECT_HASH];
+static struct kmem_cache *object_cache;
+static uint16_t generation;             /**< 当前检查点编号 */
+static uint64_t nr_dropped;             /**< 调用点表已满或记录分配失败而未跟踪的分配次数 */
+
+/**
+ * @brief 计算 64 位整数的哈希值
+ */
+static inline uint64_t hash64(uint64_t val, uint32_t bits)
+{
+    return (val * 0x61C8864680B583EBUL) >> (64 - bits);
+}
+
+/**
+ * @brief 查找或创建调用点
+ *
+ * @return 调用点在调用点表中的下标，表已满时返回 -1
+ */
+static int find_callsite(uint64_t caller)
+{
+    uint64_t idx = hash64(caller, CALLSITE_HASH_BITS);
+    for (size_t i = 0; i < NR_CALLSITES; ++i, idx = (idx + 1) & (NR_CALLSITES - 1)) {
+        if (callsites[idx].caller == caller)
+            return idx;
+        if (!callsites[idx].caller) {
+            callsites[idx].caller = caller;
+            callsites[idx].first_cycle = get_cycles();
+            return idx;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 在对象表中查找对象记录
+ *
+ * @return 指向记录指针的指针（便于删除），未找到时 *返回值 为 NULL
+ */
+static struct kmalloc_object **find_object(uint64_t addr)
+{
+    struct kmalloc_object **pp = &objects[hash64(addr, OBJECT_HASH_BITS)];
+    while (*pp && (*pp)->addr != addr)
+        pp = &(*pp)->next;
+    return pp;
+}
+
+/**
+ * @brief 初始化 kmalloc 跟踪
+ */
+void kmalloc_trace_init()
+{
+    object_cache = kmem_cache_create("kmalloc_trace", sizeof(struct kmalloc_object), 0, NULL);
+}
+
+/**
+ * @brief 记录一次分配
+ *
+ * @param ptr 分配得到的地址
+ * @param size 申请的大小
+ * @param real_size 实际分配的大小
+ * @param caller 调用点
+ */
+void kmalloc_trace_alloc(void *ptr, uint64_t size, uint64_t real_size, uint64_t caller)
+{
+    int site = find_callsite(caller);
+    struct kmalloc_object *obj;
+    if (site < 0 || !object_cache || !(obj = kmem_cache_alloc_i(object_cache))) {
+        ++nr_dropped;
+        return;
+    }
+    struct kmalloc_callsite *cs = &callsites[site];
+    ++cs->nr_allocs;
+    if (++cs->live > cs->peak)
+        cs->peak = cs->live;
+    cs->live_bytes += real_size;
+    cs->size_classes |= real_size;
+    obj->addr = (uint64_t)ptr;
+    obj->size = size;
+    obj->site = site;
+    obj->generation = generation;
+    struct kmalloc_object **head = &objects[hash64(obj->addr, OBJECT_HASH_BITS)];
+    obj->next = *head;
+    *head = obj;
+}
+
+/**
+ * @brief 检查一次释放是否合法
+ *
+ * @param ptr 待释放的地址
+ * @param size kfree_s() 的 size 参数
+ * @param caller 调用点
+ * @return 合法返回 0；ptr 未分配或已释放返回 -1
+ */
+int kmalloc_trace_check_free(void *ptr, uint64_t size, uint64_t caller)
+{
+    struct kmalloc_object *obj = *find_object((uint64_t)ptr);
+    if (!obj) {
+        /* 调用点表已满时部分对象未被跟踪，无法判断 */
+        if (nr_dropped)
+            return 0;
+        kprintf("kfree(): %p is not allocated (double free?), caller %p\n", ptr, caller);
+        return -1;
+    }
+    if (size && size != obj->size)
+        kprintf("kfree_s(): size %u mismatches kmalloc() size %u of %p, "
+                "allocated at %p, freed at %p\n", size, (uint64_t)obj->size, ptr,
+                callsites[obj->site].caller, caller);
+    return 0;
+}
+
+/**
+ * @brief 记录一次成功的释放
+ *
+ * @param ptr 已释放的地址
+ * @param real_size 实际释放的大小
+ */
+void kmalloc_trace_free(void *ptr, uint64_t real_size)
+{
+    struct kmalloc_object **pp = find_object((uint64_t)ptr);
+    struct kmalloc_object *obj = *pp;
+    if (!obj)
+        return;
+    struct kmalloc_callsite *cs = &callsites[obj->site];
+    ++cs->nr_frees;
+    --cs->live;
+    cs->live_bytes -= real_size;
+    *pp = obj->next;
+    kmem_cache_free_i(object_cache, obj);
+}
+
+/**
+ * @brief 打印各调用点的统计信息
+ */
+void kmalloc_trace_show()
+{
+    kputs("caller\t\t\tallocs\tfrees\tlive\tpeak\tbytes\trate/s\tsizes");
+    for (size_t i = 0; i < NR_CALLSITES; ++i) {
+        struct kmalloc_callsite *cs = &callsites[i];
+        if (!cs->caller)
+            continue;
+        /* 按 time CSR 计时，不依赖时钟中断是否在计数 */
+        uint64_t elapsed = get_cycles() - cs->first_cycle + 1;
+        kprintf("%p\t%u\t%u\t%u\t%u\t%u\t%u\t%x\n", cs->caller, cs->nr_allocs,
+                cs->nr_frees, cs->live, cs->peak, cs->live_bytes,
+                cs->nr_allocs * timebase_freq / elapsed, cs->size_classes);
+    }
+    if (nr_dropped)
+        kprintf("%u allocations not tracked\n", nr_dropped);
+}
+
+/**
+ * @brief 设置泄漏检查点
+ *
+ * 之后 kmalloc_trace_leaks() 只报告检查点之后分配的对象。
+ */
+void kmalloc_trace_mark()
+{
+    ++generation;
+}
+
+/**
+ * @brief 列出检查点之后分配、仍未释放的对象
+ *
+ * @return 这样的对象数
+ */
+uint64_t kmalloc_trace_leaks()
+{
+    uint64_t cnt = 0;
+    for (size_t i = 0; i < NR_OBJECT_HASH; ++i) {
+        for (struct kmalloc_object *obj = objects[i]; obj; obj = obj->next) {
+            if (obj->generation != generation)
+                continue;
+            if (cnt++ < MAX_LEAK_REPORT)
+                kprintf("leak? %p size %u allocated at %p\n", obj->addr,
+                        (uint64_t)obj->size, callsites[obj->site].caller);
+        }
+    }
+    kprintf("%u objects allocated since last mark are still live\n", cnt);
+    return cnt;
+}
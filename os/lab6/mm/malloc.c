@@ -3,10 +3,12 @@
  * @brief 实现内核内存管理
  *
  * 本模块实现了kmalloc与kfree_s函数，从而允许内核程序动态的申请和释放内存。
+ * 不超过一页的内存从桶中分配，超过一页的内存直接从伙伴系统分配物理上连续的 2^order 页。
  */
 
 #include <mm.h>
 #include <stddef.h>
+#include <utils/atomic.h>
 
 /* for malloc_test() */
 #include <assert.h>
@@ -44,37 +46,65 @@ static inline uint8_t q_log2_ceil(uint64_t n) {
     return debruijn[((uint64_t)((n + 1) * 0x07EDD5E59A4E28C2)) >> 58];
 }
 
-/**
- * @brief 快速计算素因子中所含2的个数
- *
- * 设n = (2*k+1) * 2 ** p，返回p。
- *
- * @param n   64位无符号整数
- * @return 素因子中所含2的个数
- */
-static inline uint8_t q_pow2_factor(uint64_t n) {
-    return debruijn[((uint64_t)((n & -n) * 0x07EDD5E59A4E28C2)) >> 58];
-}
-
 /* 可分配的块大小：16B - 4KB(一整页) */
 #define PAGE_SIZE_LOG2 12
 #define MIN_ALLOC_SIZE_LOG2 4
 #define MAX_ALLOC_SIZE_LOG2 PAGE_SIZE_LOG2
-/* 特殊桶大小 */
-#define SPECIAL_BUCKET_SIZE_LOG2 5
-
-/* 桶描述符目录 [16, 32, 64, 128, 256, 512, 1024, 2048, 4096] */
-struct bucket_desc* bucket_dir[MAX_ALLOC_SIZE_LOG2 - MIN_ALLOC_SIZE_LOG2 + 1] = { NULL };
-
 /* 存储桶描述符结构，32 Bytes */
 struct bucket_desc {
-    struct bucket_desc *next; /* 下一个桶描述符 */
+    struct linked_list_node list; /* 部分空闲桶链表节点，桶满时不在链表中 */
 
-    uint64_t page;    /* 存放块的内存页面 */
-    uint64_t freeidx; /* 本桶中第一个空闲块的索引 */
-    uint64_t refcnt;  /* 已分配块计数 */
+    uint64_t page;      /* 存放块的内存页面 */
+    uint16_t freeidx;   /* 本桶中第一个空闲块的索引 */
+    uint16_t refcnt;    /* 已分配块计数 */
+    uint8_t alloc_size; /* 块大小(指数形式) */
 };
 
+/*
+ * 部分空闲桶目录 [16, 32, 64, 128, 256, 512, 1024, 2048, 4096]
+ *
+ * 只有未满的桶在链表中，分配时取第一个桶即可。桶页面的物理页描述符记录了桶描述符，
+ * 释放时不需要查找。
+ */
+static struct linked_list_node bucket_dir[MAX_ALLOC_SIZE_LOG2 - MIN_ALLOC_SIZE_LOG2 + 1];
+
+/* 桶描述符缓存 */
+static struct kmem_cache *bucket_cache;
+
+/* 保护桶目录、桶描述符缓存和跟踪记录 */
+static struct spinlock kmalloc_lock;
+
+/**
+ * @brief 计算实际分配的块大小
+ *
+ * @param size 申请的内存大小
+ * @return 块大小(指数形式)，size 为 0 或超过一页时返回 0
+ */
+static inline uint8_t alloc_size_of(uint64_t size) {
+    uint8_t alloc_size = q_log2_ceil(size);
+    switch (alloc_size) {
+        case 0 ... (MIN_ALLOC_SIZE_LOG2 - 1):
+            return MIN_ALLOC_SIZE_LOG2;
+        case MIN_ALLOC_SIZE_LOG2 ... MAX_ALLOC_SIZE_LOG2:
+            return alloc_size;
+        default: /* 大于4KB或为0 */
+            return 0;
+    }
+}
+
+/**
+ * @brief 初始化内核内存分配器
+ */
+void kmalloc_init() {
+    for (size_t i = 0; i < MAX_ALLOC_SIZE_LOG2 - MIN_ALLOC_SIZE_LOG2 + 1; i += 1)
+        linked_list_init(&bucket_dir[i]);
+    init_lock(&kmalloc_lock, "kmalloc");
+    bucket_cache = kmem_cache_create("bucket_desc", sizeof(struct bucket_desc), 0, NULL);
+    assert(bucket_cache, "kmalloc_init(): fail to create bucket cache");
+    if (KMALLOC_TRACE)
+        kmalloc_trace_init();
+}
+
 /**
  * @brief 初始化指定的桶页面
  *
@@ -95,64 +125,79 @@ void init_bucket_page(uint64_t page_addr, uint8_t alloc_size) {
 /**
  * @brief 取得空桶
  *
- * 取得空桶，使用了一些奇怪的技巧。
+ * 取得空桶，桶描述符从桶描述符缓存中分配。
+ * 新桶被放入部分空闲桶链表，桶页面的物理页描述符指向桶描述符。
  *
  * @param alloc_size 分配的块大小(指数形式)
- * @return empty_bucket
+ * @return empty_bucket，内存不足时返回 NULL
  */
 struct bucket_desc* take_empty_bucket(uint8_t alloc_size) {
     struct bucket_desc *bucket;
-    uint64_t bucket_page_addr = VIRTUAL(get_free_page());
+    uint64_t bucket_page = get_free_page_nozero();
+    if (!bucket_page) return NULL;
+    uint64_t bucket_page_addr = VIRTUAL(bucket_page);
     init_bucket_page(bucket_page_addr, alloc_size);
-    if (alloc_size == SPECIAL_BUCKET_SIZE_LOG2) {
-        bucket = (struct bucket_desc *) bucket_page_addr;
-        bucket->refcnt = 1;
-        bucket->freeidx = 1;
-    } else {
-        bucket = (struct bucket_desc *) kmalloc_i(sizeof(struct bucket_desc));
-        bucket->refcnt = 0;
-        bucket->freeidx = 0;
+    bucket = (struct bucket_desc *) kmem_cache_alloc_i(bucket_cache);
+    if (!bucket) {
+        free_page(bucket_page);
+        return NULL;
     }
+    bucket->refcnt = 0;
+    bucket->freeidx = 0;
     bucket->page = bucket_page_addr;
-    bucket->next = bucket_dir[alloc_size - MIN_ALLOC_SIZE_LOG2];
-    bucket_dir[alloc_size - MIN_ALLOC_SIZE_LOG2] = bucket;
+    bucket->alloc_size = alloc_size;
+    PAGE_OF(bucket_page)->flags |= PG_bucket;
+    PAGE_OF(bucket_page)->private = bucket;
+    linked_list_unshift(&bucket_dir[alloc_size - MIN_ALLOC_SIZE_LOG2], &bucket->list);
     return bucket;
 }
 
+/**
+ * @brief 申请物理上连续的多页内核内存
+ *
+ * @param size 申请的内存大小(大于PAGE_SIZE)
+ * @return 所申请内存的起始地址，失败时返回NULL
+ */
+static void* kmalloc_large(uint64_t size) {
+    uint8_t order = q_log2_ceil(size) - PAGE_SIZE_LOG2;
+    if (order >= MAX_ORDER) return NULL;
+    uint64_t page = alloc_pages(order);
+    if (!page) return NULL;
+    PAGE_OF(page)->flags |= PG_large;
+    PAGE_OF(page)->order = order;
+    return (void *) VIRTUAL(page);
+}
+
 /**
  * @brief 申请一块内核内存
  *
  * 向内核申请size大小的一块内存，并返回该内存的起始地址；申请失败时返回NULL。
- * 所申请的内存至少为1B, 且不能超过一页大小。实际分配的内存大小为2的幂次。
+ * 所申请的内存至少为1B，实际分配的内存大小为2的幂次。超过一页的内存物理上连续，
+ * 最大为 2^(MAX_ORDER - 1) 页；更大的内存应使用 vmalloc()。
  *
- * @param size 申请的内存大小(最大为PAGE_SIZE)
+ * @param size 申请的内存大小
  * @return 所申请内存的起始地址
  */
 void* kmalloc_i(uint64_t size) {
+    if (size > PAGE_SIZE) return kmalloc_large(size);
     /* 计算实际分配的块大小 */
-    uint8_t alloc_size = q_log2_ceil(size); /* 指数形式 */
-    switch (alloc_size) {
-        case 0 ... (MIN_ALLOC_SIZE_LOG2 - 1):
-            alloc_size = MIN_ALLOC_SIZE_LOG2;
-        case MIN_ALLOC_SIZE_LOG2 ... MAX_ALLOC_SIZE_LOG2:
-            break;
-        default: /* 大于4KB或为0 */
-            return NULL;
-    }
-    /* 找到对应块大小的未满的桶 */
-    struct bucket_desc* bucket = bucket_dir[alloc_size - MIN_ALLOC_SIZE_LOG2];
-    while (bucket) {
-        if (bucket->refcnt >> (PAGE_SIZE_LOG2 - alloc_size)) { /* 桶已满 */
-            bucket = bucket->next;
-            continue;
-        }
-        break;
+    uint8_t alloc_size = alloc_size_of(size); /* 指数形式 */
+    if (!alloc_size) return NULL;
+    /* 取对应块大小的第一个未满的桶 */
+    struct linked_list_node *head = &bucket_dir[alloc_size - MIN_ALLOC_SIZE_LOG2];
+    struct bucket_desc* bucket;
+    if (linked_list_empty(head)) {
+        bucket = take_empty_bucket(alloc_size);
+        if (!bucket) return NULL;
+    } else {
+        bucket = container_of(linked_list_first(head), struct bucket_desc, list);
     }
-    if (!bucket) bucket = take_empty_bucket(alloc_size);
     /* 从桶中获取一个空闲块 */
     bucket->refcnt += 1;
-    uint64_t free_block = bucket->page + (bucket->freeidx << alloc_size);
+    uint64_t free_block = bucket->page + ((uint64_t)bucket->freeidx << alloc_size);
     bucket->freeidx = *((uint8_t *) free_block);
+    if (bucket->refcnt >> (PAGE_SIZE_LOG2 - alloc_size)) /* 桶已满 */
+        linked_list_remove(&bucket->list);
     return (void *) free_block;
 }
 
@@ -160,64 +205,126 @@ void* kmalloc_i(uint64_t size) {
  * @brief 释放一块已申请内核内存
  *
  * 释放之前申请的size大小的一块内存，并返回该内存的起始地址；释放失败时返回0，
- * 释放成功时返回参数size的值。
+ * 释放成功时返回实际释放的块大小。块所在的桶由桶页面的物理页描述符直接得到。
  *
  * @param ptr 待释放的内存地址
- * @param size 申请的内存大小(为0时自动推算)
+ * @param size 申请的内存大小(为0时不检查)
  * @return 释放的内存大小，若为0则表示释放失败
  */
 uint64_t kfree_s_i(void* ptr, uint64_t size) {
     uint64_t addr = (uint64_t) ptr;
-    /* 推算分配的块大小范围 */
-    uint8_t alloc_size_start = MIN_ALLOC_SIZE_LOG2;
-    uint8_t alloc_size_end = MAX_ALLOC_SIZE_LOG2;
-    if (size) {
-        uint8_t alloc_size = q_log2_ceil(size);
-        switch (alloc_size) {
-            case 0 ... (MIN_ALLOC_SIZE_LOG2 - 1):
-                alloc_size = MIN_ALLOC_SIZE_LOG2;
-            case MIN_ALLOC_SIZE_LOG2 ... MAX_ALLOC_SIZE_LOG2:
-                alloc_size_start = alloc_size_end = alloc_size;
-                break;
-            default: /* 大于4KB */
-                return 0;
-        }
-    } else {
-        uint8_t aligned_size = q_pow2_factor(addr);
-        if (aligned_size < MIN_ALLOC_SIZE_LOG2) return 0;
-        if (aligned_size < MAX_ALLOC_SIZE_LOG2) alloc_size_end = aligned_size;
-    }
+    if (addr < VIRTUAL(LOW_MEM) || addr >= VIRTUAL(HIGH_MEM)) return 0;
     /* 找到该块所在的桶 */
-    struct bucket_desc* bucket, *prev_bucket;
     uint64_t page_addr = (addr >> PAGE_SIZE_LOG2) << PAGE_SIZE_LOG2;
-    uint8_t guess_alloc_size = alloc_size_start;
-    while (guess_alloc_size <= alloc_size_end) {
-        bucket = bucket_dir[guess_alloc_size - MIN_ALLOC_SIZE_LOG2];
-        prev_bucket = NULL;
-        while (bucket) {
-            if (bucket->page == page_addr) break;
-            prev_bucket = bucket;
-            bucket = bucket->next;
-        }
-        if (bucket) break;
-        guess_alloc_size += 1;
+    struct page *page = PAGE_OF(PHYSICAL(page_addr));
+    if (page->flags & PG_large) {
+        uint8_t order = page->order;
+        if (addr != page_addr) return 0;
+        if (size && (size <= PAGE_SIZE || q_log2_ceil(size) - PAGE_SIZE_LOG2 != order)) return 0;
+        page->flags &= ~PG_large;
+        free_pages(PHYSICAL(page_addr), order);
+        return (uint64_t) PAGE_SIZE << order;
     }
-    if(!bucket) return 0;
+    if (!(page->flags & PG_bucket)) return 0;
+    struct bucket_desc *bucket = page->private;
+    uint8_t alloc_size = bucket->alloc_size;
+    if (size && alloc_size_of(size) != alloc_size) return 0;
+    if (addr & ((1UL << alloc_size) - 1)) return 0;
+    /* 满桶重新放回部分空闲桶链表 */
+    if (bucket->refcnt >> (PAGE_SIZE_LOG2 - alloc_size))
+        linked_list_unshift(&bucket_dir[alloc_size - MIN_ALLOC_SIZE_LOG2], &bucket->list);
     /* 将该块放回桶中 */
     bucket->refcnt -= 1;
-    if(bucket->refcnt > 1 || (bucket->refcnt == 1 && (uint64_t) bucket != page_addr)) {
+    if(bucket->refcnt) {
         *((uint8_t *) ptr) = bucket->freeidx;
-        bucket->freeidx = (addr - page_addr) >> guess_alloc_size;
+        bucket->freeidx = (addr - page_addr) >> alloc_size;
     } else { /* 空桶 */
-        if (prev_bucket) {
-            prev_bucket->next = bucket->next;
-        } else {
-            bucket_dir[guess_alloc_size - MIN_ALLOC_SIZE_LOG2] = bucket->next;
-        }
+        linked_list_remove(&bucket->list);
+        page->flags &= ~PG_bucket;
+        page->private = NULL;
         free_page(PHYSICAL(page_addr));
-        if ((uint64_t) bucket != page_addr) kfree_s_i(bucket, sizeof(struct bucket_desc));
+        kmem_cache_free_i(bucket_cache, bucket);
     }
-    return 1 << guess_alloc_size;
+    return 1 << alloc_size;
+}
+
+/* slab 测试对象的构造函数 */
+static void slab_test_ctor(void *obj) {
+    *(uint64_t *)obj = 0x5A5A5A5A;
+}
+
+/**
+ * @brief 申请一块内核内存（关中断并持有 kmalloc_lock）
+ *
+ * 不是内联函数，以便跟踪模式下记录调用点（返回地址）。
+ *
+ * @see kmalloc_i()
+ */
+void* kmalloc(uint64_t size) {
+    uint64_t flags = acquire_lock_irqsave(&kmalloc_lock);
+    void *ptr = kmalloc_i(size);
+    if (KMALLOC_TRACE && ptr) {
+        uint64_t real_size = size > PAGE_SIZE ? 1UL << q_log2_ceil(size) : 1UL << alloc_size_of(size);
+        kmalloc_trace_alloc(ptr, size, real_size, (uint64_t) __builtin_return_address(0));
+    }
+    release_lock_irqrestore(&kmalloc_lock, flags);
+    return ptr;
+}
+
+/**
+ * @brief 释放一块已申请内核内存（关中断并持有 kmalloc_lock）
+ *
+ * 跟踪模式下拒绝释放未分配的地址（如重复释放），并报告与申请大小不一致的 size。
+ *
+ * @see kfree_s_i()
+ */
+uint64_t kfree_s(void* obj, uint64_t size) {
+    if (!obj) return 0;
+    uint64_t flags = acquire_lock_irqsave(&kmalloc_lock);
+    uint64_t real_size = 0;
+    if (!KMALLOC_TRACE ||
+        !kmalloc_trace_check_free(obj, size, (uint64_t) __builtin_return_address(0))) {
+        real_size = kfree_s_i(obj, size);
+        if (KMALLOC_TRACE && real_size)
+            kmalloc_trace_free(obj, real_size);
+    }
+    release_lock_irqrestore(&kmalloc_lock, flags);
+    return real_size;
+}
+
+/**
+ * @brief 打印各调用点的统计信息（关中断并持有 kmalloc_lock）
+ *
+ * @see kmalloc_trace_show()
+ */
+void kmalloc_show_trace() {
+    uint64_t flags = acquire_lock_irqsave(&kmalloc_lock);
+    kmalloc_trace_show();
+    release_lock_irqrestore(&kmalloc_lock, flags);
+}
+
+/**
+ * @brief 设置泄漏检查点（关中断并持有 kmalloc_lock）
+ *
+ * @see kmalloc_trace_mark()
+ */
+void kmalloc_mark_trace() {
+    uint64_t flags = acquire_lock_irqsave(&kmalloc_lock);
+    kmalloc_trace_mark();
+    release_lock_irqrestore(&kmalloc_lock, flags);
+}
+
+/**
+ * @brief 列出检查点之后分配、仍未释放的对象（关中断并持有 kmalloc_lock）
+ *
+ * @return 这样的对象数
+ * @see kmalloc_trace_leaks()
+ */
+uint64_t kmalloc_find_leaks() {
+    uint64_t flags = acquire_lock_irqsave(&kmalloc_lock);
+    uint64_t nr = kmalloc_trace_leaks();
+    release_lock_irqrestore(&kmalloc_lock, flags);
+    return nr;
 }
 
 /**
@@ -251,5 +358,46 @@ void malloc_test() {
             kfree(ptr_list[((j * 0x10001 + 73) % 1031) + 83]);
         }
     }
+    /* slab test: objects keep their constructed state across free */
+    struct kmem_cache *cache = kmem_cache_create("slab_test", 24, 0, slab_test_ctor);
+    uint64_t *obj_list[400];
+    for (int j = 0; j < 400; j++) {
+        obj_list[j] = kmem_cache_alloc(cache);
+        assert(obj_list[j] && !((uint64_t)obj_list[j] & 7) && *obj_list[j] == 0x5A5A5A5A);
+    }
+    for (int j = 0; j < 400; j++) {
+        kmem_cache_free(cache, obj_list[(j * 0x10001 + 73) % 400]);
+    }
+    for (int j = 0; j < 400; j++) {
+        obj_list[j] = kmem_cache_alloc(cache);
+        assert(*obj_list[j] == 0x5A5A5A5A);
+    }
+    for (int j = 0; j < 400; j++) {
+        kmem_cache_free(cache, obj_list[j]);
+    }
+    /* multi-page kmalloc test */
+    uint64_t free_pages_before = nr_free_pages();
+    for (int order = 1; order < MAX_ORDER; order++) {
+        uint8_t *large = kmalloc((PAGE_SIZE << (order - 1)) + 1);
+        assert(large && !((uint64_t)large & ((PAGE_SIZE << order) - 1)));
+        large[(PAGE_SIZE << order) - 1] = 0;
+        assert(kfree(large) == PAGE_SIZE << order);
+    }
+    assert(!kmalloc(PAGE_SIZE << MAX_ORDER));
+    assert(nr_free_pages() == free_pages_before);
+    /* kmalloc trace test: double free is refused */
+    if (KMALLOC_TRACE) {
+        void *trace_ptr = kmalloc(64);
+        assert(kfree(trace_ptr) == 64);
+        assert(kfree(trace_ptr) == 0);
+    }
+    /* vmalloc test */
+    uint64_t *vm_a = vmalloc(3 * PAGE_SIZE + 1);
+    uint64_t *vm_b = vmalloc(PAGE_SIZE);
+    assert(vm_a && vm_b && (uint64_t)vm_b >= (uint64_t)vm_a + 5 * PAGE_SIZE);
+    for (int j = 0; j < 4 * PAGE_SIZE / 8; j++) vm_a[j] = j;
+    for (int j = 0; j < 4 * PAGE_SIZE / 8; j++) assert(vm_a[j] == j);
+    vfree(vm_a);
+    vfree(vm_b);
     kputs("malloc_test(): Passed");
 }
@@ -6,36 +6,274 @@
  * 本模块注释中专门写了函数参数是物理地址还是虚拟地址，如果没有写，默认是虚拟地址。
  */
 #include <assert.h>
+#include <errno.h>
 #include <kdebug.h>
 #include <mm.h>
 #include <stddef.h>
+#include <device/fdt.h>
+#include <utils/atomic.h>
 
-/** 内核页目录（定义在 entry.s 中）*/
-extern uint64_t boot_pg_dir[512];
+/**
+ * 内核页目录（进程 0 的页目录）
+ *
+ * 内核地址空间的页目录项指向所有进程共享的下级页表，创建进程时只拷贝页目录项。
+ * 因此内核地址空间的页目录项在启动后不能再修改，需要动态映射的区域（设备内存映射区）
+ * 的二级页表在 map_kernel() 中预先分配。
+ */
+uint64_t *kernel_pg_dir;
+
+/**
+ * 零页
+ *
+ * 匿名页第一次被读时映射到零页（只读），被写时才分配物理页。
+ * 零页位于内核 bss 段，物理地址低于 LOW_MEM，不参与引用计数。
+ */
+static unsigned char empty_zero_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+#define ZERO_PAGE PHYSICAL((uint64_t)empty_zero_page) /**< 零页物理地址 */
+
+/**
+ * 共享三级页表的锁
+ *
+ * fork() 后共享同一个三级页表的进程可能在不同处理器上同时拷贝、写保护或释放它。
+ * 检查引用计数、读写页表项和减少引用计数都在锁内进行，引用计数降为 0 的一方负责释放。
+ * 引用计数为 1 的三级页表只属于当前进程，不需要加锁。
+ */
+static struct spinlock pg_tb2_lock;
+
+/** 物理内存结束地址 */
+uint64_t mem_end = MEM_START + DEFAULT_MEMORY;
+
+/** 空闲内存区开始地址，之前是 SBI、内核和启动阶段分配的数据 */
+uint64_t low_mem;
+
+/** 物理页描述符数组，跟踪系统的全部内存，由启动分配器分配 */
+struct page *mem_map = NULL;
+
+/** 启动分配器下一个可用的物理地址，为 0 表示启动分配器已关闭 */
+static uint64_t bootmem_ptr;
+
+/** 设备树占用的物理内存 [fdt_start, fdt_end)，启动分配器和伙伴系统都要避开 */
+static uint64_t fdt_start, fdt_end;
+
+/**
+ * @brief 启动分配器
+ *
+ * 伙伴系统建立之前，mem_map[] 等大小依赖物理内存大小的数据结构
+ * 由本函数从内核之后的物理内存中顺序分配。分配的内存被清零且永不释放。
+ *
+ * @param size 字节数
+ * @return 线性映射虚拟地址，按页对齐
+ */
+void *bootmem_alloc(uint64_t size)
+{
+    assert(bootmem_ptr, "bootmem_alloc(): boot allocator is closed");
+    uint64_t start = bootmem_ptr;
+    if (start < fdt_end && start + size > fdt_start)
+        start = fdt_end;
+    uint64_t end = CEIL(start + size);
+    assert(end <= HIGH_MEM, "bootmem_alloc(): memory exhausts");
+    bootmem_ptr = end;
+    memset((void *)VIRTUAL(start), 0, end - start);
+    return (void *)VIRTUAL(start);
+}
+
+/**
+ * @brief 从设备树 /memory 节点读取物理内存大小
+ *
+ * 读取失败时保持默认值 DEFAULT_MEMORY。
+ *
+ * @param fdt 设备树物理地址
+ */
+static void mem_detect(const struct fdt_header *fdt)
+{
+    if (!fdt) {
+        kputs("mem_init(): fdt pointer is NULL");
+        return;
+    }
+    /* 启动页表已经线性映射了全部可能的物理内存 */
+    fdt = (const struct fdt_header *)VIRTUAL((uint64_t)fdt);
+    if (fdt->magic != FDT_MAGIC) {
+        kputs("mem_init(): bad fdt magic");
+        return;
+    }
+    fdt_start = FLOOR(PHYSICAL((uint64_t)fdt));
+    fdt_end = CEIL(PHYSICAL((uint64_t)fdt) + fdt32_to_cpu(fdt->totalsize));
 
-/** 当前进程的页目录 */
-uint64_t *pg_dir = boot_pg_dir;
+    struct fdt_node_header *root = fdt_find_node_by_path(fdt, "/");
+    struct fdt_property *prop;
+    uint32_t address_cells = 2, size_cells = 1;
+    if ((prop = fdt_get_prop(fdt, root, "#address-cells")))
+        address_cells = fdt_get_prop_num_value(prop, 0);
+    if ((prop = fdt_get_prop(fdt, root, "#size-cells")))
+        size_cells = fdt_get_prop_num_value(prop, 0);
+
+    struct fdt_node_header *memory = fdt_find_node_by_path(fdt, "/memory");
+    if (!memory || !(prop = fdt_get_prop(fdt, memory, "reg"))) {
+        kputs("mem_init(): /memory not found");
+        return;
+    }
+    uint64_t base = fdt_get_prop_cells_value(prop, 0, address_cells);
+    uint64_t size = fdt_get_prop_cells_value(prop, address_cells, size_cells);
+    assert(base == MEM_START, "mem_init(): memory starts at %p", base);
+    if (size > MAX_PAGING_MEMORY) {
+        kprintf("mem_init(): only %u MiB of memory can be used\n",
+                (uint64_t)MAX_PAGING_MEMORY >> 20);
+        size = MAX_PAGING_MEMORY;
+    }
+    mem_end = FLOOR(base + size);
+}
+
+/**
+ * @brief 释放引用计数已降为 0 的三级页表及其映射的物理页
+ *
+ * @param table 三级页表的物理地址
+ */
+static void release_pg_tb2(uint64_t table)
+{
+    uint64_t *pte = (uint64_t *)VIRTUAL(table);
+    for (size_t i = 0; i < 512; ++i) {
+        if (pte[i])
+            free_page(GET_PAGE_ADDR(pte[i]));
+    }
+    __free_page(table);
+}
+
+/**
+ * @brief 减少共享的三级页表的引用，最后一个引用者释放页表和页表映射的物理页
+ *
+ * 调用者已经清除了指向页表的二级页表项并刷新了 TLB。
+ *
+ * @param table 三级页表的物理地址
+ * @see tlb_gather_shared_table()
+ */
+void put_pg_tb2(uint64_t table)
+{
+    uint64_t flags = acquire_lock_irqsave(&pg_tb2_lock);
+    int last = page_ref_dec_and_test(PAGE_OF(table));
+    release_lock_irqrestore(&pg_tb2_lock, flags);
+    if (last)
+        release_pg_tb2(table);
+}
+
+/**
+ * @brief 使三级页表为当前进程私有
+ *
+ * fork() 后父子进程共享三级页表（页表所在物理页的引用计数大于 1），修改其中的页表项之前
+ * 必须拷贝一份私有的三级页表。拷贝后页表映射的每个物理页多了一个引用。
+ *
+ * @param pte1 指向三级页表的二级页表项（线性映射虚拟地址）
+ * @param addr 三级页表映射的任一虚拟地址，用于刷新 TLB
+ */
+static void unshare_pg_tb2(uint64_t *pte1, uint64_t addr)
+{
+    uint64_t old_table = GET_PAGE_ADDR(*pte1);
+    if (page_count(PAGE_OF(old_table)) == 1)
+        return;
+    uint64_t new_table = get_free_page_nozero();
+    assert(new_table, "unshare_pg_tb2(): Memory exhausts");
+    uint64_t flags = acquire_lock_irqsave(&pg_tb2_lock);
+    /* 其他进程可能已经释放了页表 */
+    if (page_count(PAGE_OF(old_table)) == 1) {
+        release_lock_irqrestore(&pg_tb2_lock, flags);
+        free_page(new_table);
+        return;
+    }
+    uint64_t *from = (uint64_t *)VIRTUAL(old_table);
+    uint64_t *to = (uint64_t *)VIRTUAL(new_table);
+    for (size_t i = 0; i < 512; ++i) {
+        to[i] = from[i];
+        /* 内核镜像中的页（如零页）不参与引用计数 */
+        if (from[i] && GET_PAGE_ADDR(from[i]) >= LOW_MEM)
+            page_ref_inc(PAGE_OF(GET_PAGE_ADDR(from[i])));
+    }
+    int last = page_ref_dec_and_test(PAGE_OF(old_table));
+    release_lock_irqrestore(&pg_tb2_lock, flags);
+    if (last)
+        release_pg_tb2(old_table);
+    *pte1 = (new_table >> 2) | GET_FLAG(*pte1);
+    addr &= ~(uint64_t)(MEGA_PAGE_SIZE - 1);
+    flush_tlb_range(addr, addr + MEGA_PAGE_SIZE);
+}
 
-/** 内存页表，跟踪系统的全部内存 */
-unsigned char mem_map[PAGING_PAGES] = { 0 };
+/**
+ * @brief 在第 level 级页表中建立叶子页表项
+ *
+ * level 为 0、1、2 时分别映射 1G、2M、4K 的页，缺少的中间页表会被创建。
+ * 当分配物理页失败（创建页表）时 panic。
+ *
+ * @param page 物理地址
+ * @param addr 虚拟地址
+ * @param level 叶子页表项所在的页表级数
+ * @param flag 标志位
+ * @note 地址需要按对应的页大小对齐
+ */
+static void set_leaf(uint64_t page, uint64_t addr, size_t level, uint16_t flag)
+{
+    uint64_t vpns[3] = { GET_VPN1(addr), GET_VPN2(addr), GET_VPN3(addr) };
+    uint64_t *page_table = current_pg_dir;
+    for (size_t i = 0; i < level; ++i) {
+        uint64_t idx = vpns[i];
+        if (!(page_table[idx] & PAGE_VALID)) {
+            /* 内核页目录项被所有进程共享，只能在启动时创建 */
+            assert(i > 0 || IS_USER(addr, addr + 1) || current_pg_dir == kernel_pg_dir,
+                   "put_page(): kernel page directory entry of %p is missing", addr);
+            uint64_t tmp;
+            assert(tmp = get_free_page(),
+                   "put_page(): Memory exhausts");
+            page_table[idx] = (tmp >> 2) | PAGE_VALID;
+        }
+        assert(!IS_LEAF(page_table[idx]),
+               "put_page(): %p is already mapped by a huge page", addr);
+        /* 用户地址空间的三级页表可能被共享 */
+        if (i == 1 && IS_USER(addr, addr + 1))
+            unshare_pg_tb2(&page_table[idx], addr);
+        page_table =
+            (uint64_t *)VIRTUAL(GET_PAGE_ADDR(page_table[idx]));
+    }
+    /* 用大页覆盖下级页表会泄漏页表 */
+    assert(level == 2 || !(page_table[vpns[level]] & PAGE_VALID) ||
+               IS_LEAF(page_table[vpns[level]]),
+           "map_range(): %p is already mapped by a page table", addr);
+    page_table[vpns[level]] = (page >> 2) | flag;
+}
 
 /**
- * @brief 将物理地址区域映射到虚拟地址区域
+ * @brief 将物理地址区域映射到虚拟地址区域，自动使用大页
+ *
+ * 每次选取物理地址和虚拟地址都已对齐、且不超过剩余长度的最大页（1G、2M 或 4K）。
+ * 因此物理地址和虚拟地址相对 2M（1G）边界的偏移相同时才能使用大页。
+ * 页目录项已经指向二级页表时不使用 1G 大页。
  *
- * @param paddr_start 起始物理地址
- * @param paddr_end 结束物理地址
+ * @param paddr 起始物理地址
  * @param vaddr 起始虚拟地址
+ * @param size 字节数
  * @param flag PTE 标志位
  * @note
- *      - 地址必须按页对齐
+ *      - 地址和长度必须按页对齐
  *      - 仅建立映射，不修改物理页引用计数
+ *      - 仅用于内核地址空间，用户地址空间的页表操作函数只处理 4K 页
  */
-static inline void map_pages(uint64_t paddr_start, uint64_t paddr_end, uint64_t vaddr, uint16_t flag)
+void map_range(uint64_t paddr, uint64_t vaddr, uint64_t size, uint16_t flag)
 {
-    while (paddr_start < paddr_end) {
-        put_page(paddr_start, vaddr, flag);
-        paddr_start += PAGE_SIZE;
-        vaddr += PAGE_SIZE;
+    assert(!((paddr | vaddr | size) & (PAGE_SIZE - 1)),
+           "map_range(): Try to map unaligned range %p to %p", paddr, vaddr);
+    while (size) {
+        size_t level = 2;
+        uint64_t step = PAGE_SIZE;
+        uint64_t dir = current_pg_dir[GET_VPN1(vaddr)];
+        /* 页目录项已经指向二级页表时（如预先分配的设备映射区）改用 2M 大页 */
+        if (!((paddr | vaddr) & (GIGA_PAGE_SIZE - 1)) && size >= GIGA_PAGE_SIZE &&
+            (!(dir & PAGE_VALID) || IS_LEAF(dir))) {
+            level = 0;
+            step = GIGA_PAGE_SIZE;
+        } else if (!((paddr | vaddr) & (MEGA_PAGE_SIZE - 1)) && size >= MEGA_PAGE_SIZE) {
+            level = 1;
+            step = MEGA_PAGE_SIZE;
+        }
+        set_leaf(paddr, vaddr, level, flag);
+        paddr += step;
+        vaddr += step;
+        size -= step;
     }
 }
 
@@ -45,16 +283,44 @@ static inline void map_pages(uint64_t paddr_start, uint64_t paddr_end, uint64_t
  * 所有进程发生系统调用、中断、异常后都会进入到内核态，因此所有进程的虚拟地址空间
  * 都要包含内核的部分。
  *
- * 本函数仅创建映射，不会修改 mem_map[] 引用计数
+ * 线性映射区尽量使用 1G/2M 大页，以减少页表占用的内存和 TLB 缺失。
+ * 内核映射在所有地址空间中都相同，因此设置 Global 位，切换 ASID 后仍保留在 TLB 中。
+ *
+ * 本函数仅创建映射，不会修改物理页引用计数
  */
 void map_kernel()
 {
-    // map_pages(DEVICE_START, DEVICE_END, DEVICE_ADDRESS, KERN_RW | PAGE_VALID);
-    map_pages(MEM_START, MEM_END, KERNEL_ADDRESS, KERN_RWX | PAGE_VALID);
+    map_range(MEM_START, KERNEL_ADDRESS, PAGING_MEMORY, KERN_RWX | PAGE_GLOBAL | PAGE_VALID);
+    /* 预先分配 vmalloc 映射区和设备内存映射区的二级页表，此后在其中建立映射不会修改页目录 */
+    for (size_t i = GET_VPN1(VMALLOC_START); i <= GET_VPN1(KERNEL_END - 1); ++i) {
+        if (current_pg_dir[i])
+            continue;
+        uint64_t tmp;
+        assert(tmp = get_free_page(), "map_kernel(): Memory exhausts");
+        current_pg_dir[i] = (tmp >> 2) | PAGE_VALID;
+    }
+}
+
+/**
+ * @brief 在新进程的页目录中安装内核映射
+ *
+ * 内核映射对所有进程都相同，内核地址空间的页目录项指向共享的下级页表（或 1G 大页），
+ * 只需拷贝页目录项，不需要分配页表或逐项拷贝。
+ *
+ * @param to_pg_dir 新进程页目录 **线性映射虚拟地址**
+ * @see map_kernel(), copy_mem()
+ */
+void share_kernel_pg_dir(uint64_t *to_pg_dir)
+{
+    for (size_t i = GET_VPN1(KERNEL_ADDRESS); i <= GET_VPN1(KERNEL_END - 1); ++i)
+        to_pg_dir[i] = kernel_pg_dir[i];
 }
 
 /**
  * @brief 激活当前进程页表
+ *
+ * 使用保留的 ASID 0 并刷新整个 TLB，仅在启动阶段使用，进程切换使用 switch_mm()。
+ *
  * @note 置位 status 寄存器 SUM 标志位，允许内核读写用户态内存
  */
 void active_mapping()
@@ -64,36 +330,67 @@ void active_mapping()
                  "sfence.vma\n\t"
                  : /* empty output list */
                  : "r"(1 << 18),
-                   "r"((PHYSICAL((uint64_t)pg_dir) >> 12) |
-                   ((uint64_t)8 << 60)));
+                   "r"((PHYSICAL((uint64_t)current_pg_dir) >> 12) |
+                   SATP_MODE_SV39));
 }
 
 /**
  * @brief 初始化内存管理模块
  *
+ * - 从设备树 /memory 节点读取物理内存大小
+ * - 由启动分配器分配物理页描述符数组 mem_map[]
  * - 初始化 mem_map[] 数组，将物理地址空间 [MEM_START, HIGH_MEM) 纳入到
- * 内核的管理中。SBI 和内核部分被设置为`USED`，其余内存被设置为`UNUSED`
+ * 内核的管理中。SBI、内核、启动阶段分配的数据和设备树被标记为`PG_reserved`，其余内存空闲
+ * - 将空闲内存 [LOW_MEM, HIGH_MEM) 交给伙伴系统管理
  * - 初始化页表。
  * - 开启分页
+ *
+ * @param fdt 设备树物理地址
  */
-void mem_init()
+void mem_init(const struct fdt_header *fdt)
 {
     memset(bss_start, 0, kernel_end - bss_start);
-    size_t i = MAP_NR(HIGH_MEM);
-    /** 设用户内存空间[LOW_MEM, HIGH_MEM)为可用 */
-    while (i > MAP_NR(LOW_MEM))
-        mem_map[--i] = UNUSED;
+    init_lock(&pg_tb2_lock, "pg_tb2");
+    mem_detect(fdt);
+    if (fdt_end > HIGH_MEM)
+        fdt_end = HIGH_MEM;
+
+    bootmem_ptr = PHYSICAL((uint64_t)kernel_end);
+    mem_map = bootmem_alloc(PAGING_PAGES * sizeof(struct page));
+    buddy_init();
+    low_mem = bootmem_ptr;
+    bootmem_ptr = 0;
+
+    /** 设用户内存空间[LOW_MEM, HIGH_MEM)为可用（mem_map[] 已被清零） */
     /** 设SBI与内核内存空间[MEM_START, LOW_MEM)的内存空间为不可用 */
-    while (i > MAP_NR(MEM_START))
-        mem_map[--i] = USED;
+    for (size_t i = MAP_NR(MEM_START); i < MAP_NR(LOW_MEM); ++i) {
+        set_page_count(&mem_map[i], 1);
+        mem_map[i].flags = PG_reserved;
+    }
+    /** 设备树所在内存不可用 */
+    for (size_t i = MAP_NR(fdt_start); i < MAP_NR(fdt_end); ++i) {
+        set_page_count(&mem_map[i], 1);
+        mem_map[i].flags = PG_reserved;
+    }
+    if (fdt_end <= LOW_MEM || fdt_start >= HIGH_MEM) {
+        buddy_add_range(LOW_MEM, HIGH_MEM);
+    } else {
+        buddy_add_range(LOW_MEM, fdt_start);
+        buddy_add_range(fdt_end, HIGH_MEM);
+    }
+    kprintf("mem_init(): memory [%p, %p), free memory starts at %p\n",
+            (uint64_t)MEM_START, HIGH_MEM, LOW_MEM);
 
     /* 进入 main() 时开启了 RV39 大页模式，暂时创造一个虚拟地址到物理地址的映射让程序跑起来。
      * 现在，我们要新建一个页目录并开启页大小为 4K 的 RV39 分页。*/
     uint64_t page = get_free_page();
     assert(page, "mem_init(): fail to allocate page");
-    pg_dir = (uint64_t *)VIRTUAL(page);
+    current_pg_dir = kernel_pg_dir = (uint64_t *)VIRTUAL(page);
     map_kernel();
     active_mapping();
+    asid_init();
+    kmalloc_init();
+    vmalloc_init();
 }
 
 /**
@@ -122,29 +419,97 @@ void free_page(uint64_t addr)
         return;
     if (addr >= HIGH_MEM)
         panic("free_page(): trying to free nonexistent page");
-    assert(mem_map[MAP_NR(addr)] != 0,
+    struct page *page = PAGE_OF(addr);
+    assert(!(page->flags & PG_reserved),
+           "free_page(): trying to free reserved page %p", addr);
+    assert(page_count(page) != 0,
            "free_page(): trying to free free page");
-    --mem_map[MAP_NR(addr)];
+    if (page_ref_dec_and_test(page))
+        __free_page(addr);
+}
+
+/**
+ * 预清零页池
+ *
+ * 进程 0 空闲时调用 zero_pool_refill() 向池中补充已清零的物理页，
+ * get_free_page() 优先从池中取页，避免在关键路径上清零整页。
+ * 池中的页引用计数为 1，不在伙伴系统中。池由 zero_pool_lock 保护，清零在锁外进行。
+ */
+static uint64_t zero_pool[ZERO_POOL_SIZE];
+static size_t zero_pool_nr = 0;
+static struct spinlock zero_pool_lock;
+uint64_t zero_pool_hits = 0;    /**< get_free_page() 从池中取到页的次数 */
+uint64_t zero_pool_misses = 0;  /**< get_free_page() 池为空、需要现场清零的次数 */
+
+/**
+ * @brief 向预清零页池补充一页
+ *
+ * 由进程 0 在空闲时（系统调用`idle()`）调用
+ *
+ * @return 补充了一页返回 1，池已满或内存耗尽返回 0
+ */
+int zero_pool_refill()
+{
+    if (zero_pool_nr == ZERO_POOL_SIZE)
+        return 0;
+    uint64_t page = alloc_pages(0);
+    if (!page)
+        return 0;
+    memset((void *)VIRTUAL(page), 0, PAGE_SIZE);
+    uint64_t flags = acquire_lock_irqsave(&zero_pool_lock);
+    int added = zero_pool_nr < ZERO_POOL_SIZE;
+    if (added)
+        zero_pool[zero_pool_nr++] = page;
+    release_lock_irqrestore(&zero_pool_lock, flags);
+    if (!added)
+        free_page(page);
+    return added;
+}
+
+/**
+ * @brief 获取未清零的空物理页
+ *
+ * 适用于调用者会覆盖整页内容的场合（如写时复制的 copy_page()）。
+ *
+ * @return 成功则物理页的物理地址,失败返回 0
+ */
+uint64_t get_free_page_nozero(void)
+{
+    uint64_t ret = alloc_pages(0);
+    if (!ret) {
+        uint64_t flags = acquire_lock_irqsave(&zero_pool_lock);
+        if (zero_pool_nr)
+            ret = zero_pool[--zero_pool_nr];
+        release_lock_irqrestore(&zero_pool_lock, flags);
+    }
+    return ret;
 }
 
 /**
  * @brief 获取空物理页
  *
+ * 优先从预清零页池取页，池为空时从伙伴系统分配一页并清零。
+ *
  * @return 成功则物理页的物理地址,失败返回 0
+ * @see alloc_pages(), zero_pool_refill()
  */
 uint64_t get_free_page(void)
 {
-    /* fix warrning !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!*/
-    size_t i = MAP_NR(HIGH_MEM) - 1;
-    for (; i >= MAP_NR(LOW_MEM); --i) {
-        if (mem_map[i] == 0) {
-            mem_map[i] = 1;
-            uint64_t ret = MEM_START + i * PAGE_SIZE;
-            memset((void *)VIRTUAL(ret), 0, PAGE_SIZE);
-            return ret;
-        }
+    uint64_t ret = 0;
+    uint64_t flags = acquire_lock_irqsave(&zero_pool_lock);
+    if (zero_pool_nr) {
+        ++zero_pool_hits;
+        ret = zero_pool[--zero_pool_nr];
+    } else {
+        ++zero_pool_misses;
     }
-    return 0;
+    release_lock_irqrestore(&zero_pool_lock, flags);
+    if (ret)
+        return ret;
+    ret = alloc_pages(0);
+    if (ret)
+        memset((void *)VIRTUAL(ret), 0, PAGE_SIZE);
+    return ret;
 }
 
 /**
@@ -164,20 +529,7 @@ uint64_t put_page(uint64_t page, uint64_t addr, uint16_t flag)
 {
     assert((page & (PAGE_SIZE - 1)) == 0,
            "put_page(): Try to put unaligned page %p to %p", page, addr);
-    uint64_t vpns[3] = { GET_VPN1(addr), GET_VPN2(addr), GET_VPN3(addr) };
-    uint64_t *page_table = pg_dir;
-    for (size_t level = 0; level < 2; ++level) {
-        uint64_t idx = vpns[level];
-        if (!(page_table[idx] & PAGE_VALID)) {
-            uint64_t tmp;
-            assert(tmp = get_free_page(),
-                   "put_page(): Memory exhausts");
-            page_table[idx] = (tmp >> 2) | PAGE_VALID;
-        }
-        page_table =
-            (uint64_t *)VIRTUAL(GET_PAGE_ADDR(page_table[idx]));
-    }
-    page_table[vpns[2]] = (page >> 2) | flag;
+    set_leaf(page, addr, 2, flag);
     return page;
 }
 
@@ -195,77 +547,115 @@ void get_empty_page(uint64_t addr, uint16_t flag)
     put_page(tmp, addr, flag | PAGE_VALID);
 }
 
+/**
+ * @brief 释放二级页表 pg_tb1 中虚拟地址区间 [from, end) 的映射
+ *
+ * 区间不超过二级页表映射的 1G 地址空间。被完全覆盖或者清除映射后变空的三级页表会被释放。
+ *
+ * @param tlb 刷新记录
+ * @param pg_tb1 二级页表（线性映射虚拟地址）
+ * @param from 起始虚拟地址
+ * @param end 结束虚拟地址
+ * @param is_user_space 是否是用户地址空间（用户地址空间同时释放映射的物理页）
+ */
+static void free_pg_tb1(struct mmu_gather *tlb, uint64_t *pg_tb1,
+                        uint64_t from, uint64_t end, int is_user_space)
+{
+    while (from < end) {
+        uint64_t base = from & ~(uint64_t)(MEGA_PAGE_SIZE - 1);
+        uint64_t next = base + MEGA_PAGE_SIZE < end ? base + MEGA_PAGE_SIZE : end;
+        uint64_t *pte = &pg_tb1[GET_VPN2(from)];
+        if (!*pte) {
+            from = next;
+            continue;
+        }
+        /* 内核 2M 大页：仅清除页表项 */
+        if (IS_LEAF(*pte)) {
+            assert(!is_user_space && from == base && next == base + MEGA_PAGE_SIZE,
+                   "free_page_tables(): can't free part of huge page %p",
+                   GET_PAGE_ADDR(*pte));
+            *pte = 0;
+            from = next;
+            continue;
+        }
+        if (is_user_space && page_count(PAGE_OF(GET_PAGE_ADDR(*pte))) > 1) {
+            /* 共享的三级页表：整个被释放时在刷新 TLB 后减少引用，否则先拷贝一份。
+             * 此时读到的引用计数可能已经过时，由 put_pg_tb2() 在锁内判断是否是最后一个引用 */
+            if (from == base && next == base + MEGA_PAGE_SIZE) {
+                tlb_gather_shared_table(tlb, GET_PAGE_ADDR(*pte));
+                *pte = 0;
+                from = next;
+                continue;
+            }
+            unshare_pg_tb2(pte, from);
+        }
+        uint64_t *pg_tb2 = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(*pte));
+        int empty = 1;
+        for (size_t nr = 0; nr < 512; ++nr) {
+            uint64_t addr = base + nr * PAGE_SIZE;
+            if (pg_tb2[nr] && addr >= from && addr < next) {
+                /* 用户地址空间：释放页表和指向的物理页 */
+                /* 内核地址空间：仅释放页表 */
+                if (is_user_space)
+                    tlb_gather_page(tlb, GET_PAGE_ADDR(pg_tb2[nr]));
+                pg_tb2[nr] = 0;
+            }
+            empty &= !pg_tb2[nr];
+        }
+        if (empty) {
+            tlb_gather_table(tlb, GET_PAGE_ADDR(*pte));
+            *pte = 0;
+        }
+        from = next;
+    }
+}
+
 /**
  * @brief 释放虚拟地址 from 开始的 size 字节
  *
- * 本函数每次释放 N * 2M 地址空间（二级页表一项映射的内存大小），因此虚拟地址`from`需要
- * 对其到 2M 边界，否则 panic。
+ * 用户地址空间：解除映射并释放物理页；内核地址空间：仅解除映射。
+ * 三级页表在被完全覆盖或变空时释放。用户地址空间的二级页表在被完全覆盖时释放（页目录项被清零），
+ * 内核地址空间的二级页表被所有进程共享，永不释放。
+ * 物理页和页表在刷新 TLB 之后才被释放。
  *
- * 这个函数被`exit()`调用，用于释放进程虚拟地址空间。
+ * 这个函数被`exit()`和`brk()`调用，用于释放进程虚拟地址空间。
  *
- * @param from 起始地址
- * @param size 要释放的字节数
- * @see exit(), fork()
+ * @param from 起始地址，需要按页对齐
+ * @param size 要释放的字节数，向上对齐到页
+ * @see exit(), fork(), sys_brk()
  */
 void free_page_tables(uint64_t from, uint64_t size)
 {
-    assert((from & 0x1FFFFF) == 0,
+    assert((from & (PAGE_SIZE - 1)) == 0,
            "free_page_tables() called with wrong alignment");
-    size = (size + 0x1FFFFF) & ~0x1FFFFF;
-    int is_user_space = IS_USER(from, from + size);
-    assert(IS_KERNEL(from, from + size) || IS_USER(from, from + size),
+    uint64_t end = from + CEIL(size);
+    int is_user_space = IS_USER(from, end);
+    assert(IS_KERNEL(from, end) || IS_USER(from, end),
            "free_page_tables(): address space [from, from + size) must be kernel space or user space");
-    size >>= 21;
-    uint64_t vpns[3] = { GET_VPN1(from), GET_VPN2(from), GET_VPN3(from) };
-    uint64_t dir_idx = vpns[0];
-    uint64_t dir_idx_end = dir_idx + ((size * 0x200000) / 0x40000000 - 1) +
-                   ((size * 0x200000) % 0x40000000 != 0);
-    assert(dir_idx_end < 512,
-           "free_page_tables(): call with wrong argument");
-    for (; dir_idx <= dir_idx_end; ++dir_idx) {
-        if (!pg_dir[dir_idx])
-            continue;
-        uint64_t cnt;
-        if (size >= 512 - vpns[1]) {
-            cnt = 512 - vpns[1];
-            size -= cnt;
-        } else {
-            cnt = size;
-            size = 0;
-        }
-
-        uint64_t *pg_tb1 =
-            (uint64_t *)VIRTUAL(GET_PAGE_ADDR(pg_dir[dir_idx])) +
-            vpns[1];
-        for (; cnt-- > 0; ++pg_tb1) {
-            if (!*pg_tb1)
-                continue;
-            uint64_t *pg_tb2 =
-                (uint64_t *)VIRTUAL(GET_PAGE_ADDR(*pg_tb1));
-            /* 用户地址空间：释放页表和指向的物理页 */
-            /* 内核地址空间：仅释放页表 */
-            if (is_user_space) {
-                for (size_t nr = 512; nr-- > 0; pg_tb2++) {
-                    if (*pg_tb2) {
-                        free_page(
-                            GET_PAGE_ADDR(*pg_tb2));
-                        *pg_tb2 = 0;
-                    }
-                }
+    struct mmu_gather tlb;
+    tlb_gather_init(&tlb);
+    tlb_gather_range(&tlb, from, end - from);
+    while (from < end) {
+        uint64_t base = from & ~(uint64_t)(GIGA_PAGE_SIZE - 1);
+        uint64_t next = base + GIGA_PAGE_SIZE < end ? base + GIGA_PAGE_SIZE : end;
+        uint64_t *dir = &current_pg_dir[GET_VPN1(from)];
+        int covered = from == base && next == base + GIGA_PAGE_SIZE;
+        if (*dir && IS_LEAF(*dir)) {
+            /* 1G 大页只用于内核线性映射，页目录项被所有进程共享 */
+            panic("free_page_tables(): can't free huge page %p",
+                  GET_PAGE_ADDR(*dir));
+        } else if (*dir) {
+            free_pg_tb1(&tlb, (uint64_t *)VIRTUAL(GET_PAGE_ADDR(*dir)),
+                        from, next, is_user_space);
+            /* 释放二级页表。内核二级页表被所有进程共享，不能释放 */
+            if (covered && is_user_space) {
+                tlb_gather_table(&tlb, GET_PAGE_ADDR(*dir));
+                *dir = 0;
             }
-            free_page(GET_PAGE_ADDR(*pg_tb1));
-            *pg_tb1 = 0;
-        }
-        /* 释放二级页表 */
-        if (vpns[1] == 0 && pg_tb1 > (uint64_t *)VIRTUAL(GET_PAGE_ADDR(
-                             pg_dir[dir_idx])) +
-                             511) {
-            free_page(GET_PAGE_ADDR(pg_dir[dir_idx]));
-            pg_dir[dir_idx] = 0;
         }
-        vpns[1] = 0;
+        from = next;
     }
-    invalidate();
+    tlb_gather_finish(&tlb);
 }
 
 /**
@@ -274,20 +664,20 @@ void free_page_tables(uint64_t from, uint64_t size)
  * 本函数并没有拷贝内存，而是让两段虚拟地址空间共享同一映射。`size`将被对齐到 2M，
  * 每次拷贝 N * 2M 地址空间（二级页表项映射的内存大小）。
  *
- * 算法：
- *     将页表看成一棵高度为 3 的多叉树。将当前进程虚拟地址 [from, from + size) 拷贝到
- *     目标进程虚拟地址空间 [to, to + size) 就是层次遍历两颗树，将 [from, from + size)
- *     对应的页表项拷贝到 [to, to + size) 对应的页表项中。
+ * 用户地址空间：两个进程的二级页表项指向同一个三级页表（写时复制页表）。三级页表中的
+ * 页表项全部被写保护，三级页表所在物理页的引用计数加 1，物理页的引用计数不变。
+ * 任一进程修改共享的三级页表（写时复制、缺页、释放）之前先拷贝一份私有的三级页表，
+ * 因此 fork() 的开销只与之后实际写入的页有关，而与地址空间大小无关。
  *
- *     实现的关键在于维护当前进程和目标进程虚拟地址（页表项）之间的对应关系。
+ * 内核地址空间：直接共享三级页表和大页，不修改引用计数。
  *
  * @param from 当前进程虚拟地址
  * @param to_pg_dir 目的进程页目录 **线性映射虚拟地址**
- * @param from 目标进程虚拟地址
+ * @param to 目标进程虚拟地址
  * @param size 要共享的字节数
- * @return 由于滥用`assert()`，导致返回值失效，暂时返回 1
- * @todo  重构，解决滥用`assert()`的问题，当出错时清理资源并返回 0
- * @see free_page_tables(), map_kernel()，copy_mem()
+ * @return 由于滥用`assert()`，导致返回值失效，暂时返回 0
+ * @todo  重构，解决滥用`assert()`的问题，当出错时清理资源并返回错误码
+ * @see free_page_tables(), unshare_pg_tb2(), copy_mem()
  * @note
  * - `to`开始的 N * 2M 虚拟地址空间必须是 **未映射的**,否则 panic。
  * - 两虚拟地址空间要么都是用户空间，要么都是内核空间
@@ -302,122 +692,69 @@ int copy_page_tables(uint64_t from, uint64_t *to_pg_dir, uint64_t to,
     /* 两虚拟地址空间要么都是用户空间，要么都是内核空间 */
     assert(!(IS_KERNEL(from, from + size) ^ IS_KERNEL(to, to + size)),
            "copy_page_tables(): called with wrong argument");
-    size >>= 21;
-    uint64_t src_vpns[3] = { GET_VPN1(from), GET_VPN2(from),
-                 GET_VPN3(from) };
-    uint64_t src_dir_idx = src_vpns[0];
-    uint64_t src_dir_idx_end = src_dir_idx +
-                   ((size * 0x200000) / 0x40000000 - 1) +
-                   ((size * 0x200000) % 0x40000000 != 0);
-    uint64_t dest_vpns[3] = { GET_VPN1(to), GET_VPN2(to), GET_VPN3(to) };
-    uint64_t dest_dir_idx = dest_vpns[0];
-    uint64_t dest_dir_idx_end = dest_dir_idx +
-                    ((size * 0x200000) / 0x40000000 - 1) +
-                    ((size * 0x200000) % 0x40000000 != 0);
-    assert(src_dir_idx_end < 512,
-           "copy_page_tables(): called with wrong argument");
-    assert(dest_dir_idx_end < 512,
-           "copy_page_tables(): called with wrong argument");
-
-    for (; src_dir_idx <= src_dir_idx_end; ++src_dir_idx, ++src_vpns[0]) {
-        if (!pg_dir[src_dir_idx]) {
-            dest_vpns[1] += 512 - src_vpns[1];
-            if (dest_vpns[1] >= 512) {
-                dest_vpns[1] %= 512;
-                ++dest_vpns[0];
-            }
-            dest_dir_idx = dest_vpns[0];
-            assert(dest_dir_idx < 512, "exceed boundary of to_pg_dir[]");
+    struct mmu_gather tlb;
+    tlb_gather_init(&tlb);
+    uint64_t end = from + size;
+    while (from < end) {
+        uint64_t *src_dir = &current_pg_dir[GET_VPN1(from)];
+        uint64_t *dest_dir = &to_pg_dir[GET_VPN1(to)];
+        if (!*src_dir) {
+            uint64_t step = GIGA_PAGE_SIZE - (from & (GIGA_PAGE_SIZE - 1));
+            if (step > end - from)
+                step = end - from;
+            from += step;
+            to += step;
+            continue;
+        }
+        /* 内核 1G 大页：直接共享页目录项 */
+        if (IS_LEAF(*src_dir)) {
+            assert(!is_user_space && !(from & (GIGA_PAGE_SIZE - 1)) &&
+                       !(to & (GIGA_PAGE_SIZE - 1)) && end - from >= GIGA_PAGE_SIZE,
+                   "copy_page_tables(): can't copy part of huge page %p",
+                   GET_PAGE_ADDR(*src_dir));
+            assert(!*dest_dir,
+                   "copy_page_tables(): page table %p already exist",
+                   GET_PAGE_ADDR(*dest_dir));
+            *dest_dir = *src_dir;
+            from += GIGA_PAGE_SIZE;
+            to += GIGA_PAGE_SIZE;
             continue;
         }
-        if (!to_pg_dir[dest_dir_idx]) {
+        if (!*dest_dir) {
             uint64_t tmp = get_free_page();
             assert(tmp, "copy_page_tables(): memory exhausts");
-            to_pg_dir[dest_dir_idx] = (tmp >> 2) | PAGE_VALID;
+            *dest_dir = (tmp >> 2) | PAGE_VALID;
         }
+        assert(!IS_LEAF(*dest_dir),
+               "copy_page_tables(): %p is mapped by huge page", to);
 
-        uint64_t cnt;
-        if (size > 512 - src_vpns[1]) {
-            cnt = 512 - src_vpns[1];
-            size -= cnt;
-        } else {
-            cnt = size;
-            size = 0;
-        }
-        uint64_t *src_pg_tb1 = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(
-                           pg_dir[src_dir_idx])) +
-                       src_vpns[1];
-        uint64_t *dest_pg_tb1 = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(
-                        to_pg_dir[dest_dir_idx])) +
-                    dest_vpns[1];
-
-        for (; cnt-- > 0; ++src_pg_tb1, ++src_vpns[1]) {
-            if (!*src_pg_tb1) {
-                ++dest_vpns[1];
-                ++dest_pg_tb1;
-                if (dest_vpns[1] >= 512) {
-                    dest_vpns[1] = 0;
-                    ++dest_vpns[0];
-                    ++dest_dir_idx;
-                    assert(dest_dir_idx < 512,
-                          "exceed boundary of to_pg_dir[]");
-                    assert(dest_dir_idx == dest_vpns[0],
-                           "dest_dir_idx don't sync with dest_vpns[]");
-                    dest_pg_tb1 = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(
-                            to_pg_dir[dest_dir_idx])) +
-                        dest_vpns[1];
-                }
-                continue;
-            }
-            if (!*dest_pg_tb1) {
-                uint64_t tmp = get_free_page();
-                assert(tmp,
-                       "copy_page_tables(): Memory exhausts");
-                *dest_pg_tb1 = (tmp >> 2) | PAGE_VALID;
-            } else {
+        uint64_t *src_pte1 = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(*src_dir)) +
+                             GET_VPN2(from);
+        uint64_t *dest_pte1 = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(*dest_dir)) +
+                              GET_VPN2(to);
+        if (*src_pte1) {
+            if (*dest_pte1)
                 panic("copy_page_tables(): page table %p already exist",
-                      GET_PAGE_ADDR(*dest_pg_tb1));
-            }
-
-            uint64_t *src_pg_tb2 =
-                (uint64_t *)VIRTUAL(GET_PAGE_ADDR(*src_pg_tb1));
-            uint64_t *dest_pg_tb2 = (uint64_t *)VIRTUAL(
-                GET_PAGE_ADDR(*dest_pg_tb1));
-            for (size_t nr = 512; nr-- > 0;
-                 ++src_pg_tb2, ++dest_pg_tb2) {
-                if (!*src_pg_tb2) {
-                    continue;
-                }
-                if (*dest_pg_tb2) {
-                    panic("copy_page_tables(): PTE is mapped to %p",
-                          GET_PAGE_ADDR(*dest_pg_tb2));
-                }
-                /* 写保护 */
-                *dest_pg_tb2 = *src_pg_tb2;
-                uint64_t page_addr = GET_PAGE_ADDR(*src_pg_tb2);
-                if (is_user_space) {
-                    ++mem_map[MAP_NR(page_addr)];
-                    *dest_pg_tb2 &= ~PAGE_WRITABLE;
-                    *src_pg_tb2 &= ~PAGE_WRITABLE;
-                }
-            }
-            ++dest_pg_tb1;
-            ++dest_vpns[1];
-            assert(dest_vpns[0] == dest_dir_idx,
-                    "dest_dir_idx don't sync with dest_vpns[0]");
-            if (dest_vpns[1] >= 512) {
-                dest_vpns[1] = 0;
-                ++dest_vpns[0];
-                ++dest_dir_idx;
-                assert(dest_dir_idx < 512, "exceed boundary of to_pg_dir[]");
-                dest_pg_tb1 = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(
-                        to_pg_dir[dest_dir_idx])) +
-                    dest_vpns[1];
+                      GET_PAGE_ADDR(*dest_pte1));
+            if (is_user_space) {
+                assert(!IS_LEAF(*src_pte1),
+                       "copy_page_tables(): huge page in user space");
+                /* 写保护，当前进程的页被写保护，需要刷新 TLB。
+                 * 页表可能已被共享，其他进程同时在拷贝或释放它 */
+                uint64_t *pg_tb2 = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(*src_pte1));
+                uint64_t flags = acquire_lock_irqsave(&pg_tb2_lock);
+                for (size_t nr = 0; nr < 512; ++nr)
+                    pg_tb2[nr] &= ~PAGE_WRITABLE;
+                page_ref_inc(PAGE_OF(GET_PAGE_ADDR(*src_pte1)));
+                release_lock_irqrestore(&pg_tb2_lock, flags);
+                tlb_gather_range(&tlb, from, MEGA_PAGE_SIZE);
             }
+            *dest_pte1 = *src_pte1;
         }
-        src_vpns[1] = 0;
+        from += MEGA_PAGE_SIZE;
+        to += MEGA_PAGE_SIZE;
     }
-    invalidate();
+    tlb_gather_finish(&tlb);
     return 0;
 }
 
@@ -425,46 +762,125 @@ int copy_page_tables(uint64_t from, uint64_t *to_pg_dir, uint64_t to,
  * @brief 取消页表项对应的页的写保护
  *
  * @param table_entry 页表项指针(虚拟地址)
+ * @param addr 页表项映射的虚拟地址，仅刷新该页的 TLB 表项
  */
-void un_wp_page(uint64_t *table_entry)
+void un_wp_page(uint64_t *table_entry, uint64_t addr)
 {
     uint64_t old_page, new_page;
     old_page = GET_PAGE_ADDR(*table_entry);
-    if (old_page >= LOW_MEM && mem_map[MAP_NR(old_page)] == 1) {
+    /* 零页：分配已清零的页即可，不需要拷贝 */
+    if (old_page == ZERO_PAGE) {
+        assert(new_page = get_free_page(),
+               "un_wp_page(): failed to get free page");
+        *table_entry = (new_page >> 2) | GET_FLAG(*table_entry) | PAGE_WRITABLE;
+        flush_tlb_page(addr);
+        return;
+    }
+    if (old_page >= LOW_MEM && page_count(PAGE_OF(old_page)) == 1) {
         *table_entry |= PAGE_WRITABLE;
-        invalidate();
+        flush_tlb_page(addr);
         return;
     }
-    assert(new_page = get_free_page(),
+    assert(new_page = get_free_page_nozero(),
            "un_wp_page(): failed to get free page");
     if (old_page >= LOW_MEM)
         free_page(old_page);
     copy_page(VIRTUAL(old_page), VIRTUAL(new_page));
     *table_entry = (new_page >> 2) | GET_FLAG(*table_entry) | PAGE_WRITABLE;
-    invalidate();
+    flush_tlb_page(addr);
 }
 
 /**
- * @brief 取消某地址的写保护
- *
- * 地址必须合法，否则 panic
+ * @brief 查找虚拟地址 addr 对应的叶子页表项
  *
  * @param addr 虚拟地址
+ * @param size 若不为 NULL，返回叶子页表项映射的页大小（4K、2M 或 1G）
+ * @return 叶子页表项指针（线性映射虚拟地址），未映射返回 NULL
  */
-void write_verify(uint64_t addr)
+static uint64_t *find_pte(uint64_t addr, uint64_t *size)
 {
     uint64_t vpns[3] = { GET_VPN1(addr), GET_VPN2(addr), GET_VPN3(addr) };
-    uint64_t *page_table = pg_dir;
-    for (size_t level = 0; level < 2; ++level) {
-        uint64_t idx = vpns[level];
-        assert (page_table[idx],
-                "write_verify(): addr %p is not available", addr);
-        page_table =
-            (uint64_t *)VIRTUAL(GET_PAGE_ADDR(page_table[idx]));
+    uint64_t *page_table = current_pg_dir;
+    uint64_t page_size = GIGA_PAGE_SIZE;
+    size_t level = 0;
+    for (; level < 2; ++level) {
+        uint64_t pte = page_table[vpns[level]];
+        if (!(pte & PAGE_VALID))
+            return NULL;
+        if (IS_LEAF(pte))
+            break;
+        page_table = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(pte));
+        page_size >>= 9;
     }
-    un_wp_page(&page_table[vpns[2]]);
+    if (!(page_table[vpns[level]] & PAGE_VALID))
+        return NULL;
+    if (size)
+        *size = page_size;
+    return &page_table[vpns[level]];
 }
 
+/**
+ * @brief 获取用户虚拟地址 addr 对应的可修改的页表项
+ *
+ * 若 addr 所在的三级页表被多个进程共享，先拷贝一份私有的三级页表。
+ *
+ * @param addr 用户虚拟地址
+ * @return 页表项指针（线性映射虚拟地址），addr 未映射到 4K 页时返回 NULL
+ */
+static uint64_t *get_pte(uint64_t addr)
+{
+    uint64_t *pte = &current_pg_dir[GET_VPN1(addr)];
+    if (!(*pte & PAGE_VALID) || IS_LEAF(*pte))
+        return NULL;
+    pte = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(*pte)) + GET_VPN2(addr);
+    if (!(*pte & PAGE_VALID) || IS_LEAF(*pte))
+        return NULL;
+    unshare_pg_tb2(pte, addr);
+    pte = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(*pte)) + GET_VPN3(addr);
+    return (*pte & PAGE_VALID) ? pte : NULL;
+}
+
+/**
+ * @brief 取消某地址的写保护
+ *
+ * @param addr 用户虚拟地址
+ * @return 成功返回 0，addr 未映射到 4K 页返回 -EFAULT
+ */
+int write_verify(uint64_t addr)
+{
+    uint64_t *pte = get_pte(addr);
+    if (!pte)
+        return -EFAULT;
+    un_wp_page(pte, addr);
+    return 0;
+}
+
+/**
+ * @brief 匿名页缺页处理
+ *
+ * 虚拟地址 addr 所在的页第一次被访问时调用：读访问映射只读的零页，写访问分配已清零的物理页。
+ * 零页被写时由写时复制机制（un_wp_page()）分配物理页。
+ *
+ * @param addr 用户虚拟地址
+ * @param write 是否是写访问
+ * @return 成功返回 0；addr 已被映射（访问权限错误）返回 -EFAULT；内存耗尽返回 -ENOMEM
+ */
+int do_no_page(uint64_t addr, int write)
+{
+    addr = FLOOR(addr);
+    if (find_pte(addr, NULL))
+        return -EFAULT;
+    if (write) {
+        uint64_t page = get_free_page();
+        if (!page)
+            return -ENOMEM;
+        put_page(page, addr, USER_RW | PAGE_VALID);
+    } else {
+        put_page(ZERO_PAGE, addr, USER_R | PAGE_VALID);
+    }
+    flush_tlb_page(addr);
+    return 0;
+}
 
 /**
  * @brief 测试内存模块是否正常
@@ -475,21 +891,16 @@ void mem_test()
     /** 测试虚拟地址到物理地址的线性映射是否正确 */
     uint64_t addr = KERNEL_ADDRESS;
     uint64_t end = KERNEL_ADDRESS + PAGING_MEMORY;
-    for (; addr < end; addr += PAGE_SIZE) {
-        uint64_t vpns[3] = { GET_VPN1(addr), GET_VPN2(addr),
-                     GET_VPN3(addr) };
-        uint64_t *page_table = pg_dir;
-        for (size_t level = 0; level < 2; ++level) {
-            uint64_t idx = vpns[level];
-            assert(page_table[idx],
-                   "page table %p of %p not exists",
-                   &page_table[idx], addr);
-            page_table = (uint64_t *)VIRTUAL(
-                GET_PAGE_ADDR(page_table[idx]));
-        }
-        assert(GET_PAGE_ADDR(page_table[vpns[2]]) == PHYSICAL(addr),
+    /* 线性映射区使用大页，按页表项实际映射的页大小步进 */
+    uint64_t size;
+    for (; addr < end; addr += size) {
+        uint64_t *pte = find_pte(addr, &size);
+        assert(pte, "mem_test(): virtual address %p is not mapped", addr);
+        assert(!(addr & (size - 1)) && addr + size <= end,
+               "mem_test(): huge page at %p exceeds linear mapping", addr);
+        assert(GET_PAGE_ADDR(*pte) == PHYSICAL(addr),
                "mem_test(): virtual address %p maps to physical address %p",
-               addr, GET_PAGE_ADDR(page_table[vpns[2]]));
+               addr, GET_PAGE_ADDR(*pte));
     }
 
     /*
@@ -499,7 +910,7 @@ void mem_test()
      * for (; addr < end; addr += PAGE_SIZE) {
      *     uint64_t vpns[3] = { GET_VPN1(addr), GET_VPN2(addr),
      *                  GET_VPN3(addr) };
-     *     uint64_t *page_table = pg_dir;
+     *     uint64_t *page_table = current_pg_dir;
      *     for (size_t level = 0; level < 2; ++level) {
      *         uint64_t idx = vpns[level];
      *         assert(page_table[idx],
@@ -532,7 +943,7 @@ void mem_test()
     for (size_t i = 0; addr < end; addr += PAGE_SIZE, ++i) {
         uint64_t vpns[3] = { GET_VPN1(addr), GET_VPN2(addr),
                      GET_VPN3(addr) };
-        uint64_t *page_table = pg_dir;
+        uint64_t *page_table = current_pg_dir;
         for (size_t level = 0; level < 2; ++level) {
             uint64_t idx = vpns[level];
             assert(page_table[idx],
@@ -540,7 +951,7 @@ void mem_test()
                    &page_table[idx], addr);
             page_table = (uint64_t *)VIRTUAL(
                 GET_PAGE_ADDR(page_table[idx]));
-            assert(mem_map[MAP_NR(PHYSICAL((uint64_t)page_table))] ==
+            assert(page_count(PAGE_OF(PHYSICAL((uint64_t)page_table))) ==
                        1,
                    "page table reference is wrong");
         }
@@ -554,10 +965,8 @@ void mem_test()
     uint64_t page = get_free_page();
     assert(page != 0, "failed to allocate memory");
     uint64_t *new_pg_dir = (uint64_t *)VIRTUAL(page);
-    uint64_t *old_pg_dir = pg_dir;
-    pg_dir = new_pg_dir;
-    map_kernel();
-    pg_dir = old_pg_dir;
+    uint64_t *old_pg_dir = current_pg_dir;
+    share_kernel_pg_dir(new_pg_dir);
     copy_page_tables(0x200000, new_pg_dir, 0x200000, 1000 * PAGE_SIZE);
 
     /* 检查旧“进程”虚拟地址空间的映射和引用计数 */
@@ -566,7 +975,7 @@ void mem_test()
     for (size_t i = 0; addr < end; addr += PAGE_SIZE, ++i) {
         uint64_t vpns[3] = { GET_VPN1(addr), GET_VPN2(addr),
                      GET_VPN3(addr) };
-        uint64_t *page_table = pg_dir;
+        uint64_t *page_table = current_pg_dir;
         for (size_t level = 0; level < 2; ++level) {
             uint64_t idx = vpns[level];
             assert(page_table[idx],
@@ -574,15 +983,16 @@ void mem_test()
                    &page_table[idx], addr);
             page_table = (uint64_t *)VIRTUAL(
                 GET_PAGE_ADDR(page_table[idx]));
-            assert(mem_map[MAP_NR(PHYSICAL((uint64_t)page_table))] ==
-                       1,
+            /* 两个“进程”共享三级页表 */
+            assert(page_count(PAGE_OF(PHYSICAL((uint64_t)page_table))) ==
+                       level + 1,
                    "page table reference is wrong");
         }
         assert(GET_PAGE_ADDR(page_table[vpns[2]]) == page_tracker[i],
                "virtual address %p maps to physical address %p", addr,
                GET_PAGE_ADDR(page_table[vpns[2]]));
-        /* 两个“进程”的虚拟地址同时映射到一个物理地址 */
-        assert(mem_map[MAP_NR(page_tracker[i])] == 2,
+        /* 两个“进程”的虚拟地址通过同一个三级页表映射到一个物理地址，物理页引用计数不变 */
+        assert(page_count(PAGE_OF(page_tracker[i])) == 1,
                "page reference is wrong");
         /* 共享同一物理地址后进行写保护 */
         assert(GET_FLAG(page_table[vpns[2]]) ==
@@ -592,13 +1002,13 @@ void mem_test()
 
     /* 检查新“进程”虚拟地址空间的映射和引用计数
      * 新“进程”虚拟地址空间和旧“进程”虚拟地址相同 */
-    pg_dir = new_pg_dir;
+    current_pg_dir = new_pg_dir;
     addr = 0x200000;
     end = addr + 1000 * PAGE_SIZE;
     for (size_t i = 0; addr < end; addr += PAGE_SIZE, ++i) {
         uint64_t vpns[3] = { GET_VPN1(addr), GET_VPN2(addr),
                      GET_VPN3(addr) };
-        uint64_t *page_table = pg_dir;
+        uint64_t *page_table = current_pg_dir;
         for (size_t level = 0; level < 2; ++level) {
             uint64_t idx = vpns[level];
             assert(page_table[idx],
@@ -606,32 +1016,43 @@ void mem_test()
                    &page_table[idx], addr);
             page_table = (uint64_t *)VIRTUAL(
                 GET_PAGE_ADDR(page_table[idx]));
-            assert(mem_map[MAP_NR(PHYSICAL((uint64_t)page_table))] ==
-                       1,
+            assert(page_count(PAGE_OF(PHYSICAL((uint64_t)page_table))) ==
+                       level + 1,
                    "page table reference is wrong");
         }
         assert(GET_PAGE_ADDR(page_table[vpns[2]]) == page_tracker[i],
                "virtual address %p maps to physical address %p", addr,
                GET_PAGE_ADDR(page_table[vpns[2]]));
-        assert(mem_map[MAP_NR(GET_PAGE_ADDR(page_table[vpns[2]]))] == 2,
+        assert(page_count(PAGE_OF(GET_PAGE_ADDR(page_table[vpns[2]]))) == 1,
                "page reference is wrong");
         assert(GET_FLAG(page_table[vpns[2]]) ==
                    (USER_RX | PAGE_VALID),
                "permission is wrong");
     }
 
+    /* 新“进程”写第一页：先拷贝共享的三级页表，再写时复制该页 */
+    assert(write_verify(0x200000) == 0, "mem_test(): write_verify() failed");
+    uint64_t *pte = find_pte(0x200000, NULL);
+    assert(GET_PAGE_ADDR(*pte) != page_tracker[0] && (*pte & PAGE_WRITABLE),
+           "mem_test(): copy on write failed");
+    assert(page_count(PAGE_OF(PHYSICAL((uint64_t)pte))) == 1,
+           "page table reference is wrong");
+    assert(page_count(PAGE_OF(page_tracker[0])) == 1 &&
+               page_count(PAGE_OF(page_tracker[1])) == 2,
+           "page reference is wrong");
+
     /* 释放新“进程”虚拟地址空间 */
-    pg_dir = new_pg_dir;
+    current_pg_dir = new_pg_dir;
     addr = 0x200000;
     end = addr + 1000 * PAGE_SIZE;
     free_page_tables(addr, 1000 * PAGE_SIZE);
 
     /* 检查旧“进程”虚拟地址空间的映射和引用计数 */
-    pg_dir = old_pg_dir;
+    current_pg_dir = old_pg_dir;
     for (size_t i = 0; addr < end; addr += PAGE_SIZE, ++i) {
         uint64_t vpns[3] = { GET_VPN1(addr), GET_VPN2(addr),
                      GET_VPN3(addr) };
-        uint64_t *page_table = pg_dir;
+        uint64_t *page_table = current_pg_dir;
         for (size_t level = 0; level < 2; ++level) {
             uint64_t idx = vpns[level];
             assert(page_table[idx],
@@ -639,7 +1060,7 @@ void mem_test()
                    &page_table[idx], addr);
             page_table = (uint64_t *)VIRTUAL(
                 GET_PAGE_ADDR(page_table[idx]));
-            assert(mem_map[MAP_NR(PHYSICAL((uint64_t)page_table))] ==
+            assert(page_count(PAGE_OF(PHYSICAL((uint64_t)page_table))) ==
                        1,
                    "page table reference is wrong");
         }
@@ -647,7 +1068,7 @@ void mem_test()
                "virtual address %p maps to physical address %p", addr,
                GET_PAGE_ADDR(page_table[vpns[2]]));
         /* 新“进程”虚拟地址空间被释放，旧“进程”唯一地占有物理页 */
-        assert(mem_map[MAP_NR(GET_PAGE_ADDR(page_table[vpns[2]]))] == 1,
+        assert(page_count(PAGE_OF(GET_PAGE_ADDR(page_table[vpns[2]]))) == 1,
                "page reference is wrong");
         /* 整个过程不涉及旧“进程”虚拟地址空间的写，因此页表项权限不变 */
         assert(GET_FLAG(page_table[vpns[2]]) ==
@@ -656,13 +1077,13 @@ void mem_test()
     }
 
     /* 检查新“进程”虚拟地址空间的映射和引用计数 */
-    pg_dir = new_pg_dir;
+    current_pg_dir = new_pg_dir;
     addr = 0x200000;
     end = addr + 1000 * PAGE_SIZE;
     for (size_t i = 0; addr < end; addr += PAGE_SIZE, ++i) {
         uint64_t vpns[3] = { GET_VPN1(addr), GET_VPN2(addr),
                      GET_VPN3(addr) };
-        uint64_t *page_table = pg_dir;
+        uint64_t *page_table = current_pg_dir;
         /* 一级页表项被清零
          * 二级页表项清零，但二级页表未被释放
          * 三级页表被释放
@@ -677,14 +1098,102 @@ void mem_test()
             }
             page_table = (uint64_t *)VIRTUAL(
                 GET_PAGE_ADDR(page_table[idx]));
-            assert(mem_map[MAP_NR(PHYSICAL((uint64_t)page_table))] ==
+            assert(page_count(PAGE_OF(PHYSICAL((uint64_t)page_table))) ==
                        1,
                    "page table reference is wrong");
         }
     }
 
-    pg_dir = old_pg_dir;
+    current_pg_dir = old_pg_dir;
     free_page_tables(0x200000, 1000 * PAGE_SIZE);
+
+    /* 测试多次 fork() 后的进程在不同处理器上同时退出：每个进程释放时读到的共享三级页表的引用计数
+     * 都大于 1，在刷新 TLB 后才减少引用，期间还有进程写时复制。mem_test() 在其他处理器启动前
+     * 运行，这里在一个处理器上按交错的顺序重现这些操作，最后一个引用者必须释放页表和物理页 */
+    uint64_t nr_free = nr_free_pages() + zero_pool_nr;
+    for (size_t i = 0; i < 1024; ++i) {
+        uint64_t page = get_free_page();
+        assert(page, "mem_test(): failed to allocate memory");
+        put_page(page, 0x200000 + i * PAGE_SIZE, USER_RWX | PAGE_VALID);
+    }
+    uint64_t *pg_dirs[5];
+    struct mmu_gather tlbs[4];
+    pg_dirs[0] = old_pg_dir;
+    for (size_t i = 1; i < 5; ++i) {
+        uint64_t page = get_free_page();
+        assert(page, "mem_test(): failed to allocate memory");
+        pg_dirs[i] = (uint64_t *)VIRTUAL(page);
+        share_kernel_pg_dir(pg_dirs[i]);
+        copy_page_tables(0x200000, pg_dirs[i], 0x200000, 1024 * PAGE_SIZE);
+    }
+    uint64_t tables[2];
+    tables[0] = PHYSICAL((uint64_t)find_pte(0x200000, NULL)) & ~(uint64_t)(PAGE_SIZE - 1);
+    tables[1] = PHYSICAL((uint64_t)find_pte(0x400000, NULL)) & ~(uint64_t)(PAGE_SIZE - 1);
+    assert(page_count(PAGE_OF(tables[0])) == 5 && page_count(PAGE_OF(tables[1])) == 5,
+           "page table reference is wrong");
+    for (size_t i = 0; i < 4; ++i) {
+        current_pg_dir = pg_dirs[i];
+        uint64_t *pg_tb1 = (uint64_t *)VIRTUAL(GET_PAGE_ADDR(current_pg_dir[GET_VPN1(0x200000)]));
+        tlb_gather_init(&tlbs[i]);
+        tlb_gather_range(&tlbs[i], 0x200000, 2 * MEGA_PAGE_SIZE);
+        free_pg_tb1(&tlbs[i], pg_tb1, 0x200000, 0x600000, 1);
+    }
+    current_pg_dir = pg_dirs[4];
+    assert(write_verify(0x200000) == 0, "mem_test(): write_verify() failed");
+    assert(page_count(PAGE_OF(tables[0])) == 4 && page_count(PAGE_OF(tables[1])) == 5,
+           "page table reference is wrong");
+    for (size_t i = 0; i < 4; ++i) {
+        current_pg_dir = pg_dirs[i];
+        tlb_gather_finish(&tlbs[i]);
+    }
+    current_pg_dir = pg_dirs[4];
+    assert(page_count(PAGE_OF(tables[1])) == 1, "page table reference is wrong");
+    free_page_tables(0x200000, 2 * MEGA_PAGE_SIZE);
+    for (size_t i = 1; i < 5; ++i) {
+        uint64_t *dir = &pg_dirs[i][GET_VPN1(0x200000)];
+        free_page(GET_PAGE_ADDR(*dir));
+        *dir = 0;
+        free_page(PHYSICAL((uint64_t)pg_dirs[i]));
+    }
+    current_pg_dir = old_pg_dir;
+    assert(nr_free_pages() + zero_pool_nr == nr_free,
+           "mem_test(): freeing shared page tables leaks memory");
+
+    /* 测试伙伴系统：分配的块物理连续、按阶对齐，释放后空闲页数恢复 */
+    nr_free = nr_free_pages();
+    uint64_t blocks[MAX_ORDER];
+    for (size_t order = 0; order < MAX_ORDER; ++order) {
+        blocks[order] = alloc_pages(order);
+        assert(blocks[order], "mem_test(): alloc_pages(%u) failed", (uint64_t)order);
+        assert(!(MAP_NR(blocks[order]) & ((1UL << order) - 1)),
+               "mem_test(): block %p is not aligned", blocks[order]);
+        for (size_t i = 0; i < (1UL << order); ++i)
+            assert(page_count(PAGE_OF(blocks[order]) + i) == 1,
+                   "page reference is wrong");
+    }
+    assert(nr_free_pages() == nr_free - ((1UL << MAX_ORDER) - 1),
+           "mem_test(): free page count is wrong");
+    for (size_t order = 0; order < MAX_ORDER; ++order)
+        free_pages(blocks[order], order);
+    assert(nr_free_pages() == nr_free, "mem_test(): free page count is wrong");
+
+    /* 测试按需分配：读缺页映射零页，写零页时分配新的清零页 */
+    nr_free = nr_free_pages() + zero_pool_nr;
+    addr = 0x200000;
+    assert(do_no_page(addr, 0) == 0, "mem_test(): do_no_page() failed");
+    pte = find_pte(addr, NULL);
+    assert(GET_PAGE_ADDR(*pte) == ZERO_PAGE && !(*pte & PAGE_WRITABLE),
+           "mem_test(): read fault should map zero page");
+    assert(do_no_page(addr, 1) == -EFAULT,
+           "mem_test(): do_no_page() on mapped page should fail");
+    assert(write_verify(addr) == 0, "mem_test(): write_verify() failed");
+    pte = find_pte(addr, NULL);
+    assert(GET_PAGE_ADDR(*pte) != ZERO_PAGE && (*pte & PAGE_WRITABLE),
+           "mem_test(): write to zero page should allocate page");
+    assert(*(uint64_t *)addr == 0, "mem_test(): new page is not zeroed");
+    free_page_tables(0x200000, PAGE_SIZE);
+    assert(nr_free_pages() + zero_pool_nr == nr_free,
+           "mem_test(): demand paging leaks memory");
     kputs("mem_test(): Passed");
 }
 
@@ -694,13 +1203,13 @@ void mem_test()
 void show_page_tables()
 {
     for (size_t i = 0; i++ < 512; ++i) {
-        kprintf("%x\n", pg_dir[i]);
-        if (pg_dir[i]) {
+        kprintf("%x\n", current_pg_dir[i]);
+        if (current_pg_dir[i] && !IS_LEAF(current_pg_dir[i])) {
             uint64_t *pg_tb1 =
-                (uint64_t *)VIRTUAL(GET_PAGE_ADDR(pg_dir[i]));
+                (uint64_t *)VIRTUAL(GET_PAGE_ADDR(current_pg_dir[i]));
             for (int j = 512; j-- > 0; ++pg_tb1) {
                 kprintf("\t%x\n", *pg_tb1);
-                if (*pg_tb1) {
+                if (*pg_tb1 && !IS_LEAF(*pg_tb1)) {
                     uint64_t *pg_tb2 = (uint64_t *)VIRTUAL(
                         GET_PAGE_ADDR(*pg_tb1));
                     for (int k = 512; k-- > 0; ++pg_tb2) {
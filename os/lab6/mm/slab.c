@@ -0,0 +1,289 @@
+/**
+ * @file slab.c
+ * @brief 实现 slab 对象缓存
+ *
+ * 频繁分配的内核对象（如 vfs_inode、device）使用专门的对象缓存（kmem_cache）分配，
+ * 对象大小只按对齐要求取整，不会像 kmalloc() 那样取整到 2 的幂次而浪费近一半内存。
+ *
+ * 每个缓存由若干 slab 组成，一个 slab 占用一个物理页：
+ *
+ *     +------------+---------+--------+----------+----------+-----+--------+
+ *     | slab 描述符 | bufctl  | 着色区 | 对象 0   | 对象 1   | ... | 剩余   |
+ *     +------------+---------+--------+----------+----------+-----+--------+
+ *
+ * bufctl[] 是空闲对象链表，bufctl[i] 为对象 i 之后的下一个空闲对象的下标。
+ * 空闲链表不存放在对象内部，因此对象在释放后仍保持构造函数初始化的状态。
+ *
+ * 着色：页内剩余的空间被用来错开不同 slab 中第一个对象的偏移（按缓存行），
+ * 使不同 slab 中相同下标的对象映射到不同的缓存组。
+ *
+ * slab 按使用情况放在缓存的满、部分空闲、空闲三条链表中，分配和释放都是 O(1)。
+ * 每个缓存最多保留一个空闲 slab，多余的空闲 slab 立即归还伙伴系统。
+ *
+ * 每个缓存有自己的自旋锁，不同缓存的分配可以在多个处理器上并行。
+ */
+#include <assert.h>
+#include <kdebug.h>
+#include <mm.h>
+#include <stddef.h>
+#include <utils/atomic.h>
+#include <utils/linked_list.h>
+
+#define L1_CACHE_BYTES 64                               /**< 缓存行大小，着色偏移的单位 */
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+#define BUFCTL_END 0xFFFF                               /**< 空闲对象链表结束 */
+
+/** 对象缓存 */
+struct kmem_cache {
+    const char *name;                       /**< 缓存名称，用于统计信息 */
+    uint64_t size;                          /**< 对象大小（已按 align 取整） */
+    uint64_t align;                         /**< 对象对齐 */
+    void (*ctor)(void *);                   /**< 构造函数，slab 创建时对每个对象调用一次，可以为 NULL */
+    uint32_t num;                           /**< 每个 slab 中的对象数 */
+    uint32_t colour;                        /**< 着色偏移的个数 */
+    uint32_t colour_next;                   /**< 下一个 slab 使用的着色偏移 */
+    uint64_t colour_off;                    /**< 着色偏移的单位 */
+    uint64_t obj_offset;                    /**< 不着色时第一个对象相对页首的偏移 */
+    struct linked_list_node slabs_full;     /**< 满 slab 链表 */
+    struct linked_list_node slabs_partial;  /**< 部分空闲 slab 链表 */
+    struct linked_list_node slabs_free;     /**< 空闲 slab 链表 */
+    struct linked_list_node list;           /**< 全部缓存的链表节点 */
+    struct spinlock lock;                   /**< 保护 slab 链表和统计信息 */
+
+    /// @{ @name 统计信息
+    uint64_t nr_slabs;                      /**< slab 数（占用的物理页数） */
+    uint64_t active_objs;                   /**< 已分配的对象数 */
+    uint64_t max_active_objs;               /**< 已分配对象数的峰值 */
+    uint64_t nr_allocs;                     /**< 分配次数 */
+    uint64_t nr_frees;                      /**< 释放次数 */
+    /// @}
+};
+
+/** slab 描述符，位于 slab 页首 */
+struct slab {
+    struct linked_list_node list;           /**< 所在的 slab 链表节点 */
+    struct kmem_cache *cache;               /**< 所属的缓存 */
+    uint64_t s_mem;                         /**< 第一个对象的地址（含着色偏移） */
+    uint32_t inuse;                         /**< 已分配的对象数 */
+    uint16_t free;                          /**< 第一个空闲对象的下标，BUFCTL_END 表示已满 */
+    uint16_t bufctl[];                      /**< 空闲对象链表 */
+};
+
+/** 全部缓存的链表 */
+static struct linked_list_node cache_chain = { &cache_chain, &cache_chain };
+
+/** 保护 cache_chain */
+static struct spinlock cache_chain_lock;
+
+/** 缓存描述符自身的缓存 */
+static struct kmem_cache cache_cache;
+
+/**
+ * @brief 计算每个 slab 中的对象数和剩余空间
+ *
+ * @param cache 已设置 size 和 align 的缓存
+ * @return 剩余空间（字节）
+ */
+static uint64_t cache_estimate(struct kmem_cache *cache)
+{
+    uint64_t num = (PAGE_SIZE - sizeof(struct slab)) / (cache->size + sizeof(uint16_t));
+    while (num &&
+           ALIGN_UP(sizeof(struct slab) + num * sizeof(uint16_t), cache->align) +
+           num * cache->size > PAGE_SIZE)
+        --num;
+    assert(num, "kmem_cache: object of %s is too large", cache->name);
+    if (num > BUFCTL_END)
+        num = BUFCTL_END;
+    cache->num = num;
+    cache->obj_offset = ALIGN_UP(sizeof(struct slab) + num * sizeof(uint16_t), cache->align);
+    return PAGE_SIZE - cache->obj_offset - num * cache->size;
+}
+
+/**
+ * @brief 初始化缓存描述符
+ */
+static void cache_init(struct kmem_cache *cache, const char *name, uint64_t size,
+                       uint64_t align, void (*ctor)(void *))
+{
+    if (!align)
+        align = sizeof(void *);
+    assert(!(align & (align - 1)), "kmem_cache_create(): bad align %u", align);
+    cache->name = name;
+    cache->align = align;
+    cache->size = ALIGN_UP(size, align);
+    cache->ctor = ctor;
+    uint64_t left = cache_estimate(cache);
+    cache->colour_off = align > L1_CACHE_BYTES ? align : L1_CACHE_BYTES;
+    cache->colour = left / cache->colour_off;
+    cache->colour_next = 0;
+    linked_list_init(&cache->slabs_full);
+    linked_list_init(&cache->slabs_partial);
+    linked_list_init(&cache->slabs_free);
+    cache->nr_slabs = 0;
+    cache->active_objs = 0;
+    cache->max_active_objs = 0;
+    cache->nr_allocs = 0;
+    cache->nr_frees = 0;
+    init_lock(&cache->lock, "kmem_cache");
+    uint64_t flags = acquire_lock_irqsave(&cache_chain_lock);
+    linked_list_push(&cache_chain, &cache->list);
+    release_lock_irqrestore(&cache_chain_lock, flags);
+}
+
+/**
+ * @brief 创建对象缓存
+ *
+ * @param name 缓存名称，必须在缓存的生命周期内有效
+ * @param size 对象大小，不能超过一页（减去 slab 描述符）
+ * @param align 对象对齐，必须是 2 的幂次，为 0 时按指针大小对齐
+ * @param ctor 构造函数，可以为 NULL。构造函数只在 slab 创建时调用，
+ *             使用者释放对象前应使其恢复构造后的状态
+ * @return 缓存，内存不足时返回 NULL
+ */
+struct kmem_cache *kmem_cache_create(const char *name, uint64_t size, uint64_t align,
+                                     void (*ctor)(void *))
+{
+    if (!cache_cache.name)
+        cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL);
+    struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+    if (!cache)
+        return NULL;
+    cache_init(cache, name, size, align, ctor);
+    return cache;
+}
+
+/**
+ * @brief 为缓存分配一个新的 slab
+ *
+ * @param cache 缓存
+ * @return slab，内存不足时返回 NULL
+ */
+static struct slab *cache_grow(struct kmem_cache *cache)
+{
+    uint64_t page = get_free_page_nozero();
+    if (!page)
+        return NULL;
+    PAGE_OF(page)->flags |= PG_slab;
+    struct slab *slab = (struct slab *)VIRTUAL(page);
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->s_mem = (uint64_t)slab + cache->obj_offset + cache->colour_next * cache->colour_off;
+    if (++cache->colour_next > cache->colour)
+        cache->colour_next = 0;
+    for (uint32_t i = 0; i < cache->num; ++i) {
+        slab->bufctl[i] = i + 1;
+        if (cache->ctor)
+            cache->ctor((void *)(slab->s_mem + i * cache->size));
+    }
+    slab->bufctl[cache->num - 1] = BUFCTL_END;
+    slab->free = 0;
+    linked_list_push(&cache->slabs_free, &slab->list);
+    ++cache->nr_slabs;
+    return slab;
+}
+
+/**
+ * @brief 从缓存中分配一个对象
+ *
+ * 调用者负责互斥，一般使用 kmem_cache_alloc()。
+ *
+ * @param cache 缓存
+ * @return 对象，内存不足时返回 NULL
+ */
+void *kmem_cache_alloc_i(struct kmem_cache *cache)
+{
+    struct slab *slab;
+    if (!linked_list_empty(&cache->slabs_partial)) {
+        slab = container_of(linked_list_first(&cache->slabs_partial), struct slab, list);
+    } else {
+        if (linked_list_empty(&cache->slabs_free) && !cache_grow(cache))
+            return NULL;
+        slab = container_of(linked_list_first(&cache->slabs_free), struct slab, list);
+    }
+    void *obj = (void *)(slab->s_mem + slab->free * cache->size);
+    slab->free = slab->bufctl[slab->free];
+    linked_list_remove(&slab->list);
+    if (++slab->inuse == cache->num)
+        linked_list_push(&cache->slabs_full, &slab->list);
+    else
+        linked_list_push(&cache->slabs_partial, &slab->list);
+    ++cache->nr_allocs;
+    if (++cache->active_objs > cache->max_active_objs)
+        cache->max_active_objs = cache->active_objs;
+    return obj;
+}
+
+/**
+ * @brief 将对象归还缓存
+ *
+ * 调用者负责互斥，一般使用 kmem_cache_free()。
+ *
+ * @param cache 缓存
+ * @param obj 由 kmem_cache_alloc() 从同一缓存分配的对象
+ */
+void kmem_cache_free_i(struct kmem_cache *cache, void *obj)
+{
+    uint64_t page = PHYSICAL(FLOOR((uint64_t)obj));
+    assert(page >= LOW_MEM && page < HIGH_MEM && (PAGE_OF(page)->flags & PG_slab),
+           "kmem_cache_free(): %p is not a slab object", obj);
+    struct slab *slab = (struct slab *)VIRTUAL(page);
+    assert(slab->cache == cache,
+           "kmem_cache_free(): %p does not belong to %s", obj, cache->name);
+    uint64_t idx = ((uint64_t)obj - slab->s_mem) / cache->size;
+    slab->bufctl[idx] = slab->free;
+    slab->free = idx;
+    linked_list_remove(&slab->list);
+    if (--slab->inuse) {
+        linked_list_push(&cache->slabs_partial, &slab->list);
+    } else if (linked_list_empty(&cache->slabs_free)) {
+        linked_list_push(&cache->slabs_free, &slab->list);
+    } else {
+        PAGE_OF(page)->flags &= ~PG_slab;
+        free_page(page);
+        --cache->nr_slabs;
+    }
+    ++cache->nr_frees;
+    --cache->active_objs;
+}
+
+/**
+ * @brief 从缓存中分配一个对象（关中断并持有缓存的锁）
+ *
+ * @see kmem_cache_alloc_i()
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    uint64_t flags = acquire_lock_irqsave(&cache->lock);
+    void *obj = kmem_cache_alloc_i(cache);
+    release_lock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+/**
+ * @brief 将对象归还缓存（关中断并持有缓存的锁）
+ *
+ * @see kmem_cache_free_i()
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    uint64_t flags = acquire_lock_irqsave(&cache->lock);
+    kmem_cache_free_i(cache, obj);
+    release_lock_irqrestore(&cache->lock, flags);
+}
+
+/**
+ * @brief 打印全部缓存的使用情况
+ */
+void show_slab_info()
+{
+    kputs("name\tobjsize\tactive\ttotal\tslabs\tpeak\tallocs\tfrees");
+    uint64_t flags = acquire_lock_irqsave(&cache_chain_lock);
+    for (struct linked_list_node *node = cache_chain.next; node != &cache_chain; node = node->next) {
+        struct kmem_cache *cache = container_of(node, struct kmem_cache, list);
+        kprintf("%s\t%u\t%u\t%u\t%u\t%u\t%u\t%u\n",
+                cache->name, cache->size, cache->active_objs,
+                cache->nr_slabs * cache->num, cache->nr_slabs,
+                cache->max_active_objs, cache->nr_allocs, cache->nr_frees);
+    }
+    release_lock_irqrestore(&cache_chain_lock, flags);
+}
@@ -0,0 +1,306 @@
+/**
+ * @file tlb.c
+ * @brief 实现 ASID 分配、进程地址空间切换和 TLB 刷新
+ *
+ * TLB 表项带有 ASID（Address Space Identifier）标签，切换进程时只需将新进程的 ASID
+ * 写入 satp，不必刷新 TLB。内核映射设置了 Global 位，被所有地址空间共享。
+ *
+ * ASID 按代（generation）分配：task_struct::asid 的低 asid_bits 位为 ASID，
+ * 高位为分配时的代号。当前代的 ASID 用完后代号加 1 并刷新整个 TLB，
+ * 旧代的 ASID 全部失效，进程下次被调度时重新分配。ASID 0 保留给启动阶段使用。
+ *
+ * 处理器不支持 ASID 时（asid_bits 为 0），每次切换都刷新整个 TLB。
+ *
+ * 修改页表后按需刷新：用户地址只刷新当前 ASID 的表项，内核地址（全局映射）
+ * 刷新所有 ASID 的表项。批量修改页表时使用 struct mmu_gather 合并刷新。
+ *
+ * 多处理器：
+ * - ASID 分配器由 asid_lock 保护，代号全局共享。每个处理器记录自己 TLB 中的代号，
+ *   切换进程时发现代号已更新则先刷新本地 TLB，因此开始新的一代不需要通知其他处理器
+ * - 一个进程同一时刻只在一个处理器上运行，用户地址只刷新本地 TLB；进程迁移到另一个处理器后
+ *   第一次运行时刷新它的 ASID，清除它上一次在该处理器上运行时留下的、可能已过时的表项
+ * - 内核映射被所有处理器共享，修改后通过 SBI RFENCE 扩展刷新其他处理器的 TLB
+ */
+#include <kdebug.h>
+#include <mm.h>
+#include <riscv.h>
+#include <sbi.h>
+#include <sched.h>
+#include <smp.h>
+#include <utils/atomic.h>
+
+/** 处理器实现的 ASID 位数 */
+static uint64_t asid_bits;
+
+/** 当前代号（位于 ASID 之上的高位） */
+static uint64_t asid_generation;
+
+/** 当前代下一个可分配的 ASID */
+static uint64_t next_asid;
+
+/** 保护 asid_generation、next_asid */
+static struct spinlock asid_lock;
+
+/**
+ * @brief 探测处理器实现的 ASID 位数并初始化 ASID 分配器
+ *
+ * satp.ASID 是 WARL 字段，向其写入全 1 后读回，实现的位保持为 1。
+ *
+ * @note 必须在开启分页后调用
+ */
+void asid_init()
+{
+    uint64_t satp = read_csr(satp);
+    write_csr(satp, satp | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    uint64_t asid = (read_csr(satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    write_csr(satp, satp);
+    flush_tlb_all();
+    for (asid_bits = 0; asid & 1; asid >>= 1)
+        ++asid_bits;
+    asid_generation = 1UL << asid_bits;
+    next_asid = 1;
+    init_lock(&asid_lock, "asid");
+    kprintf("asid_init(): %u ASID bits\n", asid_bits);
+}
+
+/**
+ * @brief 为进程分配当前代的 ASID
+ *
+ * 当前代的 ASID 用完时开始新的一代。旧代 ASID 的表项由各处理器在
+ * switch_mm() 中发现代号更新后自行刷新。
+ *
+ * @param task 进程控制块
+ * @note 调用者持有 asid_lock
+ */
+static void new_context(struct task_struct *task)
+{
+    if (next_asid >> asid_bits) {
+        asid_generation += 1UL << asid_bits;
+        next_asid = 1;
+    }
+    task->asid = asid_generation | next_asid++;
+}
+
+/**
+ * @brief 切换到进程 task 的地址空间
+ *
+ * ASID 属于当前代时直接写入 satp，不刷新 TLB；否则重新分配 ASID。
+ * 本处理器的 TLB 属于旧代时刷新整个 TLB；进程上一次运行在其他处理器上时刷新它的 ASID。
+ *
+ * @param task 进程控制块
+ * @note 置位 status 寄存器 SUM 标志位，允许内核读写用户态内存
+ */
+void switch_mm(struct task_struct *task)
+{
+    struct cpu *cpu = this_cpu();
+    uint64_t migrated = task->last_cpu != cpu;
+    task->last_cpu = cpu;
+    set_csr(sstatus, SSTATUS_PUM);
+    uint64_t ppn = PHYSICAL((uint64_t)task->pg_dir) >> 12;
+    if (!asid_bits) {
+        write_csr(satp, SATP_MODE_SV39 | ppn);
+        flush_tlb_all();
+        return;
+    }
+    acquire_lock(&asid_lock);
+    if ((task->asid ^ asid_generation) >> asid_bits)
+        new_context(task);
+    uint64_t generation = asid_generation;
+    release_lock(&asid_lock);
+    uint64_t asid = task->asid & ((1UL << asid_bits) - 1);
+    write_csr(satp, SATP_MODE_SV39 | (asid << SATP_ASID_SHIFT) | ppn);
+    if (cpu->asid_generation != generation) {
+        cpu->asid_generation = generation;
+        flush_tlb_all();
+    } else if (migrated) {
+        flush_tlb_asid(asid);
+    }
+}
+
+/**
+ * @brief 获取当前地址空间的 ASID
+ */
+static inline uint64_t current_asid()
+{
+    return (read_csr(satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+}
+
+/**
+ * @brief 刷新整个 TLB，包括全局映射
+ */
+void flush_tlb_all()
+{
+    __asm__ __volatile__("sfence.vma zero, zero\n\t" ::: "memory");
+}
+
+/**
+ * @brief 刷新某一 ASID 的全部非全局表项
+ *
+ * @param asid 地址空间标识符
+ */
+void flush_tlb_asid(uint64_t asid)
+{
+    __asm__ __volatile__("sfence.vma zero, %0\n\t" ::"r"(asid) : "memory");
+}
+
+/**
+ * @brief 刷新本处理器 TLB 中虚拟地址 addr 所在页的表项
+ */
+static inline void local_flush_tlb_page(uint64_t addr)
+{
+    if (IS_USER(addr, addr + 1))
+        __asm__ __volatile__("sfence.vma %0, %1\n\t"
+                             ::"r"(addr), "r"(current_asid()) : "memory");
+    else
+        __asm__ __volatile__("sfence.vma %0, zero\n\t" ::"r"(addr) : "memory");
+}
+
+/**
+ * @brief 刷新当前地址空间中虚拟地址 addr 所在页的表项
+ *
+ * 用户地址只刷新当前 ASID 的表项；内核地址是全局映射，需要刷新所有 ASID 的表项，
+ * 并且刷新其他处理器。
+ *
+ * @param addr 虚拟地址
+ */
+void flush_tlb_page(uint64_t addr)
+{
+    local_flush_tlb_page(addr);
+    if (!IS_USER(addr, addr + 1))
+        smp_flush_tlb_kernel(FLOOR(addr), PAGE_SIZE);
+}
+
+/**
+ * @brief 刷新当前地址空间中虚拟地址区间 [start, end) 的表项
+ *
+ * 区间超过 FLUSH_TLB_MAX_PAGES 页时，逐页刷新不如刷新整个地址空间：
+ * 用户区间刷新当前 ASID，内核区间刷新整个 TLB。内核区间同时刷新其他处理器。
+ *
+ * @param start 起始虚拟地址
+ * @param end 结束虚拟地址
+ */
+void flush_tlb_range(uint64_t start, uint64_t end)
+{
+    start = FLOOR(start);
+    end = CEIL(end);
+    if (!IS_USER(start, end))
+        smp_flush_tlb_kernel(start, end - start);
+    if ((end - start) / PAGE_SIZE > FLUSH_TLB_MAX_PAGES) {
+        if (IS_USER(start, end))
+            flush_tlb_asid(current_asid());
+        else
+            flush_tlb_all();
+        return;
+    }
+    for (; start < end; start += PAGE_SIZE)
+        local_flush_tlb_page(start);
+}
+
+/**
+ * @brief 开始一次批量页表操作
+ *
+ * @param tlb 刷新记录
+ */
+void tlb_gather_init(struct mmu_gather *tlb)
+{
+    tlb->start = -1UL;
+    tlb->end = 0;
+    tlb->nr = 0;
+    tlb->freed_tables = 0;
+}
+
+/**
+ * @brief 记录页表被修改的虚拟地址区间
+ *
+ * @param tlb 刷新记录
+ * @param addr 起始虚拟地址
+ * @param size 字节数
+ */
+void tlb_gather_range(struct mmu_gather *tlb, uint64_t addr, uint64_t size)
+{
+    if (addr < tlb->start)
+        tlb->start = addr;
+    if (addr + size > tlb->end)
+        tlb->end = addr + size;
+}
+
+/**
+ * @brief 刷新记录的区间并释放延迟释放的物理页
+ *
+ * 指定地址的 sfence.vma 只保证刷新叶子页表项，释放了页表时必须用 rs1 = x0 的 sfence.vma
+ * 刷新缓存的非叶子页表项：用户区间刷新当前 ASID，内核区间刷新所有处理器的整个 TLB。
+ */
+static void tlb_gather_flush(struct mmu_gather *tlb)
+{
+    if (tlb->start < tlb->end) {
+        if (!tlb->freed_tables) {
+            flush_tlb_range(tlb->start, tlb->end);
+        } else if (IS_USER(tlb->start, tlb->end)) {
+            flush_tlb_asid(current_asid());
+        } else {
+            flush_tlb_all();
+            smp_flush_tlb_kernel(0, -1UL); /* SBI 规定 size 为 -1 时刷新整个地址空间 */
+        }
+    }
+    while (tlb->nr) {
+        uint64_t page = tlb->pages[--tlb->nr];
+        if (page & 1)
+            put_pg_tb2(page & ~1UL);
+        else
+            free_page(page);
+    }
+    tlb->freed_tables = 0;
+}
+
+/**
+ * @brief 延迟释放解除映射的物理页
+ *
+ * 物理页在刷新 TLB 之后才被释放，记录已满时立即刷新一次。
+ *
+ * @param tlb 刷新记录
+ * @param page 物理地址
+ */
+void tlb_gather_page(struct mmu_gather *tlb, uint64_t page)
+{
+    if (tlb->nr == MMU_GATHER_BATCH)
+        tlb_gather_flush(tlb);
+    tlb->pages[tlb->nr++] = page;
+}
+
+/**
+ * @brief 延迟释放（或减少引用）不再被页表项指向的页表
+ *
+ * 刷新时同时刷新缓存的非叶子页表项。
+ *
+ * @param tlb 刷新记录
+ * @param page 页表的物理地址
+ */
+void tlb_gather_table(struct mmu_gather *tlb, uint64_t page)
+{
+    tlb_gather_page(tlb, page);
+    tlb->freed_tables = 1;
+}
+
+/**
+ * @brief 延迟减少共享的三级页表的引用
+ *
+ * 刷新后调用 put_pg_tb2()，最后一个引用者同时释放页表映射的物理页。
+ *
+ * @param tlb 刷新记录
+ * @param page 三级页表的物理地址
+ */
+void tlb_gather_shared_table(struct mmu_gather *tlb, uint64_t page)
+{
+    tlb_gather_table(tlb, page | 1);
+}
+
+/**
+ * @brief 结束批量页表操作，用一次刷新覆盖全部修改
+ *
+ * @param tlb 刷新记录
+ */
+void tlb_gather_finish(struct mmu_gather *tlb)
+{
+    tlb_gather_flush(tlb);
+    tlb_gather_init(tlb);
+}
@@ -0,0 +1,171 @@
+/**
+ * @file vmalloc.c
+ * @brief 实现内核虚拟内存分配 vmalloc()
+ *
+ * kmalloc() 分配的内存物理上连续，受伙伴系统最大块和内存碎片的限制。
+ * vmalloc() 逐页分配物理页，将它们映射到 vmalloc 映射区 [VMALLOC_START, VMALLOC_END)
+ * 中一段连续的虚拟地址，适用于不要求物理连续的大块内存（如大文件、大表）。
+ *
+ * 每个分配区之后保留一个不映射的保护页，越界访问会触发缺页异常而不是破坏相邻的分配区。
+ * vmalloc 映射区的二级页表在启动时由 map_kernel() 分配并被所有进程共享，
+ * 因此建立映射只修改共享的页表，不需要同步各进程的页目录。
+ *
+ * vmlist_lock 保护分配区链表，建立和解除映射时也持有它，避免多个处理器同时为共享的二级页表分配三级页表。
+ */
+#include <assert.h>
+#include <mm.h>
+#include <stddef.h>
+#include <utils/atomic.h>
+#include <utils/linked_list.h>
+
+/** vmalloc 分配区 */
+struct vm_struct {
+    struct linked_list_node list;   /**< 按地址排序的分配区链表节点 */
+    uint64_t addr;                  /**< 起始虚拟地址 */
+    uint64_t size;                  /**< 大小（字节），包括保护页 */
+    uint64_t nr_pages;              /**< 映射的物理页数 */
+    uint64_t *pages;                /**< 映射的物理页（物理地址） */
+};
+
+/** 按地址排序的分配区链表 */
+static struct linked_list_node vmlist;
+
+/** 保护 vmlist 和 vmalloc 映射区的页表 */
+static struct spinlock vmlist_lock;
+
+/** 分配区描述符缓存 */
+static struct kmem_cache *vm_struct_cache;
+
+/**
+ * @brief 初始化 vmalloc
+ */
+void vmalloc_init()
+{
+    linked_list_init(&vmlist);
+    init_lock(&vmlist_lock, "vmlist");
+    vm_struct_cache = kmem_cache_create("vm_struct", sizeof(struct vm_struct), 0, NULL);
+    assert(vm_struct_cache, "vmalloc_init(): fail to create vm_struct cache");
+}
+
+/**
+ * @brief 在 vmalloc 映射区中分配一段虚拟地址
+ *
+ * 首次适应：在按地址排序的分配区链表中找到第一个足够大的空隙。
+ *
+ * @param area 分配区，size 为需要的大小（包括保护页）
+ * @return 成功返回 0，虚拟地址空间不足返回 -1
+ */
+static int get_vm_area(struct vm_struct *area)
+{
+    uint64_t addr = VMALLOC_START;
+    struct linked_list_node *node;
+    for (node = vmlist.next; node != &vmlist; node = node->next) {
+        struct vm_struct *tmp = container_of(node, struct vm_struct, list);
+        if (tmp->addr - addr >= area->size)
+            break;
+        addr = tmp->addr + tmp->size;
+    }
+    if (VMALLOC_END - addr < area->size)
+        return -1;
+    area->addr = addr;
+    linked_list_insert_before(node, &area->list);
+    return 0;
+}
+
+/**
+ * @brief 查找起始地址为 addr 的分配区
+ *
+ * @param addr 虚拟地址
+ * @return 分配区，不存在时返回 NULL
+ */
+static struct vm_struct *find_vm_area(uint64_t addr)
+{
+    for (struct linked_list_node *node = vmlist.next; node != &vmlist; node = node->next) {
+        struct vm_struct *area = container_of(node, struct vm_struct, list);
+        if (area->addr == addr)
+            return area;
+    }
+    return NULL;
+}
+
+/**
+ * @brief 释放分配区的物理页和描述符
+ *
+ * 调用前必须已经解除映射并刷新 TLB。
+ *
+ * @param area 分配区
+ */
+static void free_vm_area(struct vm_struct *area)
+{
+    for (uint64_t i = 0; i < area->nr_pages; ++i)
+        if (area->pages[i])
+            free_page(area->pages[i]);
+    kfree(area->pages);
+    kmem_cache_free(vm_struct_cache, area);
+}
+
+/**
+ * @brief 分配虚拟地址连续的内核内存
+ *
+ * 物理页不保证连续，也没有被清零。
+ *
+ * @param size 字节数，向上对齐到页
+ * @return 虚拟地址，失败时返回 NULL
+ * @see vfree()
+ */
+void *vmalloc(uint64_t size)
+{
+    size = CEIL(size);
+    if (!size || size > VMALLOC_END - VMALLOC_START)
+        return NULL;
+    struct vm_struct *area = kmem_cache_alloc(vm_struct_cache);
+    if (!area)
+        return NULL;
+    area->nr_pages = size / PAGE_SIZE;
+    area->size = size + PAGE_SIZE;
+    area->pages = kmalloc(area->nr_pages * sizeof(uint64_t));
+    if (!area->pages) {
+        kmem_cache_free(vm_struct_cache, area);
+        return NULL;
+    }
+    uint64_t flags = acquire_lock_irqsave(&vmlist_lock);
+    if (get_vm_area(area)) {
+        release_lock_irqrestore(&vmlist_lock, flags);
+        kfree(area->pages);
+        kmem_cache_free(vm_struct_cache, area);
+        return NULL;
+    }
+    for (uint64_t i = 0; i < area->nr_pages; ++i)
+        area->pages[i] = 0;
+    for (uint64_t i = 0; i < area->nr_pages; ++i) {
+        if (!(area->pages[i] = get_free_page_nozero())) {
+            release_lock_irqrestore(&vmlist_lock, flags);
+            vfree((void *)area->addr);
+            return NULL;
+        }
+        map_range(area->pages[i], area->addr + i * PAGE_SIZE, PAGE_SIZE,
+                  KERN_RW | PAGE_GLOBAL | PAGE_VALID);
+    }
+    release_lock_irqrestore(&vmlist_lock, flags);
+    return (void *)area->addr;
+}
+
+/**
+ * @brief 释放 vmalloc() 分配的内存
+ *
+ * 解除映射并刷新 TLB 之后才释放物理页。
+ *
+ * @param addr vmalloc() 返回的虚拟地址，为 NULL 时什么也不做
+ */
+void vfree(void *addr)
+{
+    if (!addr)
+        return;
+    uint64_t flags = acquire_lock_irqsave(&vmlist_lock);
+    struct vm_struct *area = find_vm_area((uint64_t)addr);
+    assert(area, "vfree(): bad address %p", addr);
+    linked_list_remove(&area->list);
+    free_page_tables(area->addr, area->nr_pages * PAGE_SIZE);
+    release_lock_irqrestore(&vmlist_lock, flags);
+    free_vm_area(area);
+}